@@ -0,0 +1,243 @@
+"""
+This module downloads panoramas in bulk by panorama ID, saving each
+panorama as a JPEG file named by its panorama ID in an output folder,
+or, for large batches, as records of size-capped tar shards.
+Downloads can be spread over multiple worker processes, so that
+decoding and stitching do not hold back the downloading, with a rate
+limiter shared between the processes capping the total request rate.
+The result of each panorama is appended to a JSON lines manifest.
+Batches are resumable: completed panoramas are recorded in a batch
+journal and tiles are checkpointed, both in the output folder, so
+a rerun after a crash continues where the previous run stopped.
+If metrics are being served (see metrics.py), worker processes forward
+theirs to the parent after each panorama.
+Given a memory budget, panoramas are only started while their projected
+peak memory (see memory.py) fits in the budget, together with those
+running, and the peak RSS of each panorama is recorded in the manifest.
+"""
+import json
+import multiprocessing
+import multiprocessing.pool
+import pathlib
+import queue
+import time
+from typing import Iterable, Iterator
+
+import panorama
+from encoding import JpegEncoder
+from hedging import HedgePolicy
+from journal import BatchJournal, TileJournal, write_atomic
+from memory import MemoryBudget, estimate_memory, get_peak_rss, reset_peak_rss
+from metrics import Metrics
+from panorama import PanoramaSettings, get_pil_panorama
+from ratelimit import RateLimiter
+from shards import ShardWriter, read_shard_keys
+from stats import add_observer, get_observers
+
+
+BATCH_JOURNAL_FILENAME = "batch_journal.txt"
+MANIFEST_FILENAME = "manifest.jsonl"
+TILE_JOURNAL_FOLDER = ".tiles"
+PANORAMA_EXTENSION = ".jpg"
+OK = "ok"
+ERROR = "error"
+
+
+# Per-process state of batch workers.
+_hedge = None
+_shards = None
+_metrics = None
+
+
+def _initialise_worker(
+    api: str, rate_limiter: RateLimiter | None, hedge: HedgePolicy | None,
+    folder: pathlib.Path, shard_size: int | None, forward_metrics: bool
+) -> None:
+    # Workers use the parent's tile API and shared rate limiter,
+    # and a per-process copy of the hedge policy. Each worker writes
+    # its own shards, which are complete after every record, so need
+    # not be closed when the pool terminates the worker.
+    global _hedge, _shards, _metrics
+    panorama.PANORAMA_DOWNLOAD_API = api
+    panorama.set_rate_limiter(rate_limiter)
+    _hedge = hedge
+    if shard_size is not None:
+        _shards = ShardWriter(folder, max_size=shard_size)
+    if forward_metrics:
+        _metrics = Metrics()
+        add_observer(_metrics)
+
+
+def _download(
+    panorama_id: str, folder: pathlib.Path, settings: PanoramaSettings,
+    crop_black_edges: bool, hedge: HedgePolicy | None,
+    shards: ShardWriter | None
+) -> dict:
+    # Downloads and saves one panorama, returning its manifest entry.
+    # The peak RSS includes the memory of the process before the
+    # panorama, and of previous panoramas unless reset by the worker.
+    start = time.perf_counter()
+    memory = {
+        "estimated_bytes": estimate_memory(settings, crop_black_edges)}
+    path = folder / f"{panorama_id}{PANORAMA_EXTENSION}"
+    tile_journal = TileJournal(folder / TILE_JOURNAL_FOLDER)
+    try:
+        image = get_pil_panorama(
+            panorama_id, settings, True, crop_black_edges, hedge=hedge,
+            journal=tile_journal)
+        # Written from the encoder's buffer, without copying it to bytes.
+        data = JpegEncoder().encode_view(image)
+        if shards is None:
+            write_atomic(path, data)
+        else:
+            settings = settings or PanoramaSettings()
+            path = shards.write(panorama_id, data, {
+                "panorama_id": panorama_id, "zoom": settings.zoom,
+                "top_left": settings.top_left,
+                "bottom_right": settings.bottom_right,
+                "width": image.width, "height": image.height},
+                PANORAMA_EXTENSION)
+    except Exception as e:
+        return {
+            "panorama_id": panorama_id, "status": ERROR,
+            "error": f"{type(e).__name__}: {e}",
+            "seconds": time.perf_counter() - start, **memory,
+            "peak_rss": get_peak_rss()}
+    return {
+        "panorama_id": panorama_id, "status": OK, "path": str(path),
+        "bytes": data.nbytes, "seconds": time.perf_counter() - start,
+        **memory, "peak_rss": get_peak_rss()}
+
+
+def _download_in_worker(arguments: tuple) -> tuple[dict, dict | None]:
+    # Returns the manifest entry, and the metrics to forward, if any.
+    # The peak RSS is only reset in workers, not in the caller's process.
+    reset_peak_rss()
+    entry = _download(*arguments, _hedge, _shards)
+    return entry, None if _metrics is None else _metrics.take()
+
+
+def _admit(
+    pool: multiprocessing.pool.Pool, tasks: Iterable[tuple],
+    budget: MemoryBudget, processes: int
+) -> Iterator[tuple[dict, dict | None]]:
+    # Starts tasks once their projected peak memory fits in the budget,
+    # at most one per worker, yielding their results as they complete.
+    results = queue.Queue()
+    running = 0
+
+    def take() -> tuple[dict, dict | None]:
+        nonlocal running
+        result = results.get()
+        running -= 1
+        if isinstance(result, BaseException):
+            raise result
+        return result
+
+    for task in tasks:
+        size = estimate_memory(task[2], task[3])
+        # Budget is only released by completed tasks.
+        while running == processes or not budget.acquire(size, 0):
+            yield take()
+
+        def done(result: object, size: int = size) -> None:
+            budget.release(size)
+            results.put(result)
+
+        pool.apply_async(
+            _download_in_worker, (task,), callback=done, error_callback=done)
+        running += 1
+    while running:
+        yield take()
+
+
+def download_batch(
+    panorama_ids: Iterable[str], folder: str | pathlib.Path,
+    settings: PanoramaSettings = None, crop_black_edges: bool = True,
+    processes: int = 1, rate: float = None, burst: int = None,
+    hedge: HedgePolicy = None, shard_size: int = None,
+    memory_budget: int = None
+) -> list[dict]:
+    """
+    Downloads each panorama with the given settings to the output folder,
+    skipping panoramas already downloaded by a previous run into the
+    same folder. Use one output folder per batch job (settings).
+    Panoramas are downloaded by the given number of worker processes.
+    If a rate is given, the total tile requests per second across
+    all processes is limited to it, allowing bursts of `burst` requests.
+    Returns the manifest entries of this run, which are also appended to
+    the manifest file. Failed panoramas are retried on the next run.
+    If a shard size (bytes) is given, panoramas are appended to tar
+    shards of at most that size (see shards.py) in the folder, keyed by
+    panorama ID, instead of being saved as individual files.
+    If a memory budget (bytes) is given, worker processes only start a
+    panorama once its projected peak memory fits in the budget, along
+    with the panoramas running (one is always allowed to run). Manifest
+    entries include the projected peak memory and the measured peak RSS
+    (of the panorama's worker process, reset before each panorama, or
+    with one process, of the calling process so far).
+    """
+    if not isinstance(processes, int) or processes < 1:
+        raise ValueError("Processes must be a positive integer.")
+    if shard_size is not None and (
+        not isinstance(shard_size, int) or shard_size < 1
+    ):
+        raise ValueError("Shard size must be a positive integer.")
+    budget = None if memory_budget is None else MemoryBudget(memory_budget)
+    folder = pathlib.Path(folder)
+    folder.mkdir(parents=True, exist_ok=True)
+    batch_journal = BatchJournal(folder / BATCH_JOURNAL_FILENAME)
+    if shard_size is not None:
+        # Records indexed by a previous run are complete, even if it
+        # stopped before journaling them, so are not written again.
+        for panorama_id in sorted(read_shard_keys(folder)):
+            if panorama_id not in batch_journal:
+                batch_journal.commit(panorama_id)
+    rate_limiter = None if rate is None else RateLimiter(rate, burst)
+    tasks = (
+        (panorama_id, folder, settings, crop_black_edges)
+        for panorama_id in panorama_ids if panorama_id not in batch_journal)
+    metrics = [
+        observer for observer in get_observers()
+        if isinstance(observer, Metrics)]
+    initargs = (
+        panorama.PANORAMA_DOWNLOAD_API, rate_limiter, hedge, folder,
+        shard_size, bool(metrics))
+    entries = []
+    with open(folder / MANIFEST_FILENAME, "a", encoding="utf8") as manifest:
+        def record(entry: dict) -> None:
+            manifest.write(f"{json.dumps(entry)}\n")
+            manifest.flush()
+            if entry["status"] == OK:
+                batch_journal.commit(entry["panorama_id"])
+                TileJournal(folder / TILE_JOURNAL_FOLDER).clear(
+                    entry["panorama_id"])
+            entries.append(entry)
+
+        if processes == 1:
+            previous_rate_limiter = panorama.get_rate_limiter()
+            if rate_limiter is not None:
+                panorama.set_rate_limiter(rate_limiter)
+            shards = None
+            if shard_size is not None:
+                shards = ShardWriter(folder, max_size=shard_size)
+            try:
+                for task in tasks:
+                    record(_download(*task, hedge, shards))
+            finally:
+                panorama.set_rate_limiter(previous_rate_limiter)
+                if shards is not None:
+                    shards.close()
+            return entries
+        with multiprocessing.Pool(
+            processes, _initialise_worker, initargs
+        ) as pool:
+            if budget is None:
+                results = pool.imap_unordered(_download_in_worker, tasks)
+            else:
+                results = _admit(pool, tasks, budget, processes)
+            for entry, snapshot in results:
+                for observer in metrics:
+                    observer.merge(snapshot)
+                record(entry)
+    return entries
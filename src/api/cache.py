@@ -0,0 +1,166 @@
+"""
+This module provides in-memory caching for long-running processes
+which request the same panoramas repeatedly. There are three levels:
+- Raw tiles (bytes), keyed by (panorama ID, zoom, x, y).
+- Stitched panoramas (PIL Images), keyed by panorama ID and settings
+  (see panorama.get_panorama_key).
+- Computed cubemaps (lists of six face images), keyed as panoramas.
+Each level is an LRU cache with a byte budget rather than an item count,
+since a zoom 0 tile and a zoom 5 panorama differ massively in size.
+All operations are thread-safe.
+"""
+import threading
+from collections import OrderedDict
+from dataclasses import dataclass
+from typing import Any, Callable, Hashable
+
+from PIL import Image
+
+
+DEFAULT_TILE_BUDGET = 256 * 1024 ** 2
+DEFAULT_PANORAMA_BUDGET = 512 * 1024 ** 2
+DEFAULT_CUBEMAP_BUDGET = 512 * 1024 ** 2
+
+
+def image_size(image: Image.Image) -> int:
+    """Returns the approximate number of bytes held by a decoded image."""
+    return image.width * image.height * len(image.getbands())
+
+
+def cubemap_size(faces: list[Image.Image]) -> int:
+    """Returns the approximate number of bytes held by cubemap faces."""
+    return sum(map(image_size, faces))
+
+
+@dataclass
+class CacheStatistics:
+    """Snapshot of the hit/miss statistics of a cache level."""
+    hits: int = 0
+    misses: int = 0
+    evictions: int = 0
+    # Current number of items and bytes held.
+    items: int = 0
+    size: int = 0
+
+    @property
+    def hit_rate(self) -> float:
+        """Proportion of lookups which were hits (0 if no lookups)."""
+        lookups = self.hits + self.misses
+        return self.hits / lookups if lookups else 0.0
+
+
+class LRUCache:
+    """
+    Thread-safe least-recently-used cache with a byte budget.
+    The size of each value is determined by the `sizeof` function.
+    Values larger than the entire budget are never stored.
+    """
+
+    def __init__(
+        self, budget: int, sizeof: Callable[[Any], int] = len
+    ) -> None:
+        if not isinstance(budget, int):
+            raise TypeError("Budget must be an integer.")
+        if budget < 0:
+            raise ValueError("Budget must be non-negative.")
+        self._budget = budget
+        self._sizeof = sizeof
+        self._items = OrderedDict()
+        self._size = 0
+        self._lock = threading.Lock()
+        self._statistics = CacheStatistics()
+
+    def get(self, key: Hashable, default: Any = None) -> Any:
+        """Returns the value for the key if cached, else the default."""
+        with self._lock:
+            if key not in self._items:
+                self._statistics.misses += 1
+                return default
+            self._items.move_to_end(key)
+            self._statistics.hits += 1
+            return self._items[key][0]
+
+    def put(self, key: Hashable, value: Any) -> None:
+        """Caches a value, evicting least recently used values if needed."""
+        size = self._sizeof(value)
+        with self._lock:
+            if key in self._items:
+                self._size -= self._items.pop(key)[1]
+            if size > self._budget:
+                return
+            self._items[key] = (value, size)
+            self._size += size
+            while self._size > self._budget:
+                _, (_, evicted_size) = self._items.popitem(last=False)
+                self._size -= evicted_size
+                self._statistics.evictions += 1
+
+    def discard(self, key: Hashable) -> None:
+        """Removes the key from the cache if present."""
+        with self._lock:
+            if key in self._items:
+                self._size -= self._items.pop(key)[1]
+
+    def clear(self) -> None:
+        """Removes all cached values (statistics are kept)."""
+        with self._lock:
+            self._items.clear()
+            self._size = 0
+
+    def statistics(self) -> CacheStatistics:
+        """Returns a snapshot of the cache statistics."""
+        with self._lock:
+            return CacheStatistics(
+                self._statistics.hits, self._statistics.misses,
+                self._statistics.evictions, len(self._items), self._size)
+
+    def __contains__(self, key: Hashable) -> bool:
+        with self._lock:
+            return key in self._items
+
+    def __len__(self) -> int:
+        with self._lock:
+            return len(self._items)
+
+    @property
+    def budget(self) -> int:
+        """Maximum number of bytes held by the cache."""
+        return self._budget
+
+    @property
+    def size(self) -> int:
+        """Number of bytes currently held by the cache."""
+        with self._lock:
+            return self._size
+
+
+class PanoramaCache:
+    """
+    Groups the tile, panorama and cubemap cache levels, each with its
+    own byte budget. Pass an instance to the download functions to
+    enable caching. Cached panoramas and cubemaps are shared between
+    callers, so copy them before modifying them in place.
+    """
+
+    def __init__(
+        self, tile_budget: int = DEFAULT_TILE_BUDGET,
+        panorama_budget: int = DEFAULT_PANORAMA_BUDGET,
+        cubemap_budget: int = DEFAULT_CUBEMAP_BUDGET
+    ) -> None:
+        self.tiles = LRUCache(tile_budget)
+        self.panoramas = LRUCache(panorama_budget, image_size)
+        self.cubemaps = LRUCache(cubemap_budget, cubemap_size)
+
+    def clear(self) -> None:
+        """Clears all cache levels."""
+        self.tiles.clear()
+        self.panoramas.clear()
+        self.cubemaps.clear()
+
+    def statistics(self) -> dict[str, CacheStatistics]:
+        """Returns the statistics of each cache level by name."""
+        return {
+            "tiles": self.tiles.statistics(),
+            "panoramas": self.panoramas.statistics(),
+            "cubemaps": self.cubemaps.statistics()
+        }
@@ -7,12 +7,19 @@
 enum Faces {FRONT, BACK, TOP, BOTTOM, RIGHT, LEFT};
 
 
-void set_cubemap(char* input, int w, int h, char* output);
-void project(
-    char* input, int input_width, int input_height,
-    char* output, int output_width, int output_height,
-    double pitch, double yaw, double fov, char* cubemap = nullptr
-);
+// Kernels exposed with C linkage for use from Python (ctypes).
+extern "C" {
+    // Sets the output to the six faces (in Faces order, each
+    // w/4 x w/4 RGB) of the equirectangular RGB image (w x h).
+    void set_cubemap(char* input, int w, int h, char* output);
+    // The cubemap, if given, is the base of each of the six faces
+    // (in Faces order, each w/4 x w/4 RGB), which need not be adjacent.
+    void project(
+        char* input, int input_width, int input_height,
+        char* output, int output_width, int output_height,
+        double pitch, double yaw, double fov, char** cubemap = nullptr
+    );
+}
 void set_pixel_colour(
     char* input, char* r, int width, int height, int face_x, int face_y,
     Faces face
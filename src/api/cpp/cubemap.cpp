@@ -4,6 +4,7 @@
 #include <algorithm>
 
 #include "conversion.h"
+#include "trace.h"
 
 
 // atan constants
@@ -79,9 +80,10 @@ struct RGB {
 };
 
 
-// Reusable objects for the cubemap processing.
-RGB a, b, c, d;
-Coordinates coordinates;
+// Reusable objects for the cubemap processing (per thread, so that
+// cubemaps can be computed concurrently).
+thread_local RGB a, b, c, d;
+thread_local Coordinates coordinates;
 
 
 // Integer min/max clipping.
@@ -124,9 +126,7 @@ void set_pixel_colour(
     int face_x, int face_y, Faces face
 ) {
     int edge_length = width / 4;
-    int x, y;
-    double theta, phi, u, v;
-    int ui, vi, mu, nu;
+    int x = 0, y = 0;
     switch (face) {
         case FRONT:
             x = face_x + edge_length * 2; y = face_y + edge_length;
@@ -150,7 +150,9 @@ void set_pixel_colour(
 }
 
 
-// Computes an entire cubemap (entirety of all 6 faces).
+// Computes an entire cubemap (entirety of all 6 faces), in four bands
+// of columns (traced if built with tracing): back, left, front with
+// the faces above and below it, and right.
 void set_cubemap(
     char* input, int input_width, int input_height, char* output
 ) {
@@ -158,49 +160,56 @@ void set_cubemap(
     Faces face, face2;
     int start, stop;
     unsigned index;
-    for (int x = 0; x < input_width; ++x) {
-        start = edge_length;
-        stop = edge_length * 2;
-        switch (x / edge_length) {
-            case 0: face = BACK; break;
-            case 1: face = LEFT; break;
-            case 2:
-                start = 0;
-                stop = edge_length * 3;
-                face = FRONT;
-                break;
-            case 3: face = RIGHT;
-        }
-        for (int y = start; y < stop; ++y) {
-            if (y < edge_length) {
-                face2 = BOTTOM; 
-            } else if (y >= edge_length * 2) {
-                face2 = TOP;
-            } else {
-                face2 = face;
-            }
-            switch (face2) {
-                case FRONT:
-                    index = ((y - edge_length) * edge_length + x - edge_length * 2) * 3;
-                    break;
-                case BACK:
-                    index = (edge_length * edge_length + (y - edge_length) * edge_length + x) * 3;
-                    break;
-                case TOP:
-                    index = (2 * edge_length * edge_length + (y - edge_length * 2) * edge_length + x - edge_length * 2) * 3;
+    TRACE_SCOPE(
+        "set_cubemap", TRACE_SIMD, 6 * (int64_t)edge_length * edge_length, 1);
+    for (int band = 0; band < 4; ++band) {
+        TRACE_SCOPE(
+            "set_cubemap band", TRACE_SIMD,
+            (band == 2 ? 3 : 1) * (int64_t)edge_length * edge_length, band);
+        for (int x = band * edge_length; x < (band + 1) * edge_length; ++x) {
+            start = edge_length;
+            stop = edge_length * 2;
+            switch (band) {
+                case 0: face = BACK; break;
+                case 1: face = LEFT; break;
+                case 2:
+                    start = 0;
+                    stop = edge_length * 3;
+                    face = FRONT;
                     break;
-                case BOTTOM:
-                    index = (3 * edge_length * edge_length + y * edge_length + x - edge_length * 2) * 3;
-                    break;
-                case RIGHT:
-                    index = (4 * edge_length * edge_length + (y - edge_length) * edge_length + x - edge_length * 3) * 3;
-                    break;
-                case LEFT:
-                    index = (5 * edge_length * edge_length + (y - edge_length) * edge_length + x - edge_length) * 3;
+                case 3: face = RIGHT;
+            }
+            for (int y = start; y < stop; ++y) {
+                if (y < edge_length) {
+                    face2 = BOTTOM; 
+                } else if (y >= edge_length * 2) {
+                    face2 = TOP;
+                } else {
+                    face2 = face;
+                }
+                switch (face2) {
+                    case FRONT:
+                        index = ((y - edge_length) * edge_length + x - edge_length * 2) * 3;
+                        break;
+                    case BACK:
+                        index = (edge_length * edge_length + (y - edge_length) * edge_length + x) * 3;
+                        break;
+                    case TOP:
+                        index = (2 * edge_length * edge_length + (y - edge_length * 2) * edge_length + x - edge_length * 2) * 3;
+                        break;
+                    case BOTTOM:
+                        index = (3 * edge_length * edge_length + y * edge_length + x - edge_length * 2) * 3;
+                        break;
+                    case RIGHT:
+                        index = (4 * edge_length * edge_length + (y - edge_length) * edge_length + x - edge_length * 3) * 3;
+                        break;
+                    case LEFT:
+                        index = (5 * edge_length * edge_length + (y - edge_length) * edge_length + x - edge_length) * 3;
+                }
+                set_pixel_colour(
+                    input, x, y, edge_length,
+                    input_width, input_height, face2, output + index);
             }
-            set_pixel_colour(
-                input, x, y, edge_length,
-                input_width, input_height, face2, output + index);
         }
     }
 }
@@ -0,0 +1,208 @@
+// Parallel strip JPEG encoder. Each strip is encoded by libjpeg with
+// identical (default) tables and a restart marker after every MCU row.
+// Restart markers reset all entropy coding state, so the scan data of
+// consecutive strips can be concatenated into one valid baseline JPEG,
+// given a restart marker at each joint and the full height in the header.
+#include <algorithm>
+#include <atomic>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <jpeglib.h>
+
+#include "encode.h"
+#include "trace.h"
+
+
+const int CHANNELS = 3;
+// Restart markers cycle through RST0 to RST7.
+const int RESTART_MARKERS = 8;
+// MCU rows per strip. As a multiple of the restart marker cycle, each
+// strip's markers are numbered exactly as in a single-pass encode.
+const int STRIP_MCU_ROWS = 2 * RESTART_MARKERS;
+const int MAX_JPEG_HEIGHT = 65535;
+const unsigned char MARKER = 0xFF;
+const unsigned char SOF0 = 0xC0;
+const unsigned char RST0 = 0xD0;
+const unsigned char SOS = 0xDA;
+const unsigned char EOI = 0xD9;
+
+
+// Encoded strip (complete JPEG), allocated by libjpeg with malloc.
+struct Strip {
+    unsigned char* data = nullptr;
+    unsigned long size = 0;
+    // Offsets of the SOF0 marker and of the scan data.
+    size_t frame = 0, scan = 0;
+};
+
+
+// libjpeg error manager returning control to the encoder on errors,
+// rather than exiting the process (the libjpeg default).
+struct EncodeError {
+    jpeg_error_mgr manager;
+    std::jmp_buf jump;
+};
+
+
+void exit_encode(j_common_ptr info) {
+    std::longjmp(reinterpret_cast<EncodeError*>(info->err)->jump, 1);
+}
+
+
+// Luma sampling factors (horizontal, vertical) by subsampling option.
+const int SAMPLING[3][2] {{1, 1}, {2, 1}, {2, 2}};
+
+
+// Encodes rows [start, start + rows) of the image as a complete JPEG.
+bool encode_strip(
+    const char* input, int width, int start, int rows, int quality,
+    int subsampling, Strip& strip
+) {
+    TRACE_SCOPE("encode_jpeg strip", "libjpeg", (int64_t)width * rows, start);
+    jpeg_compress_struct info;
+    EncodeError error;
+    info.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = exit_encode;
+    if (setjmp(error.jump)) {
+        jpeg_destroy_compress(&info);
+        return false;
+    }
+    jpeg_create_compress(&info);
+    jpeg_mem_dest(&info, &strip.data, &strip.size);
+    info.image_width = width;
+    info.image_height = rows;
+    info.input_components = CHANNELS;
+    info.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&info);
+    jpeg_set_quality(&info, quality, TRUE);
+    info.comp_info[0].h_samp_factor = SAMPLING[subsampling][0];
+    info.comp_info[0].v_samp_factor = SAMPLING[subsampling][1];
+    info.restart_in_rows = 1;
+    jpeg_start_compress(&info, TRUE);
+    while (info.next_scanline < info.image_height) {
+        JSAMPROW row = reinterpret_cast<JSAMPROW>(const_cast<char*>(
+            input + (size_t)(start + info.next_scanline) * width * CHANNELS));
+        jpeg_write_scanlines(&info, &row, 1);
+    }
+    jpeg_finish_compress(&info);
+    jpeg_destroy_compress(&info);
+    return true;
+}
+
+
+// Finds the SOF0 marker and the start of the scan data of a strip.
+bool parse_strip(Strip& strip) {
+    size_t position = 2;
+    while (position + 4 <= strip.size) {
+        if (strip.data[position] != MARKER) {
+            return false;
+        }
+        unsigned char marker = strip.data[position + 1];
+        size_t length = (
+            strip.data[position + 2] << 8 | strip.data[position + 3]);
+        if (marker == SOF0) {
+            strip.frame = position;
+        } else if (marker == SOS) {
+            strip.scan = position + 2 + length;
+            return strip.frame != 0 && strip.size >= strip.scan + 2;
+        }
+        position += 2 + length;
+    }
+    return false;
+}
+
+
+size_t encode_jpeg(
+    const char* input, int width, int height, int quality, int subsampling,
+    int threads, char** output
+) {
+    if (
+        width < 1 || height < 1 || height > MAX_JPEG_HEIGHT
+        || quality < 1 || quality > 100 || subsampling < 0 || subsampling > 2
+    ) {
+        return 0;
+    }
+    int strip_height = STRIP_MCU_ROWS * 8 * SAMPLING[subsampling][1];
+    int count = (height + strip_height - 1) / strip_height;
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min(threads, count);
+    TRACE_SCOPE(
+        "encode_jpeg", "parallel strips", (int64_t)width * height, threads);
+    std::vector<Strip> strips(count);
+    std::atomic<int> next {0};
+    std::atomic<bool> failed {false};
+    auto work = [&] {
+        for (int i = next++; i < count && !failed; i = next++) {
+            int start = i * strip_height;
+            int rows = std::min(strip_height, height - start);
+            if (
+                !encode_strip(
+                    input, width, start, rows, quality, subsampling,
+                    strips[i])
+                || !parse_strip(strips[i])
+            ) {
+                failed = true;
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; ++i) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    size_t size = 0;
+    unsigned char* jpeg = nullptr;
+    if (!failed) {
+        // Headers of the first strip, scan data of all strips (without
+        // EOI), a restart marker between strips, then EOI.
+        size = strips[0].scan + 2 * count;
+        for (const Strip& strip : strips) {
+            size += strip.size - strip.scan - 2;
+        }
+        jpeg = static_cast<unsigned char*>(std::malloc(size));
+    }
+    if (jpeg == nullptr) {
+        // Encoding failed or the JPEG could not be allocated.
+        size = 0;
+    } else {
+        unsigned char* position = jpeg;
+        std::memcpy(position, strips[0].data, strips[0].scan);
+        // Image height of the SOF0 segment (after length and precision).
+        position[strips[0].frame + 5] = height >> 8;
+        position[strips[0].frame + 6] = height & 0xFF;
+        position += strips[0].scan;
+        for (int i = 0; i < count; ++i) {
+            size_t length = strips[i].size - strips[i].scan - 2;
+            std::memcpy(position, strips[i].data + strips[i].scan, length);
+            position += length;
+            *position++ = MARKER;
+            if (i < count - 1) {
+                // Restart marker after the strip's last MCU row.
+                int mcu_rows = (i + 1) * STRIP_MCU_ROWS;
+                *position++ = RST0 + (mcu_rows - 1) % RESTART_MARKERS;
+            } else {
+                *position++ = EOI;
+            }
+        }
+        *output = reinterpret_cast<char*>(jpeg);
+    }
+    for (Strip& strip : strips) {
+        std::free(strip.data);
+    }
+    return size;
+}
+
+
+void free_jpeg(char* data) {
+    std::free(data);
+}
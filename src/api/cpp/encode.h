@@ -0,0 +1,24 @@
+// Parallel JPEG encoding of large images, which are split into
+// horizontal strips encoded concurrently, then joined into one JPEG.
+// Exposed with C linkage for use from Python (ctypes).
+#ifndef ENCODE_H
+#define ENCODE_H
+
+#include <cstddef>
+
+
+extern "C" {
+    // Encodes an RGB image (width x height) as a single baseline JPEG
+    // on `threads` threads (0 for all cores), with the given quality
+    // [1-100] and chroma subsampling (0: 4:4:4, 1: 4:2:2, 2: 4:2:0).
+    // Sets the output to the JPEG data, to be released by free_jpeg,
+    // returning its size, or 0 on failure.
+    size_t encode_jpeg(
+        const char* input, int width, int height, int quality,
+        int subsampling, int threads, char** output
+    );
+    // Releases JPEG data returned by encode_jpeg.
+    void free_jpeg(char* data);
+}
+
+#endif
@@ -0,0 +1,347 @@
+// Native tile fetcher, using libcurl's multi interface to drive all
+// transfers from a single event loop, and libjpeg to decode tiles
+// as soon as they arrive, while the remaining tiles download.
+#include <algorithm>
+#include <chrono>
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <curl/curl.h>
+#include <jpeglib.h>
+
+#include "fetch.h"
+#include "trace.h"
+
+
+// Arena blocks are at least this size (bytes), holding many tiles each.
+const size_t ARENA_BLOCK_SIZE = 1 << 22;
+// Initial buffer size of responses without a known length.
+const size_t INITIAL_TILE_SIZE = 1 << 16;
+const int CHANNELS = 3;
+const auto RETRY_DELAY = std::chrono::milliseconds(1000);
+// Maximum wait (ms) for transfer activity before checking for retries.
+const int POLL_TIMEOUT = 1000;
+
+
+// Bump allocator holding the downloaded tiles, all freed at once.
+class Arena {
+    private:
+        std::vector<std::unique_ptr<char[]>> blocks;
+        size_t used = 0, capacity = 0;
+    public:
+        char* allocate(size_t size);
+};
+
+
+char* Arena::allocate(size_t size) {
+    if (used + size > capacity) {
+        capacity = std::max(size, ARENA_BLOCK_SIZE);
+        blocks.emplace_back(new char[capacity]);
+        used = 0;
+    }
+    char* result = blocks.back().get() + used;
+    used += size;
+    return result;
+}
+
+
+// Download state of a single tile.
+struct Transfer {
+    CURL* handle = nullptr;
+    Arena* arena = nullptr;
+    char* data = nullptr;
+    size_t size = 0, capacity = 0;
+    int retries = 0;
+    // When the transfer is due to (re)start.
+    std::chrono::steady_clock::time_point retry_time;
+};
+
+
+struct Fetch {
+    Arena arena;
+    std::vector<Transfer> transfers;
+    std::string error;
+    // Failed requests retried, across all transfers.
+    int retries = 0;
+};
+
+
+// Appends received data to a transfer, growing its buffer in the arena.
+// The response length is reserved up front where known, so that most
+// tiles are written straight into place with no further copying.
+size_t write_data(char* data, size_t size, size_t count, void* user) {
+    Transfer* transfer = static_cast<Transfer*>(user);
+    size_t length = size * count;
+    size_t required = transfer->size + length;
+    if (required > transfer->capacity) {
+        curl_off_t content_length = -1;
+        curl_easy_getinfo(
+            transfer->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+            &content_length);
+        size_t capacity = std::max({
+            transfer->capacity * 2, required, INITIAL_TILE_SIZE});
+        if (content_length >= 0 && (size_t)content_length >= required) {
+            capacity = content_length;
+        }
+        char* buffer = transfer->arena->allocate(capacity);
+        if (transfer->size) {
+            std::memcpy(buffer, transfer->data, transfer->size);
+        }
+        transfer->data = buffer;
+        transfer->capacity = capacity;
+    }
+    std::memcpy(transfer->data + transfer->size, data, length);
+    transfer->size = required;
+    return length;
+}
+
+
+// libjpeg error manager returning control to the decoder on errors,
+// rather than exiting the process (the libjpeg default).
+struct DecodeError {
+    jpeg_error_mgr manager;
+    std::jmp_buf jump;
+};
+
+
+void exit_decode(j_common_ptr info) {
+    std::longjmp(reinterpret_cast<DecodeError*>(info->err)->jump, 1);
+}
+
+
+// Silences libjpeg warnings (e.g. of corrupt data).
+void ignore_message(j_common_ptr) {}
+
+
+int decode_tile(
+    const char* data, size_t size, char* output, int width, int height,
+    int x, int y
+) {
+    // Traced before setjmp, which must not skip its destructor. Pixels
+    // are unknown until the header is read, so the value is the size.
+    TRACE_SCOPE("decode_tile", "libjpeg", 0, size);
+    jpeg_decompress_struct info;
+    DecodeError error;
+    info.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = exit_decode;
+    error.manager.output_message = ignore_message;
+    if (setjmp(error.jump)) {
+        jpeg_destroy_decompress(&info);
+        return -1;
+    }
+    jpeg_create_decompress(&info);
+    jpeg_mem_src(
+        &info, reinterpret_cast<const unsigned char*>(data), size);
+    jpeg_read_header(&info, TRUE);
+    info.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&info);
+    int columns = std::min(width - x, (int)info.output_width);
+    // Freed by libjpeg, even after an error.
+    JSAMPARRAY row = (*info.mem->alloc_sarray)(
+        reinterpret_cast<j_common_ptr>(&info), JPOOL_IMAGE,
+        info.output_width * CHANNELS, 1);
+    while (info.output_scanline < info.output_height) {
+        int output_y = y + info.output_scanline;
+        if (output_y >= height) {
+            // Remaining rows lie outside the image.
+            break;
+        }
+        jpeg_read_scanlines(&info, row, 1);
+        if (columns > 0) {
+            std::memcpy(
+                output + ((size_t)output_y * width + x) * CHANNELS, row[0],
+                (size_t)columns * CHANNELS);
+        }
+    }
+    // Also aborts the decompression if rows were skipped.
+    jpeg_destroy_decompress(&info);
+    return 0;
+}
+
+
+// Returns the error message of a failed transfer.
+std::string get_transfer_error(CURLcode result, long status) {
+    if (result != CURLE_OK) {
+        return curl_easy_strerror(result);
+    }
+    if (status == 400) {
+        return "400 - Bad Request";
+    }
+    return std::to_string(status) + " - something went wrong.";
+}
+
+
+// Returns when a request may start, waiting at least `delay`, and for
+// a token of the rate limiter (if any).
+std::chrono::steady_clock::time_point get_start_time(
+    ReserveFunction reserve, std::chrono::milliseconds delay
+) {
+    if (reserve == nullptr) {
+        return std::chrono::steady_clock::now() + delay;
+    }
+    // The wait is from when the token is taken, which can be well
+    // after the call, as the reserve function first waits for the GIL.
+    auto wait = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::duration<double>(reserve()));
+    return std::chrono::steady_clock::now() + std::max<
+        std::chrono::microseconds>(delay, wait);
+}
+
+
+Fetch* fetch_tiles(
+    const char* const* urls, int count, int connections, int retries,
+    const int* positions, char* output, int width, int height,
+    ReserveFunction reserve
+) {
+    static std::once_flag initialised;
+    std::call_once(initialised, [] { curl_global_init(CURL_GLOBAL_ALL); });
+    Fetch* fetch = new Fetch();
+    // Sized once, as the transfers are referenced by their handles.
+    fetch->transfers.resize(count);
+    CURLM* multi = curl_multi_init();
+    long max_connections = connections;
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, max_connections);
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, max_connections);
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    for (int i = 0; i < count; ++i) {
+        Transfer& transfer = fetch->transfers[i];
+        transfer.arena = &fetch->arena;
+        transfer.retries = retries;
+        transfer.handle = curl_easy_init();
+        curl_easy_setopt(transfer.handle, CURLOPT_URL, urls[i]);
+        curl_easy_setopt(transfer.handle, CURLOPT_WRITEFUNCTION, write_data);
+        curl_easy_setopt(transfer.handle, CURLOPT_WRITEDATA, &transfer);
+        curl_easy_setopt(transfer.handle, CURLOPT_PRIVATE, &transfer);
+        curl_easy_setopt(transfer.handle, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(
+            transfer.handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+        // Prefer waiting to multiplex over opening another connection.
+        curl_easy_setopt(transfer.handle, CURLOPT_PIPEWAIT, 1L);
+        if (reserve == nullptr) {
+            curl_multi_add_handle(multi, transfer.handle);
+        }
+    }
+    // Transfers waiting to start: failed transfers waiting to be
+    // retried and, if rate limited, the next transfer waiting for its
+    // token (`paced`, until started).
+    std::vector<Transfer*> waiting;
+    int next = reserve == nullptr ? count : 0;
+    Transfer* paced = nullptr;
+    int remaining = count;
+    int running = 0;
+    while (remaining > 0 && fetch->error.empty()) {
+        // Takes tokens for the next transfers one at a time, starting
+        // them once allowed, rather than all at once.
+        while (next < count && paced == nullptr) {
+            Transfer* transfer = &fetch->transfers[next++];
+            transfer->retry_time = get_start_time(
+                reserve, std::chrono::milliseconds(0));
+            if (transfer->retry_time <= std::chrono::steady_clock::now()) {
+                curl_multi_add_handle(multi, transfer->handle);
+            } else {
+                waiting.push_back(transfer);
+                paced = transfer;
+            }
+        }
+        curl_multi_perform(multi, &running);
+        CURLMsg* message;
+        int queued;
+        while (
+            fetch->error.empty()
+            && (message = curl_multi_info_read(multi, &queued))
+        ) {
+            if (message->msg != CURLMSG_DONE) {
+                continue;
+            }
+            Transfer* transfer;
+            long status = 0;
+            curl_easy_getinfo(
+                message->easy_handle, CURLINFO_PRIVATE, &transfer);
+            curl_easy_getinfo(
+                message->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+            CURLcode result = message->data.result;
+            curl_multi_remove_handle(multi, transfer->handle);
+            if (result == CURLE_OK && status == 200) {
+                --remaining;
+                int i = transfer - fetch->transfers.data();
+                if (
+                    output != nullptr
+                    && decode_tile(
+                        transfer->data, transfer->size, output, width, height,
+                        positions[2 * i], positions[2 * i + 1]) != 0
+                ) {
+                    fetch->error = "Tile could not be decoded.";
+                }
+                continue;
+            }
+            if (transfer->retries-- == 0) {
+                fetch->error = get_transfer_error(result, status);
+                continue;
+            }
+            ++fetch->retries;
+            transfer->size = 0;
+            transfer->retry_time = get_start_time(reserve, RETRY_DELAY);
+            waiting.push_back(transfer);
+        }
+        if (!fetch->error.empty()) {
+            break;
+        }
+        // Starts waiting transfers once due, waiting no longer than
+        // until the next one is due.
+        auto now = std::chrono::steady_clock::now();
+        int timeout = POLL_TIMEOUT;
+        for (auto it = waiting.begin(); it != waiting.end();) {
+            if ((*it)->retry_time <= now) {
+                curl_multi_add_handle(multi, (*it)->handle);
+                if (*it == paced) {
+                    paced = nullptr;
+                }
+                it = waiting.erase(it);
+                timeout = 0;
+            } else {
+                auto delay = std::chrono::duration_cast<
+                    std::chrono::milliseconds>((*it)->retry_time - now);
+                timeout = std::min(timeout, (int)delay.count());
+                ++it;
+            }
+        }
+        if (remaining > 0 && timeout > 0) {
+            curl_multi_poll(multi, nullptr, 0, timeout, nullptr);
+        }
+    }
+    for (Transfer& transfer : fetch->transfers) {
+        // Removing a handle not in the multi handle has no effect.
+        curl_multi_remove_handle(multi, transfer.handle);
+        curl_easy_cleanup(transfer.handle);
+        transfer.handle = nullptr;
+    }
+    curl_multi_cleanup(multi);
+    return fetch;
+}
+
+
+const char* fetch_error(const Fetch* fetch) {
+    return fetch->error.empty() ? nullptr : fetch->error.c_str();
+}
+
+
+int fetch_retries(const Fetch* fetch) {
+    return fetch->retries;
+}
+
+
+const char* fetch_tile(const Fetch* fetch, int index, size_t* size) {
+    const Transfer& transfer = fetch->transfers[index];
+    *size = transfer.size;
+    return transfer.data;
+}
+
+
+void free_fetch(Fetch* fetch) {
+    delete fetch;
+}
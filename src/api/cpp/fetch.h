@@ -0,0 +1,49 @@
+// Native tile fetching and decoding, for downloads beyond what
+// Python's asyncio can sustain. Tiles are downloaded concurrently with
+// libcurl's event-driven multi interface into a single arena,
+// optionally decoded with libjpeg straight into a panorama buffer.
+// Exposed with C linkage for use from Python (ctypes).
+#ifndef FETCH_H
+#define FETCH_H
+
+#include <cstddef>
+
+
+// Result of downloading a set of tiles (opaque to callers).
+struct Fetch;
+// Takes a request token of a rate limiter, returning the seconds to wait
+// until the request is allowed.
+typedef double (*ReserveFunction)();
+
+
+extern "C" {
+    // Downloads the tiles at the given URLs, over at most `connections`
+    // connections (multiplexed if HTTP/2), retrying each failed tile up
+    // to `retries` times. If `output` is given, each tile is decoded on
+    // arrival into the RGB image (width x height) at its pixel position
+    // (positions[2i], positions[2i+1]). If `reserve` is given, every
+    // request (including retries) takes a token from it first, and is
+    // only started once allowed, one token being taken at a time.
+    // Never returns null.
+    Fetch* fetch_tiles(
+        const char* const* urls, int count, int connections, int retries,
+        const int* positions, char* output, int width, int height,
+        ReserveFunction reserve
+    );
+    // Returns the error message of a failed fetch, or null on success.
+    const char* fetch_error(const Fetch* fetch);
+    // Returns the number of failed requests that were retried.
+    int fetch_retries(const Fetch* fetch);
+    // Returns the downloaded bytes of a tile, setting their size.
+    const char* fetch_tile(const Fetch* fetch, int index, size_t* size);
+    // Releases a fetch, including the arena holding its tiles.
+    void free_fetch(Fetch* fetch);
+    // Decodes a JPEG into the RGB image (width x height) at (x, y),
+    // clipped to the image bounds. Returns 0 on success, else -1.
+    int decode_tile(
+        const char* data, size_t size, char* output, int width, int height,
+        int x, int y
+    );
+}
+
+#endif
@@ -1,17 +1,17 @@
 // C++ implementation for projection rendering, including
 // a Matrix class implementation
 // with only the required matrix operations implemented.
-
-// Uncomment this line to include displaying to console for debugging only.
-// #define DEBUG
-#ifdef DEBUG
-    #include <iostream>
-#endif
+// Calls and bands of rows are traced if built with tracing (trace.h).
 #include <algorithm>
 #include <cmath>
 #include <memory>
 
 #include "conversion.h"
+#include "trace.h"
+
+
+// Output rows per traced band.
+const int PROJECT_BAND_ROWS = 64;
 
 
 // Very simple matrix class containing only required matrix operations.
@@ -24,10 +24,6 @@ class Matrix {
         Matrix(unsigned, unsigned, double* initial, unsigned initial_count);
         // Retrieve value at (row, column) [0-indexed].
         inline double& operator()(unsigned row, unsigned column) const;
-        // Output for debugging.
-        #ifdef DEBUG
-            friend std::ostream& operator <<(std::ostream&, const Matrix&);
-        #endif
 };
 
 
@@ -55,19 +51,6 @@ double& Matrix::operator()(unsigned row, unsigned column = 0) const {
 };
 
 
-#ifdef DEBUG
-std::ostream& operator <<(std::ostream& output, const Matrix& matrix) {
-    for (int row = 0; row < matrix.rows; ++row) {
-        for (int column = 0; column < matrix.columns; ++column) {
-            output << matrix(row, column) << ' ';
-        }
-        output << '\n';
-    }
-    return output;
-};
-#endif
-
-
 // Returns the 3x3 transformation matrix for a given
 // pitch and yaw angle for a camera at the origin.
 // This matrix transforms from camera to world coordinates.
@@ -95,7 +78,7 @@ inline double clip(double value, double min, double max) {
 inline void set_output_pixel(
     char* input, int input_width, int input_height,
     int x, int y, char* output, int width,
-    const Matrix& direction, int face_length, char* cubemap = nullptr
+    const Matrix& direction, int face_length, char** cubemap = nullptr
 ) {
     int half_face_length = face_length / 2;
     double x1, y1, z1, abs_max, abs_x, abs_y, abs_z;
@@ -150,18 +133,17 @@ inline void set_output_pixel(
             z1 = round(clip(z1, -half_face_length, half_face_length - 1));
             y2 = y1 + half_face_length; x2 = z1 + half_face_length;
     }
-    unsigned index = (y * width + (width - x)) * 3;
+    unsigned index = (y * width + (width - 1 - x)) * 3;
     if (cubemap == nullptr) {
         // Pre-built cubemap unavailable, compute pixel.
         set_pixel_colour(
             input, output + index, input_width, input_height, x2, y2, face);
     } else {
         // Use pre-built cubemap result..
-        unsigned cubemap_index = (
-            face * face_length * face_length + y2 * face_length + x2) * 3;
-        output[index] = cubemap[cubemap_index];
-        output[index + 1] = cubemap[cubemap_index + 1];
-        output[index + 2] = cubemap[cubemap_index + 2];
+        const char* pixel = cubemap[face] + (y2 * face_length + x2) * 3;
+        output[index] = pixel[0];
+        output[index + 1] = pixel[1];
+        output[index + 2] = pixel[2];
     }
 }
 
@@ -171,7 +153,7 @@ inline void set_output_pixel(
 void project(
     char* input, int input_width, int input_height,
     char* output, int output_width, int output_height,
-    double pitch, double yaw, double fov, char* cubemap
+    double pitch, double yaw, double fov, char** cubemap
 ) {
     int face_length = input_width / 4;
     // Conversions converting pitch angle to be CW,
@@ -182,23 +164,37 @@ void project(
     Matrix direction {3, 1};
     double fov_constant =  1 / tan(fov * M_PI / 360);
     double x1, y1, prev_x;
+    // Whether pixels are looked up in a pre-built cubemap, or computed
+    // (only used by tracing).
+    [[maybe_unused]] const char* path = (
+        cubemap == nullptr ? "computed" : "cubemap lookup");
+    TRACE_SCOPE("project", path, (int64_t)output_width * output_height, 1);
     // Performance optimisation - use same direction matrix object
     // adjusting it as required per pixel.
-    for (int y = 0; y < output_height; ++y) {
-        y1 = ((double)y * 2 / output_height - 1) / fov_constant;
-        direction(0) = y1 * transform_matrix(0, 1) - transform_matrix(0, 2);
-        direction(1) = y1 * transform_matrix(1, 1) - transform_matrix(1, 2);
-        direction(2) = y1 * transform_matrix(2, 1) - transform_matrix(2, 2);
-        prev_x = 0;
-        for (int x = 0; x < output_width; ++x) {
-            x1 = ((double)x * 2 / output_width - 1) / fov_constant;
-            direction(0) += (x1 - prev_x) * transform_matrix(0);
-            direction(1) += (x1 - prev_x) * transform_matrix(1);
-            direction(2) += (x1 - prev_x) * transform_matrix(2);
-            set_output_pixel(
-                input, input_width, input_height,
-                x, y, output, output_width, direction, face_length, cubemap);
-            prev_x = x1;
+    for (int band = 0; band < output_height; band += PROJECT_BAND_ROWS) {
+        int band_end = std::min(band + PROJECT_BAND_ROWS, output_height);
+        TRACE_SCOPE(
+            "project band", path, (int64_t)output_width * (band_end - band),
+            band / PROJECT_BAND_ROWS);
+        for (int y = band; y < band_end; ++y) {
+            y1 = ((double)y * 2 / output_height - 1) / fov_constant;
+            direction(0) = (
+                y1 * transform_matrix(0, 1) - transform_matrix(0, 2));
+            direction(1) = (
+                y1 * transform_matrix(1, 1) - transform_matrix(1, 2));
+            direction(2) = (
+                y1 * transform_matrix(2, 1) - transform_matrix(2, 2));
+            prev_x = 0;
+            for (int x = 0; x < output_width; ++x) {
+                x1 = ((double)x * 2 / output_width - 1) / fov_constant;
+                direction(0) += (x1 - prev_x) * transform_matrix(0);
+                direction(1) += (x1 - prev_x) * transform_matrix(1);
+                direction(2) += (x1 - prev_x) * transform_matrix(2);
+                set_output_pixel(
+                    input, input_width, input_height, x, y, output,
+                    output_width, direction, face_length, cubemap);
+                prev_x = x1;
+            }
         }
     }
 }
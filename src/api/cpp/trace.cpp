@@ -0,0 +1,156 @@
+// Per-thread trace buffers (see trace.h). Each thread records into its
+// own single-producer single-consumer ring buffer, without locks (but
+// for acquiring a buffer on its first event), dropping events while its
+// buffer is full. The host drains all buffers, one drain at a time.
+// Buffers are never freed: those of exited threads are reused.
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <pthread.h>
+#endif
+
+#include "trace.h"
+
+
+uint64_t trace_clock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+#ifdef NATIVE_TRACE
+
+// Events per thread buffer (a power of 2).
+const uint64_t TRACE_BUFFER_EVENTS = 4096;
+
+
+std::atomic<bool> trace_enabled {false};
+std::atomic<uint64_t> dropped {0};
+
+
+struct TraceBuffer {
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+    // Written by the recording thread only.
+    std::atomic<uint64_t> head {0};
+    // Written by the draining thread only.
+    std::atomic<uint64_t> tail {0};
+    // Whether a (live) thread records into the buffer.
+    std::atomic<bool> owned {true};
+};
+
+
+// All buffers, guarded by the mutex, which also serialises draining.
+std::mutex buffers_mutex;
+std::vector<TraceBuffer*> buffers;
+
+
+// Releases the buffer of a thread when it exits, for reuse.
+struct TraceBufferOwner {
+    TraceBuffer* buffer = nullptr;
+
+    ~TraceBufferOwner() {
+        if (buffer != nullptr) {
+            buffer->owned.store(false, std::memory_order_release);
+        }
+    }
+};
+thread_local TraceBufferOwner owner;
+
+
+// Returns a buffer released by an exited thread, or a new buffer.
+TraceBuffer* acquire_buffer() {
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    for (TraceBuffer* buffer : buffers) {
+        bool owned = false;
+        if (buffer->owned.compare_exchange_strong(
+            owned, true, std::memory_order_acquire
+        )) {
+            return buffer;
+        }
+    }
+    buffers.push_back(new TraceBuffer);
+    return buffers.back();
+}
+
+
+uint64_t get_thread_id() {
+    #ifdef _WIN32
+        return GetCurrentThreadId();
+    #else
+        return (uint64_t)pthread_self();
+    #endif
+}
+
+
+void trace_record(TraceEvent& event) {
+    if (owner.buffer == nullptr) {
+        owner.buffer = acquire_buffer();
+    }
+    TraceBuffer* buffer = owner.buffer;
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    if (
+        head - buffer->tail.load(std::memory_order_acquire)
+        >= TRACE_BUFFER_EVENTS
+    ) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    event.thread = get_thread_id();
+    buffer->events[head % TRACE_BUFFER_EVENTS] = event;
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+
+int trace_available() {
+    return 1;
+}
+
+
+void set_trace(int enabled) {
+    trace_enabled.store(enabled != 0, std::memory_order_relaxed);
+}
+
+
+size_t drain_trace(TraceEvent* events, size_t capacity) {
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    size_t count = 0;
+    for (TraceBuffer* buffer : buffers) {
+        uint64_t tail = buffer->tail.load(std::memory_order_relaxed);
+        uint64_t head = buffer->head.load(std::memory_order_acquire);
+        while (tail < head && count < capacity) {
+            events[count++] = buffer->events[tail++ % TRACE_BUFFER_EVENTS];
+        }
+        buffer->tail.store(tail, std::memory_order_release);
+    }
+    return count;
+}
+
+
+uint64_t trace_dropped() {
+    return dropped.load(std::memory_order_relaxed);
+}
+
+#else
+
+int trace_available() {
+    return 0;
+}
+
+
+void set_trace(int) {}
+
+
+size_t drain_trace(TraceEvent*, size_t) {
+    return 0;
+}
+
+
+uint64_t trace_dropped() {
+    return 0;
+}
+
+#endif
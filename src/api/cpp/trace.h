@@ -0,0 +1,103 @@
+// Compile-time tracing of the native kernels. Built with NATIVE_TRACE
+// defined (-DNATIVE_TRACE), TRACE_SCOPE records the duration of its
+// enclosing scope, with a pixel count, the code path taken and a value
+// (such as a thread count or band number), into a lock-free buffer of
+// the recording thread, which the host drains (drain_trace). Otherwise
+// the macro compiles to nothing, not even evaluating its arguments.
+// Even when built, nothing is recorded until the host enables it.
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstddef>
+#include <cstdint>
+
+
+// A recorded scope. Names and paths are string literals.
+struct TraceEvent {
+    const char* name;
+    const char* path;
+    // Trace clock (see trace_clock) nanoseconds.
+    uint64_t start;
+    uint64_t duration;
+    int64_t pixels;
+    int64_t value;
+    // As Python's threading.get_ident().
+    uint64_t thread;
+};
+
+
+extern "C" {
+    // Returns 1 if the library was built with tracing, else 0.
+    int trace_available();
+    // Enables (1) or disables (0) recording.
+    void set_trace(int enabled);
+    // Returns the time of the trace clock (steady, nanoseconds).
+    uint64_t trace_clock();
+    // Moves up to `capacity` recorded events (of all threads) into
+    // `events`, returning the number moved.
+    size_t drain_trace(TraceEvent* events, size_t capacity);
+    // Returns the number of events dropped, their thread's buffer
+    // being full (not drained in time).
+    uint64_t trace_dropped();
+}
+
+
+// Vector instruction set the kernels were compiled (auto-vectorised) for.
+#if defined(__AVX512F__)
+    #define TRACE_SIMD "avx512"
+#elif defined(__AVX2__)
+    #define TRACE_SIMD "avx2"
+#elif defined(__SSE2__) || defined(_M_X64)
+    #define TRACE_SIMD "sse2"
+#elif defined(__ARM_NEON)
+    #define TRACE_SIMD "neon"
+#else
+    #define TRACE_SIMD "scalar"
+#endif
+
+
+#ifdef NATIVE_TRACE
+
+#include <atomic>
+
+
+extern std::atomic<bool> trace_enabled;
+// Records an event into the current thread's buffer.
+void trace_record(TraceEvent& event);
+
+
+// Records the duration of its scope, if recording when constructed.
+class TraceScope {
+    private:
+        TraceEvent event;
+        bool active;
+    public:
+        TraceScope(
+            const char* name, const char* path, int64_t pixels, int64_t value
+        ) : active(trace_enabled.load(std::memory_order_relaxed)) {
+            if (active) {
+                event = {name, path, trace_clock(), 0, pixels, value, 0};
+            }
+        }
+        ~TraceScope() {
+            if (active) {
+                event.duration = trace_clock() - event.start;
+                trace_record(event);
+            }
+        }
+};
+
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name, path, pixels, value) \
+    TraceScope TRACE_CONCAT(trace_scope_, __LINE__) { \
+        name, path, (int64_t)(pixels), (int64_t)(value)}
+
+#else
+
+#define TRACE_SCOPE(name, path, pixels, value) ((void)0)
+
+#endif
+
+#endif
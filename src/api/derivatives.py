@@ -0,0 +1,107 @@
+"""
+This module produces several derivatives of a panorama (for example,
+the full image, a preview and a thumbnail) in one pass: the panorama is
+downloaded and decoded once, successive half-size levels are built from
+it, each by Pillow's 2x2 box reduction of the level above, and each
+derivative is resized from the smallest level still at least its size.
+Derivatives are encoded concurrently as soon as their level is built.
+"""
+import os
+from concurrent.futures import ThreadPoolExecutor
+from dataclasses import dataclass
+
+from PIL import Image
+
+from cache import PanoramaCache
+from encoding import Encoder, JpegEncoder
+from hedging import HedgePolicy
+from journal import TileJournal
+from panorama import PanoramaSettings, get_pil_panorama
+
+
+LANCZOS = Image.Resampling.LANCZOS
+
+
+@dataclass(frozen=True)
+class Derivative:
+    """
+    A derivative image, scaled down (never up) so that its longest side
+    is at most max_size pixels (None for full size), encoded by the
+    encoder (JPEG by default).
+    """
+    name: str
+    max_size: int | None = None
+    encoder: Encoder = None
+
+    def __post_init__(self) -> None:
+        if self.max_size is not None and (
+            not isinstance(self.max_size, int) or self.max_size < 1
+        ):
+            raise ValueError("Max size must be a positive integer or None.")
+
+    def get_size(self, size: tuple[int, int]) -> tuple[int, int]:
+        """Returns the size of the derivative of an image of a size."""
+        width, height = size
+        if self.max_size is None or max(width, height) <= self.max_size:
+            return size
+        scale = self.max_size / max(width, height)
+        return (
+            max(1, round(width * scale)), max(1, round(height * scale)))
+
+
+DEFAULT_DERIVATIVES = (
+    Derivative("full"), Derivative("preview", 1024),
+    Derivative("thumbnail", 256))
+
+
+def _encode(image: Image.Image, derivative: Derivative) -> bytes:
+    # Resizes a level to the size of a derivative, then encodes it.
+    size = derivative.get_size(image.size)
+    if size != image.size:
+        image = image.resize(size, LANCZOS)
+    return (derivative.encoder or JpegEncoder()).encode(image)
+
+
+def get_derivatives(
+    image: Image.Image, derivatives: tuple[Derivative, ...] = (
+        DEFAULT_DERIVATIVES), threads: int = 0
+) -> dict[str, bytes]:
+    """
+    Returns the encoded derivatives of an image by name, encoded on the
+    given number of threads (0 for all cores).
+    """
+    names = [derivative.name for derivative in derivatives]
+    if len(set(names)) != len(names):
+        raise ValueError("Derivative names must be unique.")
+    # Decoded once, before any thread reads it.
+    image.load()
+    # Largest first, so that each level is built once, from the last.
+    order = sorted(
+        derivatives, key=lambda derivative: derivative.get_size(image.size),
+        reverse=True)
+    with ThreadPoolExecutor(threads or os.cpu_count()) as executor:
+        futures = {}
+        level = image
+        for derivative in order:
+            width, height = derivative.get_size(image.size)
+            while level.width // 2 >= width and level.height // 2 >= height:
+                level = level.reduce(2)
+            futures[derivative.name] = executor.submit(
+                _encode, level, derivative)
+        return {name: futures[name].result() for name in names}
+
+
+def download_derivatives(
+    panorama_id: str, settings: PanoramaSettings = None,
+    derivatives: tuple[Derivative, ...] = DEFAULT_DERIVATIVES,
+    crop_black_edges: bool = True, cache: PanoramaCache = None,
+    hedge: HedgePolicy = None, journal: TileJournal = None,
+    threads: int = 0
+) -> dict[str, bytes]:
+    """
+    Downloads a panorama once and returns its encoded derivatives by
+    name (see get_derivatives).
+    """
+    image = get_pil_panorama(
+        panorama_id, settings, True, crop_black_edges, cache, hedge, journal)
+    return get_derivatives(image, derivatives, threads)
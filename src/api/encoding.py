@@ -0,0 +1,358 @@
+"""
+This module encodes output images. Large JPEGs are encoded by
+the native encoder (see native.py) if it is built, which splits the
+image into horizontal strips encoded in parallel on all cores,
+joined into a single baseline JPEG. Otherwise, PIL is used.
+Other formats (WebP, AVIF and, if pillow-jxl-plugin is installed,
+JPEG XL) are available as pluggable encoders, each with speed/effort
+presets trading encode time for smaller files.
+Encoded images can be returned as a view of the encoder's buffer,
+or written from it straight to a file, mmap or socket (a sink),
+rather than copied into new bytes first.
+"""
+import functools
+import io
+import os
+import socket
+from typing import BinaryIO
+
+from PIL import Image, features
+
+from stats import STAGE_ENCODE, stage
+
+try:
+    # Registers JPEG XL support with PIL.
+    import pillow_jxl
+except ImportError:
+    pillow_jxl = None
+
+
+DEFAULT_QUALITY = 75
+# Chroma subsampling options, numbered as by PIL.
+SUBSAMPLING_444 = 0
+SUBSAMPLING_422 = 1
+SUBSAMPLING_420 = 2
+SUBSAMPLING = (SUBSAMPLING_444, SUBSAMPLING_422, SUBSAMPLING_420)
+DEFAULT_SUBSAMPLING = SUBSAMPLING_420
+# Smaller images are encoded by PIL, not being worth parallelising
+# (the pixels must first be copied out of PIL for the native encoder).
+PARALLEL_MIN_PIXELS = 2048 * 1024
+# Encoder presets, from fastest to smallest output.
+PRESET_FAST = "fast"
+PRESET_BALANCED = "balanced"
+PRESET_SMALL = "small"
+PRESETS = (PRESET_FAST, PRESET_BALANCED, PRESET_SMALL)
+DEFAULT_PRESET = PRESET_BALANCED
+WEBP_MAX_SIZE = 16383
+
+
+def validate_jpeg_options(quality: int, subsampling: int) -> None:
+    """Raises an error if the JPEG quality or subsampling is invalid."""
+    if not isinstance(quality, int):
+        raise TypeError("Quality must be an integer.")
+    if not 1 <= quality <= 100:
+        raise ValueError("Quality must be between 1 and 100.")
+    if subsampling not in SUBSAMPLING:
+        raise ValueError(f"Subsampling must be one of: {SUBSAMPLING}")
+
+
+def write_output(
+    data: bytes | memoryview, sink: int | socket.socket | BinaryIO
+) -> int:
+    """
+    Writes encoded data to a sink without copying it: a file descriptor,
+    a socket, or a binary file-like object, such as an open file or a
+    writable mmap (written at its position, raising ValueError if the
+    data does not fit). Returns the number of bytes written.
+    """
+    view = memoryview(data).cast("B")
+    if isinstance(sink, socket.socket):
+        sink.sendall(view)
+        return view.nbytes
+    if isinstance(sink, int):
+        write = functools.partial(os.write, sink)
+    elif hasattr(sink, "write"):
+        write = sink.write
+    else:
+        raise TypeError(
+            "Sink must be a file descriptor, a socket or a file object.")
+    written = 0
+    while written < view.nbytes:
+        # Unbuffered files and descriptors may write only part.
+        count = write(view[written:])
+        if count is None:
+            raise BlockingIOError("Sink is not ready for writing.")
+        written += count
+    return written
+
+
+def _use_native_jpeg(image: Image.Image, threads: int) -> bool:
+    # Whether a JPEG is worth encoding in parallel (natively).
+    # Imported here to avoid a circular import.
+    import native
+    return (
+        threads > 1 and image.width * image.height >= PARALLEL_MIN_PIXELS
+        and native.is_available())
+
+
+def encode_jpeg(
+    image: Image.Image, quality: int = DEFAULT_QUALITY,
+    subsampling: int = DEFAULT_SUBSAMPLING, threads: int = 0
+) -> bytes:
+    """
+    Encodes an image as a baseline JPEG with the given quality [1-100]
+    and chroma subsampling (SUBSAMPLING_444, _422 or _420).
+    Large images are encoded on the given number of threads
+    (0 for all cores) if the native library is built.
+    """
+    validate_jpeg_options(quality, subsampling)
+    threads = threads or os.cpu_count() or 1
+    if _use_native_jpeg(image, threads):
+        return bytes(
+            encode_jpeg_view(image, quality, subsampling, threads))
+    with stage(STAGE_ENCODE), io.BytesIO() as f:
+        image.save(
+            f, format="jpeg", quality=quality, subsampling=subsampling)
+        return f.getvalue()
+
+
+def encode_jpeg_view(
+    image: Image.Image, quality: int = DEFAULT_QUALITY,
+    subsampling: int = DEFAULT_SUBSAMPLING, threads: int = 0
+) -> memoryview:
+    """
+    As encode_jpeg, but returns a view of the encoder's output buffer
+    rather than a copy, for example to pass to write_output.
+    """
+    validate_jpeg_options(quality, subsampling)
+    threads = threads or os.cpu_count() or 1
+    if _use_native_jpeg(image, threads):
+        # Imported here to avoid a circular import.
+        import native
+        with stage(STAGE_ENCODE):
+            return native.encode_jpeg_view(
+                image, quality, subsampling, threads)
+    f = io.BytesIO()
+    with stage(STAGE_ENCODE):
+        image.save(
+            f, format="jpeg", quality=quality, subsampling=subsampling)
+    # Keeps the buffer alive (and unresizable) while viewed.
+    return f.getbuffer()
+
+
+class Encoder:
+    """
+    Base class of output encoders, each for one format.
+    Quality [1-100] is on the codec's own scale (the same number
+    does not give the same visual quality in each format).
+    The preset sets the codec's speed/effort, and threads (0 for all
+    cores) caps the threads used, if the codec encodes in parallel.
+    """
+    # Set by subclasses.
+    name = None
+    extension = None
+    default_quality = DEFAULT_QUALITY
+    # Codec save options of each preset.
+    preset_options = {preset: {} for preset in PRESETS}
+
+    def __init__(
+        self, quality: int = None, preset: str = DEFAULT_PRESET,
+        threads: int = 0
+    ) -> None:
+        if quality is None:
+            quality = self.default_quality
+        if not isinstance(quality, int):
+            raise TypeError("Quality must be an integer.")
+        if not 1 <= quality <= 100:
+            raise ValueError("Quality must be between 1 and 100.")
+        if preset not in PRESETS:
+            raise ValueError(f"Preset must be one of: {PRESETS}")
+        if not isinstance(threads, int):
+            raise TypeError("Threads must be an integer.")
+        if threads < 0:
+            raise ValueError("Threads must be 0 (all cores) or positive.")
+        self._quality = quality
+        self._preset = preset
+        self._threads = threads
+
+    @property
+    def quality(self) -> int:
+        return self._quality
+
+    @property
+    def preset(self) -> str:
+        return self._preset
+
+    @property
+    def threads(self) -> int:
+        return self._threads
+
+    def encode(self, image: Image.Image) -> bytes:
+        """Encodes an image, returning the file bytes."""
+        with io.BytesIO() as f:
+            self._save(image, f)
+            return f.getvalue()
+
+    def encode_view(self, image: Image.Image) -> memoryview:
+        """
+        Encodes an image, returning a view of the encoder's output
+        buffer (not copied into new bytes).
+        """
+        f = io.BytesIO()
+        self._save(image, f)
+        # Keeps the buffer alive (and unresizable) while viewed.
+        return f.getbuffer()
+
+    def encode_to(
+        self, image: Image.Image, sink: int | socket.socket | BinaryIO
+    ) -> int:
+        """
+        Encodes an image straight into a sink (see write_output),
+        returning the number of bytes written.
+        """
+        return write_output(self.encode_view(image), sink)
+
+    def _save(self, image: Image.Image, f: BinaryIO) -> None:
+        # Encodes an image into a file object with PIL. Subclasses for
+        # formats PIL cannot encode override this.
+        if image.mode not in ("RGB", "L"):
+            image = image.convert("RGB")
+        with stage(STAGE_ENCODE):
+            image.save(
+                f, format=self.name, quality=self._quality,
+                **self.preset_options[self._preset], **self._get_options())
+
+    def _get_options(self) -> dict:
+        # Further save options, besides those of the preset.
+        return {}
+
+
+class JpegEncoder(Encoder):
+    """
+    Baseline JPEG, encoded in parallel for large images (see
+    encode_jpeg). Optimising the Huffman tables does not allow
+    parallel encoding, so the small preset encodes on one thread,
+    with optimised tables and progressive scans. libjpeg has no other
+    speed/effort setting, so the fast and balanced presets are the
+    same: JPEG effectively has two presets.
+    """
+    name = "jpeg"
+    extension = ".jpg"
+    preset_options = {
+        PRESET_FAST: {}, PRESET_BALANCED: {},
+        PRESET_SMALL: {"optimize": True, "progressive": True},
+    }
+
+    def __init__(
+        self, quality: int = None, preset: str = DEFAULT_PRESET,
+        threads: int = 0, subsampling: int = DEFAULT_SUBSAMPLING
+    ) -> None:
+        super().__init__(quality, preset, threads)
+        validate_jpeg_options(self.quality, subsampling)
+        self._subsampling = subsampling
+
+    @property
+    def subsampling(self) -> int:
+        return self._subsampling
+
+    def encode(self, image: Image.Image) -> bytes:
+        if self.preset != PRESET_SMALL:
+            return encode_jpeg(
+                image, self.quality, self._subsampling, self.threads)
+        return super().encode(image)
+
+    def encode_view(self, image: Image.Image) -> memoryview:
+        if self.preset != PRESET_SMALL:
+            return encode_jpeg_view(
+                image, self.quality, self._subsampling, self.threads)
+        return super().encode_view(image)
+
+    def _get_options(self) -> dict:
+        return {"subsampling": self._subsampling}
+
+
+class WebpEncoder(Encoder):
+    """
+    Lossy WebP, on one thread, up to 16383 pixels in each dimension
+    (larger images, such as full zoom 5 panoramas, cannot be encoded).
+    """
+    name = "webp"
+    extension = ".webp"
+    default_quality = 80
+    preset_options = {
+        PRESET_FAST: {"method": 0}, PRESET_BALANCED: {"method": 4},
+        PRESET_SMALL: {"method": 6},
+    }
+
+    def _save(self, image: Image.Image, f: BinaryIO) -> None:
+        if max(image.size) > WEBP_MAX_SIZE:
+            raise ValueError(
+                f"WebP images can only be up to {WEBP_MAX_SIZE} pixels "
+                "in width and height.")
+        super()._save(image, f)
+
+
+class AvifEncoder(Encoder):
+    """AVIF (AV1), encoded on multiple threads by libavif."""
+    name = "avif"
+    extension = ".avif"
+    preset_options = {
+        PRESET_FAST: {"speed": 9}, PRESET_BALANCED: {"speed": 6},
+        PRESET_SMALL: {"speed": 4},
+    }
+
+    def _get_options(self) -> dict:
+        return {"max_threads": self.threads or os.cpu_count() or 1}
+
+
+class JxlEncoder(Encoder):
+    """JPEG XL (lossy), as encoded by pillow-jxl-plugin."""
+    name = "jxl"
+    extension = ".jxl"
+    default_quality = 90
+    preset_options = {
+        PRESET_FAST: {"effort": 3}, PRESET_BALANCED: {"effort": 7},
+        PRESET_SMALL: {"effort": 9},
+    }
+
+
+# Encoders by format name, of the formats PIL can encode.
+ENCODERS = {}
+
+
+def register_encoder(encoder_class: type[Encoder]) -> type[Encoder]:
+    """
+    Registers an encoder class under its format name, replacing any
+    encoder of the same name. Returns the class (usable as a decorator).
+    """
+    if not (
+        isinstance(encoder_class, type) and issubclass(encoder_class, Encoder)
+    ):
+        raise TypeError("Encoder class must be a subclass of Encoder.")
+    if not isinstance(encoder_class.name, str):
+        raise TypeError("Encoder name must be a string.")
+    ENCODERS[encoder_class.name] = encoder_class
+    return encoder_class
+
+
+register_encoder(JpegEncoder)
+if features.check("webp"):
+    register_encoder(WebpEncoder)
+if features.check("avif"):
+    register_encoder(AvifEncoder)
+if pillow_jxl is not None:
+    register_encoder(JxlEncoder)
+
+
+def get_encoder(
+    name: str, quality: int = None, preset: str = DEFAULT_PRESET,
+    threads: int = 0
+) -> Encoder:
+    """
+    Returns an encoder of a registered format ("jpeg", and where
+    supported by PIL, "webp", "avif" and "jxl"), with the given quality
+    (None for the codec default), preset and threads (0 for all cores).
+    """
+    if name not in ENCODERS:
+        raise ValueError(f"Format must be one of: {tuple(ENCODERS)}")
+    return ENCODERS[name](quality, preset, threads)
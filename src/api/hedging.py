@@ -0,0 +1,99 @@
+"""
+This module implements request hedging to cut tile download tail latency.
+If a tile has not downloaded by a given percentile of recent latencies,
+a duplicate request is sent and whichever finishes first is used.
+The proportion of duplicate requests is capped by a budget, keeping
+the extra load on the server bounded.
+"""
+import threading
+from collections import deque
+
+
+DEFAULT_PERCENTILE = 95
+DEFAULT_BUDGET = 0.05
+DEFAULT_HISTORY = 256
+DEFAULT_MIN_SAMPLES = 16
+
+
+class HedgePolicy:
+    """
+    Tracks recent request latencies to decide when to hedge, including:
+    - Latency percentile [1-99] after which a duplicate request is sent.
+    - Budget: maximum ratio of hedged requests to all requests [0-1].
+    - History: number of recent latencies considered.
+    - Minimum samples before any hedging takes place.
+    Thread-safe, so one policy can be shared between downloads.
+    """
+
+    def __init__(
+        self, percentile: float = DEFAULT_PERCENTILE,
+        budget: float = DEFAULT_BUDGET, history: int = DEFAULT_HISTORY,
+        min_samples: int = DEFAULT_MIN_SAMPLES
+    ) -> None:
+        if not 1 <= percentile <= 99:
+            raise ValueError("Percentile must be between 1 and 99.")
+        if not 0 <= budget <= 1:
+            raise ValueError("Budget must be between 0 and 1.")
+        if not 1 <= min_samples <= history:
+            raise ValueError(
+                "Minimum samples must be at least 1 and at most the history.")
+        self._percentile = percentile
+        self._budget = budget
+        self._min_samples = min_samples
+        self._latencies = deque(maxlen=history)
+        self._lock = threading.Lock()
+        self._requests = 0
+        self._hedges = 0
+        self._hedge_wins = 0
+
+    def __getstate__(self) -> dict:
+        # Locks cannot be pickled, so each copy gets its own.
+        state = self.__dict__.copy()
+        del state["_lock"]
+        return state
+
+    def __setstate__(self, state: dict) -> None:
+        self.__dict__.update(state)
+        self._lock = threading.Lock()
+
+    def delay(self) -> float | None:
+        """
+        Registers a new request, returning the seconds after which to
+        hedge it, or None if there are too few latency samples.
+        """
+        with self._lock:
+            self._requests += 1
+            if len(self._latencies) < self._min_samples:
+                return None
+            latencies = sorted(self._latencies)
+        index = round((len(latencies) - 1) * self._percentile / 100)
+        return latencies[index]
+
+    def try_hedge(self) -> bool:
+        """Returns True and registers a hedge if the budget allows it."""
+        with self._lock:
+            if self._hedges + 1 > self._budget * self._requests:
+                return False
+            self._hedges += 1
+            return True
+
+    def record(self, latency: float, hedge_won: bool = False) -> None:
+        """Records the latency (seconds) of a completed request."""
+        with self._lock:
+            self._latencies.append(latency)
+            self._hedge_wins += hedge_won
+
+    @property
+    def requests(self) -> int:
+        """Number of requests registered."""
+        return self._requests
+
+    @property
+    def hedges(self) -> int:
+        """Number of duplicate (hedge) requests sent."""
+        return self._hedges
+
+    @property
+    def hedge_wins(self) -> int:
+        """Number of hedges which finished before the original request."""
+        return self._hedge_wins
@@ -0,0 +1,103 @@
+"""
+This module provides an HTTP/2 client backend for tile and thumbnail
+requests. Rather than opening a connection per concurrent request as
+with HTTP/1.1, requests to the host are multiplexed as streams over
+one or a few connections. Servers not offering HTTP/2 are still spoken
+to, over HTTP/1.1. Requires httpx with HTTP/2 support, installed by:
+pip install httpx[http2]
+"""
+import importlib.util
+import threading
+
+try:
+    import httpx
+except ImportError:
+    httpx = None
+
+
+DEFAULT_CONNECTIONS = 1
+DEFAULT_STREAMS = 64
+
+
+def is_available() -> bool:
+    """Returns True if httpx and its HTTP/2 support (h2) are installed."""
+    return httpx is not None and importlib.util.find_spec("h2") is not None
+
+
+class Http2Settings:
+    """
+    HTTP/2 client settings, including:
+    - Maximum connections to the host.
+    - Maximum requests (streams) in flight across all connections.
+    - Prior knowledge: use HTTP/2 for unencrypted (http://) URLs without
+      negotiation, for servers known to support it (e.g. locally).
+    Otherwise, HTTP/2 is negotiated during the TLS handshake, falling back
+    to HTTP/1.1, with at most one request in flight per connection.
+    """
+
+    def __init__(
+        self, connections: int = DEFAULT_CONNECTIONS,
+        streams: int = DEFAULT_STREAMS, prior_knowledge: bool = False
+    ) -> None:
+        if not is_available():
+            raise ImportError(
+                "HTTP/2 requires httpx: pip install httpx[http2]")
+        if not isinstance(connections, int) or connections < 1:
+            raise ValueError("Connections must be a positive integer.")
+        if not isinstance(streams, int) or streams < 1:
+            raise ValueError("Streams must be a positive integer.")
+        self._connections = connections
+        self._streams = streams
+        self._prior_knowledge = prior_knowledge
+        # Synchronous client, created on first use and shared by threads.
+        self._client = None
+        self._lock = threading.Lock()
+
+    def _get_client_options(self) -> dict:
+        limits = httpx.Limits(
+            max_connections=self._connections,
+            max_keepalive_connections=self._connections)
+        # No timeout, as with requests.
+        return {
+            "http1": not self._prior_knowledge, "http2": True,
+            "limits": limits, "timeout": None}
+
+    def create_async_client(self) -> "httpx.AsyncClient":
+        """
+        Returns a new asynchronous client with these settings,
+        to be used (and closed) within a single event loop.
+        """
+        return httpx.AsyncClient(**self._get_client_options())
+
+    def get(self, url: str, params: dict) -> tuple[int, bytes]:
+        """
+        Sends a GET request with the shared synchronous client,
+        returning the status code and content.
+        """
+        with self._lock:
+            if self._client is None:
+                self._client = httpx.Client(**self._get_client_options())
+        response = self._client.get(url, params=params)
+        return response.status_code, response.content
+
+    def close(self) -> None:
+        """Closes the connections of the synchronous client, if any."""
+        with self._lock:
+            if self._client is not None:
+                self._client.close()
+                self._client = None
+
+    @property
+    def connections(self) -> int:
+        """Maximum connections to the host."""
+        return self._connections
+
+    @property
+    def streams(self) -> int:
+        """Maximum requests in flight."""
+        return self._streams
+
+    @property
+    def prior_knowledge(self) -> bool:
+        """Whether HTTP/2 is used for http:// URLs without negotiation."""
+        return self._prior_knowledge
@@ -0,0 +1,144 @@
+"""
+This module allows downloads to be resumed after failures or crashes.
+A tile journal checkpoints each downloaded tile to disk, so that a
+rerun only downloads the missing tiles. A batch journal records each
+completed item of a batch job, so that a rerun skips them.
+All writes are atomic and durable (flushed to disk before an item is
+committed), so neither a crash nor a power loss leaves a partial entry.
+"""
+import contextlib
+import os
+import pathlib
+import shutil
+import threading
+from typing import BinaryIO, Iterator
+
+
+TILE_EXTENSION = ".jpg"
+TEMPORARY_EXTENSION = ".tmp"
+
+
+def fsync_directory(path: pathlib.Path) -> None:
+    """
+    Flushes a directory's entries (such as a rename) to disk, where
+    supported (not on Windows, whose renames need no flush).
+    """
+    if os.name == "nt":
+        return
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        os.fsync(fd)
+    finally:
+        os.close(fd)
+
+
+@contextlib.contextmanager
+def open_atomic(path: pathlib.Path) -> Iterator[BinaryIO]:
+    """
+    Opens a file to durably write in the context, as write_atomic:
+    written to a temporary file (unique to the process and thread),
+    which replaces the path once the context exits without an error.
+    """
+    temporary_path = path.with_name(
+        f"{path.name}.{os.getpid()}.{threading.get_ident()}"
+        f"{TEMPORARY_EXTENSION}")
+    try:
+        with temporary_path.open("wb") as f:
+            yield f
+            f.flush()
+            os.fsync(f.fileno())
+        os.replace(temporary_path, path)
+    except BaseException:
+        temporary_path.unlink(missing_ok=True)
+        raise
+    fsync_directory(path.parent)
+
+
+def write_atomic(path: pathlib.Path, data: bytes | memoryview) -> None:
+    """
+    Durably writes a file: to a temporary file first, flushed to disk,
+    then renamed over the path (atomic), with the rename flushed too.
+    Even after a crash or power loss, the file is either absent (or
+    its previous version) or complete.
+    """
+    with open_atomic(path) as f:
+        f.write(data)
+
+
+class TileJournal:
+    """
+    Checkpoints downloaded tiles in a folder, one file per tile,
+    stored as <panorama ID>/<zoom>/<x>_<y>.jpg
+    """
+
+    def __init__(self, folder: str | pathlib.Path) -> None:
+        self.folder = pathlib.Path(folder)
+        self.folder.mkdir(parents=True, exist_ok=True)
+
+    def _get_path(
+        self, panorama_id: str, zoom: int, x: int, y: int
+    ) -> pathlib.Path:
+        filename = f"{x}_{y}{TILE_EXTENSION}"
+        return self.folder / panorama_id / str(zoom) / filename
+
+    def get(
+        self, panorama_id: str, zoom: int, x: int, y: int
+    ) -> bytes | None:
+        """Returns the checkpointed tile, or None if not checkpointed."""
+        try:
+            return self._get_path(panorama_id, zoom, x, y).read_bytes()
+        except FileNotFoundError:
+            return None
+
+    def put(
+        self, panorama_id: str, zoom: int, x: int, y: int, tile: bytes
+    ) -> None:
+        """Checkpoints a downloaded tile."""
+        path = self._get_path(panorama_id, zoom, x, y)
+        path.parent.mkdir(parents=True, exist_ok=True)
+        write_atomic(path, tile)
+
+    def clear(self, panorama_id: str) -> None:
+        """Removes all checkpointed tiles of a panorama."""
+        shutil.rmtree(self.folder / panorama_id, ignore_errors=True)
+
+
+class BatchJournal:
+    """
+    Records the completed items of a batch job in an append-only file,
+    one item per line. Items are only considered committed once their
+    line is completely written and flushed to disk.
+    """
+
+    def __init__(self, path: str | pathlib.Path) -> None:
+        self.path = pathlib.Path(path)
+        self._lock = threading.Lock()
+        self._committed = set()
+        if self.path.is_file():
+            lines = self.path.read_text("utf8").split("\n")
+            # The last line is incomplete (or empty) if it lacks a newline.
+            self._committed.update(lines[:-1])
+            if lines[-1]:
+                # Discard the incomplete line from a crash mid-write.
+                with self.path.open("r+", encoding="utf8") as f:
+                    f.truncate(self.path.stat().st_size - len(
+                        lines[-1].encode("utf8")))
+
+    def commit(self, item: str) -> None:
+        """Durably records an item as completed."""
+        if "\n" in item:
+            raise ValueError("Items cannot contain newlines.")
+        with self._lock:
+            with self.path.open("a", encoding="utf8") as f:
+                f.write(f"{item}\n")
+                f.flush()
+                os.fsync(f.fileno())
+            self._committed.add(item)
+
+    def __contains__(self, item: str) -> bool:
+        with self._lock:
+            return item in self._committed
+
+    def __len__(self) -> int:
+        with self._lock:
+            return len(self._committed)
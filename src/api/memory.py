@@ -0,0 +1,171 @@
+"""
+This module accounts for the memory of panorama jobs, so that running
+several at once (such as in a batch, see batch.py) does not exhaust
+memory. A job holds its downloaded tiles, the row images and full image
+they are stitched into, a cropped copy, and the pixels and output of
+the encoder, and its projected peak is predicted from its settings
+(see estimate_memory). A MemoryBudget admits jobs only while their
+projected peaks fit in it together. The actual peak resident memory
+(RSS) of a job can be measured by resetting the peak before the job
+(see reset_peak_rss) and reading it after (see get_peak_rss).
+"""
+import collections
+import contextlib
+import sys
+import threading
+from typing import Iterator
+
+from panorama import TILE_HEIGHT, TILE_WIDTH, PanoramaSettings
+
+try:
+    import resource
+except ImportError:
+    # Not available on Windows.
+    resource = None
+
+
+TILE_CHANNELS = 3
+# Assumed upper bounds of the size of downloaded (JPEG) tiles and of
+# an encoded panorama, relative to the size of their pixels.
+TILE_COMPRESSION = 0.25
+OUTPUT_COMPRESSION = 0.25
+PROC_STATUS = "/proc/self/status"
+PROC_CLEAR_REFS = "/proc/self/clear_refs"
+# Written to clear_refs, resets the peak RSS (Linux 4.0+).
+RESET_PEAK_RSS = "5"
+
+
+def estimate_memory(
+    settings: PanoramaSettings = None, crop_black_edges: bool = True
+) -> int:
+    """
+    Returns the projected peak memory (bytes) of downloading, stitching
+    and encoding a panorama with the given settings: tiles x 512 x 512
+    x 3 bytes for each full-size intermediate held at once, plus the
+    downloaded tiles. Black edges, if cropped, are assumed to hold
+    content, so the estimate is an upper bound for smaller panoramas.
+    """
+    if settings is None:
+        settings = PanoramaSettings()
+    tile = TILE_WIDTH * TILE_HEIGHT * TILE_CHANNELS
+    pixels = settings.tiles * tile
+    # Downloaded tiles are held until the panorama is done.
+    tiles = int(pixels * TILE_COMPRESSION)
+    # Stitching holds the row images, the full image and a decoded tile.
+    stitch = 2 * pixels + tile
+    # Cropping copies the full image.
+    crop = 2 * pixels if crop_black_edges else 0
+    # Encoding holds the image, its pixels copied out for the native
+    # encoder and the output.
+    encode = 2 * pixels + int(pixels * OUTPUT_COMPRESSION)
+    return tiles + max(stitch, crop, encode)
+
+
+class MemoryBudget:
+    """
+    A memory budget (bytes) shared by concurrent jobs, each reserving
+    its projected peak (see estimate_memory) before it starts and
+    releasing it once done. Jobs are admitted in the order they arrive,
+    each once its reservation fits in what remains of the budget.
+    A job larger than the whole budget is admitted alone.
+    """
+
+    def __init__(self, limit: int) -> None:
+        if not isinstance(limit, int) or limit < 1:
+            raise ValueError("Limit must be a positive integer.")
+        self.limit = limit
+        self._reserved = 0
+        self._jobs = 0
+        # Jobs waiting to be admitted, in order.
+        self._waiting = collections.deque()
+        self._condition = threading.Condition()
+
+    @property
+    def reserved(self) -> int:
+        """Bytes reserved by the jobs admitted."""
+        return self._reserved
+
+    @property
+    def jobs(self) -> int:
+        """Number of jobs admitted (and not yet released)."""
+        return self._jobs
+
+    def _admits(self, waiter: object, size: int) -> bool:
+        # Whether a waiting job is next, and fits.
+        return self._waiting[0] is waiter and (
+            self._jobs == 0 or self._reserved + size <= self.limit)
+
+    def acquire(self, size: int, timeout: float = None) -> bool:
+        """
+        Reserves `size` bytes for a job, waiting until it is admitted
+        (at most `timeout` seconds, if given). Returns True if admitted,
+        or False if timed out.
+        """
+        if not isinstance(size, int) or size < 0:
+            raise ValueError("Size must be a non-negative integer.")
+        waiter = object()
+        with self._condition:
+            self._waiting.append(waiter)
+            try:
+                if not self._condition.wait_for(
+                    lambda: self._admits(waiter, size), timeout
+                ):
+                    return False
+                self._reserved += size
+                self._jobs += 1
+                return True
+            finally:
+                self._waiting.remove(waiter)
+                # The next job may now be admitted.
+                self._condition.notify_all()
+
+    def release(self, size: int) -> None:
+        """Releases the reservation of an admitted job."""
+        with self._condition:
+            self._reserved -= size
+            self._jobs -= 1
+            self._condition.notify_all()
+
+    @contextlib.contextmanager
+    def reserve(self, size: int) -> Iterator[None]:
+        """Reserves `size` bytes around the context (see acquire)."""
+        self.acquire(size)
+        try:
+            yield
+        finally:
+            self.release(size)
+
+
+def reset_peak_rss() -> bool:
+    """
+    Resets the peak RSS of this process to its current RSS, so that
+    get_peak_rss then returns the peak since. Returns False if this
+    is not supported (on Linux only), the peak then remaining that of
+    the whole process so far.
+    """
+    try:
+        with open(PROC_CLEAR_REFS, "w", encoding="ascii") as f:
+            f.write(RESET_PEAK_RSS)
+    except OSError:
+        return False
+    return True
+
+
+def get_peak_rss() -> int | None:
+    """
+    Returns the peak RSS (bytes) of this process (since last reset, see
+    reset_peak_rss), or None if it cannot be measured (on Windows).
+    """
+    try:
+        with open(PROC_STATUS, encoding="ascii") as f:
+            for line in f:
+                if line.startswith("VmHWM:"):
+                    # In kilobytes.
+                    return int(line.split()[1]) * 1024
+    except OSError:
+        pass
+    if resource is None:
+        return None
+    peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    # In bytes on macOS, kilobytes elsewhere.
+    return peak if sys.platform == "darwin" else peak * 1024
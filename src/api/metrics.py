@@ -0,0 +1,245 @@
+"""
+This module exposes metrics of long-running processes (such as batch
+downloads) for Prometheus to scrape, in its text exposition format,
+from a local HTTP listener (see MetricsServer) on a background thread.
+Metrics observe everything recorded by stats.py in the process: tiles
+fetched (downloaded or from the cache/journal) or skipped as black
+edges, HTTP responses by status code, retries, bytes downloaded and
+allocated, cache hits and misses, a latency histogram and CPU time of
+each stage, and pixels output by the native kernels (throughput being
+the rate of pixels over the rate of the kernel's stage time), as well
+as a gauge of the tiles downloading, from the tiles in flight counted
+by every download backend. Batch worker processes forward their metrics
+(including changes in tiles in flight) to the parent after each
+panorama (see batch.py).
+"""
+import bisect
+import http.server
+import threading
+
+from stats import (
+    BYTES_ALLOCATED, BYTES_DOWNLOADED, CACHE_HITS, CACHE_MISSES, COUNTERS,
+    CUBEMAP_PIXELS, PROJECT_PIXELS, RETRIES, TILES_CACHED, TILES_DOWNLOADED,
+    TILES_IN_FLIGHT, TILES_SKIPPED, add_observer, remove_observer)
+
+
+DEFAULT_HOST = "127.0.0.1"
+DEFAULT_PORT = 9464
+METRICS_PATH = "/metrics"
+CONTENT_TYPE = "text/plain; version=0.0.4; charset=utf-8"
+PREFIX = "streetview"
+# Upper bounds (seconds) of the stage latency histogram buckets.
+LATENCY_BUCKETS = (
+    0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+    30, 60)
+# Exposed counters (name, help, label) of stats counters, grouped into
+# one metric per name. Tiles in flight are exposed as a gauge instead.
+TILES_HELP = "Tiles fetched or skipped, by source."
+COUNTER_METRICS = {
+    TILES_DOWNLOADED: ("tiles_total", TILES_HELP, 'source="downloaded"'),
+    TILES_CACHED: ("tiles_total", TILES_HELP, 'source="cached"'),
+    TILES_SKIPPED: ("tiles_total", TILES_HELP, 'source="skipped"'),
+    RETRIES: ("retries_total", "Request retries.", ""),
+    BYTES_DOWNLOADED: (
+        "downloaded_bytes_total", "Bytes of successful responses.", ""),
+    BYTES_ALLOCATED: (
+        "allocated_bytes_total", "Bytes of decoded and stitched images.", ""),
+    CACHE_HITS: ("cache_hits_total", "Cache lookups found.", ""),
+    CACHE_MISSES: ("cache_misses_total", "Cache lookups not found.", ""),
+    CUBEMAP_PIXELS: (
+        "kernel_pixels_total", "Pixels output by the native kernels.",
+        'kernel="set_cubemap"'),
+    PROJECT_PIXELS: (
+        "kernel_pixels_total", "Pixels output by the native kernels.",
+        'kernel="project"'),
+}
+
+
+class Metrics:
+    """
+    Counters and stage latency histograms of a process, which observe
+    (see stats.add_observer) and are exposed by a MetricsServer.
+    Snapshots of metrics taken in other processes can be merged in.
+    """
+
+    def __init__(self, buckets: tuple[float, ...] = LATENCY_BUCKETS) -> None:
+        if not buckets or list(buckets) != sorted(set(buckets)):
+            raise ValueError("Buckets must be increasing.")
+        self.buckets = tuple(buckets)
+        self._lock = threading.Lock()
+        self._counters = dict.fromkeys(COUNTERS, 0)
+        self._status_codes = {}
+        # By stage: counts of each bucket (not cumulative) and above,
+        # total wall time and total CPU time.
+        self._stages = {}
+
+    def _get_stage(self, name: str) -> dict:
+        # Returns the histogram of a stage, adding it if new.
+        stage = self._stages.get(name)
+        if stage is None:
+            stage = self._stages[name] = {
+                "counts": [0] * (len(self.buckets) + 1), "sum": 0.0,
+                "cpu": 0.0}
+        return stage
+
+    def add_stage(self, name: str, wall_time: float, cpu_time: float) -> None:
+        """Records one call of a stage in its latency histogram."""
+        index = bisect.bisect_left(self.buckets, wall_time)
+        with self._lock:
+            stage = self._get_stage(name)
+            stage["counts"][index] += 1
+            stage["sum"] += wall_time
+            stage["cpu"] += cpu_time
+
+    def add(self, counter: str, value: int = 1) -> None:
+        """Increments a counter (or the tiles in flight, by any value)."""
+        with self._lock:
+            self._counters[counter] += value
+
+    def add_status(self, status: int) -> None:
+        """Counts a response with an HTTP status code."""
+        with self._lock:
+            self._status_codes[status] = (
+                self._status_codes.get(status, 0) + 1)
+
+    def take(self) -> dict:
+        """
+        Returns a snapshot of the metrics recorded since the last one
+        taken (picklable, to merge into the metrics of another process),
+        clearing them.
+        """
+        with self._lock:
+            snapshot = {
+                "buckets": self.buckets, "counters": self._counters,
+                "status_codes": self._status_codes, "stages": self._stages}
+            self._counters = dict.fromkeys(COUNTERS, 0)
+            self._status_codes = {}
+            self._stages = {}
+        return snapshot
+
+    def merge(self, snapshot: dict) -> None:
+        """Adds a snapshot (see take) to these metrics."""
+        if tuple(snapshot["buckets"]) != self.buckets:
+            raise ValueError("Snapshot has different buckets.")
+        with self._lock:
+            for counter, value in snapshot["counters"].items():
+                self._counters[counter] += value
+            for status, value in snapshot["status_codes"].items():
+                self._status_codes[status] = (
+                    self._status_codes.get(status, 0) + value)
+            for name, other in snapshot["stages"].items():
+                stage = self._get_stage(name)
+                for i, value in enumerate(other["counts"]):
+                    stage["counts"][i] += value
+                stage["sum"] += other["sum"]
+                stage["cpu"] += other["cpu"]
+
+    def render(self) -> str:
+        """Returns the metrics in the Prometheus text format."""
+        lines = []
+
+        def add_metric(
+            name: str, kind: str, help_text: str,
+            samples: list[tuple[str, str, float]]
+        ) -> None:
+            # Adds a metric with samples (suffix, labels, value).
+            lines.append(f"# HELP {PREFIX}_{name} {help_text}")
+            lines.append(f"# TYPE {PREFIX}_{name} {kind}")
+            for suffix, labels, value in samples:
+                labels = f"{{{labels}}}" if labels else ""
+                lines.append(f"{PREFIX}_{name}{suffix}{labels} {value}")
+
+        with self._lock:
+            counters = dict(self._counters)
+            status_codes = dict(self._status_codes)
+            stages = {
+                name: {**stage, "counts": list(stage["counts"])}
+                for name, stage in self._stages.items()}
+        grouped = {}
+        for counter, (name, help_text, labels) in COUNTER_METRICS.items():
+            grouped.setdefault(name, (help_text, []))[1].append(
+                ("", labels, counters[counter]))
+        for name, (help_text, samples) in grouped.items():
+            add_metric(name, "counter", help_text, samples)
+        add_metric(
+            "http_responses_total", "counter",
+            "Responses received, by HTTP status code.",
+            [("", f'code="{status}"', value)
+                for status, value in sorted(status_codes.items())])
+        histogram = []
+        cpu = []
+        for name, stage in sorted(stages.items()):
+            cumulative = 0
+            for bound, value in zip(
+                (*self.buckets, "+Inf"), stage["counts"]
+            ):
+                cumulative += value
+                histogram.append(
+                    ("_bucket", f'stage="{name}",le="{bound}"', cumulative))
+            histogram.append(("_sum", f'stage="{name}"', stage["sum"]))
+            histogram.append(("_count", f'stage="{name}"', cumulative))
+            cpu.append(("", f'stage="{name}"', stage["cpu"]))
+        add_metric(
+            "stage_duration_seconds", "histogram",
+            "Wall time of each call of a stage.", histogram)
+        add_metric(
+            "stage_cpu_seconds_total", "counter",
+            "CPU time of the threads running a stage.", cpu)
+        add_metric(
+            "tiles_in_flight", "gauge", "Tiles currently downloading.",
+            [("", "", counters[TILES_IN_FLIGHT])])
+        return "\n".join(lines) + "\n"
+
+
+class MetricsServer:
+    """
+    Serves metrics (new metrics if None) at /metrics over HTTP on the
+    host and port (0 for any free port, see the port attribute), on a
+    background thread, until closed. The metrics observe everything
+    recorded in the process while the server is open.
+    By default, only local connections are accepted.
+    """
+
+    def __init__(
+        self, metrics: Metrics = None, port: int = DEFAULT_PORT,
+        host: str = DEFAULT_HOST
+    ) -> None:
+        self.metrics = Metrics() if metrics is None else metrics
+        metrics = self.metrics
+
+        class Handler(http.server.BaseHTTPRequestHandler):
+
+            def do_GET(self) -> None:
+                if self.path.split("?")[0] != METRICS_PATH:
+                    self.send_error(404)
+                    return
+                body = metrics.render().encode()
+                self.send_response(200)
+                self.send_header("Content-Type", CONTENT_TYPE)
+                self.send_header("Content-Length", str(len(body)))
+                self.end_headers()
+                self.wfile.write(body)
+
+            def log_message(self, *_) -> None:
+                pass
+
+        self._server = http.server.ThreadingHTTPServer((host, port), Handler)
+        self._server.daemon_threads = True
+        self.port = self._server.server_address[1]
+        add_observer(self.metrics)
+        self._thread = threading.Thread(
+            target=self._server.serve_forever, daemon=True)
+        self._thread.start()
+
+    def close(self) -> None:
+        """Stops serving and observing."""
+        remove_observer(self.metrics)
+        self._server.shutdown()
+        self._server.server_close()
+        self._thread.join()
+
+    def __enter__(self) -> "MetricsServer":
+        return self
+
+    def __exit__(self, *_) -> None:
+        self.close()
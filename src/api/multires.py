@@ -0,0 +1,223 @@
+"""
+This module exports panoramas as cubemaps: six face images, written to
+files or tar shards, or multi-resolution cubemap pyramids in the
+multires layout of the Pannellum web viewer:
+<folder>/<level>/<face><row>_<column>.<extension> plus config.json,
+where level 1 is the smallest and faces are f, b, u, d, l, r.
+The cubemap is computed once (natively, see native.py) at the full
+resolution, each lower pyramid level halving the faces of the level
+above, and all faces or tiles are encoded and written in parallel.
+Progress can be reported through a callback, called on the calling
+thread with the number of faces or tiles completed and the total.
+"""
+import json
+import math
+import os
+import pathlib
+from concurrent.futures import Future, ThreadPoolExecutor, as_completed
+from typing import Callable
+
+from PIL import Image
+
+import native
+from cache import PanoramaCache
+from encoding import Encoder, JpegEncoder
+from hedging import HedgePolicy
+from journal import TileJournal
+from panorama import PanoramaSettings
+from rawfile import RawPanorama
+from shards import ShardWriter
+
+
+DEFAULT_TILE_SIZE = 512
+CONFIG_FILENAME = "config.json"
+# Pannellum face names, by native.CUBEMAP_FACES face.
+FACE_NAMES = {
+    "front": "f", "back": "b", "bottom": "u", "top": "d",
+    "right": "r", "left": "l"}
+
+
+def get_levels(cube_size: int, tile_size: int) -> int:
+    """
+    Returns the number of pyramid levels of faces of the given size,
+    the smallest level being a single tile per face.
+    """
+    if cube_size <= tile_size:
+        return 1
+    return math.ceil(math.log2(cube_size / tile_size)) + 1
+
+
+def _wait(
+    futures: list[Future], progress: Callable[[int, int], None] | None
+) -> None:
+    # Waits for all tasks, reporting progress as each completes.
+    # Raises the first error, cancelling the remaining tasks.
+    try:
+        for completed, future in enumerate(as_completed(futures), 1):
+            future.result()
+            if progress is not None:
+                progress(completed, len(futures))
+    except BaseException:
+        for future in futures:
+            future.cancel()
+        raise
+
+
+def _save_tile(
+    face: Image.Image, box: tuple[int, int, int, int], path: pathlib.Path,
+    encoder: Encoder
+) -> None:
+    # Crops a tile from a face and encodes it to a file.
+    with path.open("wb") as f:
+        encoder.encode_to(face.crop(box), f)
+
+
+def _save_face(
+    face: Image.Image, name: str, destination: pathlib.Path | ShardWriter,
+    encoder: Encoder, key: str, metadata: dict
+) -> None:
+    # Encodes a face to a file in a folder, or a shard record.
+    if isinstance(destination, ShardWriter):
+        destination.write(
+            f"{key}_{name}", encoder.encode_view(face),
+            {**metadata, "face": name}, encoder.extension)
+        return
+    with (destination / f"{name}{encoder.extension}").open("wb") as f:
+        encoder.encode_to(face, f)
+
+
+def export_cubemap(
+    source: Image.Image | RawPanorama | list[Image.Image],
+    destination: str | pathlib.Path | ShardWriter, encoder: Encoder = None,
+    threads: int = 0, progress: Callable[[int, int], None] = None,
+    key: str = None, metadata: dict = None
+) -> None:
+    """
+    Exports the six faces of a cubemap, encoded by the encoder (JPEG by
+    default) concurrently on the given number of threads (0 for all
+    cores), either as files <face><extension> in a folder (faces named
+    as in native.CUBEMAP_FACES), or as records <key>_<face> of a shard
+    writer, with the metadata and face name. The source is a panorama
+    (2:1 image or raw file), whose cubemap is computed natively,
+    or the faces themselves, such as those of a raw cubemap file.
+    Progress is reported as faces are written (see above).
+    """
+    if isinstance(source, RawPanorama) and source.is_cubemap:
+        faces = source.to_images()
+    elif isinstance(source, (Image.Image, RawPanorama)):
+        faces = native.get_cubemap(source)
+    else:
+        faces = list(source)
+    if len(faces) != len(native.CUBEMAP_FACES):
+        raise ValueError("A cubemap must have six faces.")
+    if encoder is None:
+        encoder = JpegEncoder()
+    if isinstance(destination, ShardWriter):
+        if key is None:
+            raise ValueError("A key is required to write to shards.")
+    else:
+        destination = pathlib.Path(destination)
+        destination.mkdir(parents=True, exist_ok=True)
+    metadata = metadata or {}
+    with ThreadPoolExecutor(threads or os.cpu_count()) as executor:
+        futures = [
+            executor.submit(
+                _save_face, face, name, destination, encoder, key, metadata)
+            for name, face in zip(native.CUBEMAP_FACES, faces)]
+        _wait(futures, progress)
+
+
+def _validate_tile_size(tile_size: int) -> None:
+    # Raises an error if a multires tile size is invalid.
+    if not isinstance(tile_size, int) or tile_size < 1:
+        raise ValueError("Tile size must be a positive integer.")
+
+
+def export_multires(
+    image: Image.Image, folder: str | pathlib.Path,
+    tile_size: int = DEFAULT_TILE_SIZE, encoder: Encoder = None,
+    threads: int = 0, progress: Callable[[int, int], None] = None
+) -> dict:
+    """
+    Exports an equirectangular panorama as a multires cubemap pyramid
+    of square tiles (tile_size, smaller at face edges) in the folder,
+    encoded by the encoder (JPEG by default) on the given number of
+    threads (0 for all cores). A panorama that is not 2:1, such as one
+    with black edges cropped, is stretched to 2:1. Returns the viewer
+    configuration, which is also written to config.json.
+    Progress is reported as tiles are written (see above).
+    """
+    _validate_tile_size(tile_size)
+    if image.height != image.width // 2:
+        image = image.resize((image.width, image.width // 2))
+    return _export_multires_faces(
+        native.get_cubemap(image), folder, tile_size, encoder, threads,
+        progress)
+
+
+def _export_multires_faces(
+    faces: list[Image.Image], folder: str | pathlib.Path, tile_size: int,
+    encoder: Encoder | None, threads: int,
+    progress: Callable[[int, int], None] | None
+) -> dict:
+    # Exports the faces of a cubemap as a multires pyramid (see above).
+    if encoder is None:
+        encoder = JpegEncoder()
+    folder = pathlib.Path(folder)
+    cube_size = faces[0].width
+    levels = get_levels(cube_size, tile_size)
+    with ThreadPoolExecutor(threads or os.cpu_count()) as executor:
+        futures = []
+        for level in range(levels, 0, -1):
+            level_folder = folder / str(level)
+            level_folder.mkdir(parents=True, exist_ok=True)
+            size = faces[0].width
+            count = math.ceil(size / tile_size)
+            for name, face in zip(native.CUBEMAP_FACES, faces):
+                for row in range(count):
+                    for column in range(count):
+                        box = (
+                            column * tile_size, row * tile_size,
+                            min((column + 1) * tile_size, size),
+                            min((row + 1) * tile_size, size))
+                        path = level_folder / (
+                            f"{FACE_NAMES[name]}{row}_{column}"
+                            f"{encoder.extension}")
+                        futures.append(executor.submit(
+                            _save_tile, face, box, path, encoder))
+            if level > 1:
+                # Queued tiles keep this level's faces referenced.
+                faces = [face.reduce(2) for face in faces]
+        _wait(futures, progress)
+    config = {
+        "type": "multires",
+        "multiRes": {
+            "path": "/%l/%s%y_%x",
+            "extension": encoder.extension.removeprefix("."),
+            "tileResolution": tile_size,
+            "maxLevel": levels,
+            "cubeResolution": cube_size,
+        },
+    }
+    with (folder / CONFIG_FILENAME).open("w", encoding="utf8") as f:
+        json.dump(config, f, indent=4)
+    return config
+
+
+def download_multires(
+    panorama_id: str, folder: str | pathlib.Path,
+    settings: PanoramaSettings = None, tile_size: int = DEFAULT_TILE_SIZE,
+    encoder: Encoder = None, threads: int = 0, cache: PanoramaCache = None,
+    hedge: HedgePolicy = None, journal: TileJournal = None,
+    progress: Callable[[int, int], None] = None
+) -> dict:
+    """
+    Downloads a panorama (with black edges cropped) and exports it as a
+    multires cubemap pyramid, as export_multires. If a cache is
+    provided, the cubemap is cached too (see native.download_cubemap).
+    """
+    _validate_tile_size(tile_size)
+    faces = native.download_cubemap(
+        panorama_id, settings, cache=cache, hedge=hedge, journal=journal)
+    return _export_multires_faces(
+        faces, folder, tile_size, encoder, threads, progress)
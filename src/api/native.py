@@ -0,0 +1,495 @@
+"""
+This module binds the native (C++) tile fetcher in cpp/fetch.cpp,
+an alternative download backend for tile rates beyond what asyncio
+and aiohttp can sustain. All tiles are downloaded by libcurl's
+event-driven multi interface into a single arena, and can be decoded
+by libjpeg straight into a panorama image as they arrive, without
+creating Python objects for each tile. It also encodes large JPEGs
+in parallel (cpp/encode.cpp), and converts panoramas to cubemaps
+(cpp/cubemap.cpp). Build the library first with make (see cpp/Makefile)
+in the cpp folder, or for example on Linux (native.dll on Windows,
+libnative.dylib on macOS):
+g++ -O2 -shared -fPIC -pthread -o cpp/libnative.so cpp/fetch.cpp
+cpp/encode.cpp cpp/cubemap.cpp cpp/projection.cpp cpp/trace.cpp
+-lcurl -ljpeg
+Built with -DNATIVE_TRACE (make TRACE=1), the native calls record their
+timings (and those of their bands or strips) while a tracer is
+recording (see tracing.py), which are added to its trace after each
+call.
+"""
+import contextlib
+import ctypes
+import pathlib
+import sys
+import time
+import urllib.parse
+import weakref
+from typing import Iterator
+
+import requests as rq
+from PIL import Image
+
+import panorama
+from cache import PanoramaCache
+from encoding import validate_jpeg_options
+from hedging import HedgePolicy
+from journal import TileJournal
+from panorama import (
+    MAX_RETRIES, MAX_TILES_HEIGHT, MAX_TILES_WIDTH, TILE_HEIGHT, TILE_WIDTH,
+    PanoramaSettings, crop_black_image_edges, get_cached_tiles,
+    get_panorama_key, get_tile_params, store_tile, validate_download)
+from rawfile import RawPanorama
+from stats import (
+    BYTES_ALLOCATED, BYTES_DOWNLOADED, CACHE_HITS, CACHE_MISSES,
+    CUBEMAP_PIXELS, PROJECT_PIXELS, RETRIES, STAGE_CUBEMAP, STAGE_DECODE,
+    STAGE_DOWNLOAD, STAGE_PROJECT, TILES_DOWNLOADED, count, in_flight,
+    stage)
+from tracing import CATEGORY_NATIVE, get_tracers
+
+
+LIBRARY_NAMES = {"win32": "native.dll", "darwin": "libnative.dylib"}
+LIBRARY_PATH = (
+    pathlib.Path(__file__).parent / "cpp"
+    / LIBRARY_NAMES.get(sys.platform, "libnative.so"))
+DEFAULT_CONNECTIONS = 8
+CHANNELS = 3
+# Cubemap faces, in the order of the Faces enum (cpp/conversion.h).
+# The "top" face looks down and the "bottom" face looks up.
+CUBEMAP_FACES = ("front", "back", "top", "bottom", "right", "left")
+# Maximum native trace events moved per drain_trace call.
+TRACE_DRAIN_EVENTS = 4096
+# As ReserveFunction (cpp/fetch.h).
+RESERVE_FUNCTION = ctypes.CFUNCTYPE(ctypes.c_double)
+
+
+class TraceEvent(ctypes.Structure):
+    # As struct TraceEvent (cpp/trace.h).
+    _fields_ = (
+        ("name", ctypes.c_char_p), ("path", ctypes.c_char_p),
+        ("start", ctypes.c_uint64), ("duration", ctypes.c_uint64),
+        ("pixels", ctypes.c_int64), ("value", ctypes.c_int64),
+        ("thread", ctypes.c_uint64))
+
+
+# Loaded on first use.
+_library = None
+
+
+def _load_library() -> ctypes.CDLL:
+    # Loads the native library, declaring its function signatures.
+    global _library
+    if _library is not None:
+        return _library
+    if not LIBRARY_PATH.is_file():
+        raise OSError(f"Native library not built: {LIBRARY_PATH}")
+    library = ctypes.CDLL(str(LIBRARY_PATH))
+    library.fetch_tiles.argtypes = (
+        ctypes.POINTER(ctypes.c_char_p), ctypes.c_int, ctypes.c_int,
+        ctypes.c_int, ctypes.POINTER(ctypes.c_int), ctypes.c_void_p,
+        ctypes.c_int, ctypes.c_int, RESERVE_FUNCTION)
+    library.fetch_tiles.restype = ctypes.c_void_p
+    library.fetch_error.argtypes = (ctypes.c_void_p,)
+    library.fetch_error.restype = ctypes.c_char_p
+    library.fetch_retries.argtypes = (ctypes.c_void_p,)
+    library.fetch_retries.restype = ctypes.c_int
+    library.fetch_tile.argtypes = (
+        ctypes.c_void_p, ctypes.c_int, ctypes.POINTER(ctypes.c_size_t))
+    library.fetch_tile.restype = ctypes.c_void_p
+    library.free_fetch.argtypes = (ctypes.c_void_p,)
+    library.free_fetch.restype = None
+    library.decode_tile.argtypes = (
+        ctypes.c_char_p, ctypes.c_size_t, ctypes.c_void_p, ctypes.c_int,
+        ctypes.c_int, ctypes.c_int, ctypes.c_int)
+    library.decode_tile.restype = ctypes.c_int
+    library.encode_jpeg.argtypes = (
+        ctypes.c_char_p, ctypes.c_int, ctypes.c_int, ctypes.c_int,
+        ctypes.c_int, ctypes.c_int, ctypes.POINTER(ctypes.c_void_p))
+    library.encode_jpeg.restype = ctypes.c_size_t
+    library.free_jpeg.argtypes = (ctypes.c_void_p,)
+    library.free_jpeg.restype = None
+    library.set_cubemap.argtypes = (
+        ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_void_p)
+    library.set_cubemap.restype = None
+    library.project.argtypes = (
+        ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_void_p,
+        ctypes.c_int, ctypes.c_int, ctypes.c_double, ctypes.c_double,
+        ctypes.c_double, ctypes.POINTER(ctypes.c_void_p))
+    library.project.restype = None
+    library.trace_available.argtypes = ()
+    library.trace_available.restype = ctypes.c_int
+    library.set_trace.argtypes = (ctypes.c_int,)
+    library.set_trace.restype = None
+    library.trace_clock.argtypes = ()
+    library.trace_clock.restype = ctypes.c_uint64
+    library.drain_trace.argtypes = (
+        ctypes.POINTER(TraceEvent), ctypes.c_size_t)
+    library.drain_trace.restype = ctypes.c_size_t
+    library.trace_dropped.argtypes = ()
+    library.trace_dropped.restype = ctypes.c_uint64
+    _library = library
+    return library
+
+
+def is_available() -> bool:
+    """Returns True if the native library is built and can be loaded."""
+    try:
+        _load_library()
+    except OSError:
+        return False
+    return True
+
+
+def is_tracing_available() -> bool:
+    """Returns True if the native library is built with tracing."""
+    return is_available() and bool(_load_library().trace_available())
+
+
+def drain_trace() -> list[dict]:
+    """
+    Returns (and removes) the events recorded by the native library
+    (if built with tracing): their name, code path, start (in
+    time.perf_counter seconds), duration (seconds), pixels, value
+    (such as a thread count or band number) and thread ID.
+    """
+    library = _load_library()
+    events = (TraceEvent * TRACE_DRAIN_EVENTS)()
+    # Offset of perf_counter from the trace clock.
+    offset = time.perf_counter() - library.trace_clock() / 1e9
+    drained = []
+    while count := library.drain_trace(events, TRACE_DRAIN_EVENTS):
+        drained.extend({
+            "name": event.name.decode(), "path": event.path.decode(),
+            "start": event.start / 1e9 + offset,
+            "duration": event.duration / 1e9, "pixels": event.pixels,
+            "value": event.value, "thread": event.thread}
+            for event in events[:count])
+    return drained
+
+
+# Whether native recording is enabled (for tracers).
+_native_tracing = False
+
+
+@contextlib.contextmanager
+def _trace_native(library: ctypes.CDLL) -> Iterator[None]:
+    # Enables native recording around a native call while any tracer
+    # is recording (if built with tracing), then adds the recorded
+    # events to the tracers.
+    global _native_tracing
+    tracers = get_tracers()
+    if not tracers or not library.trace_available():
+        if _native_tracing:
+            _native_tracing = False
+            library.set_trace(0)
+        yield
+        return
+    if not _native_tracing:
+        _native_tracing = True
+        library.set_trace(1)
+    try:
+        yield
+    finally:
+        for event in drain_trace():
+            args = {
+                "path": event["path"], "pixels": event["pixels"],
+                "value": event["value"]}
+            for tracer in tracers:
+                tracer.add_complete(
+                    event["name"], CATEGORY_NATIVE, event["start"],
+                    event["duration"], args, event["thread"])
+
+
+def _get_tile_url(panorama_id: str, zoom: int, x: int, y: int) -> bytes:
+    params = urllib.parse.urlencode(get_tile_params(panorama_id, zoom, x, y))
+    return f"{panorama.PANORAMA_DOWNLOAD_API}?{params}".encode()
+
+
+def _fetch_tiles(
+    panorama_id: str, zoom: int, coordinates: list[tuple[int, int]],
+    connections: int, keep: bool = True, image: bytearray = None,
+    settings: PanoramaSettings = None
+) -> list[bytes] | None:
+    # Downloads tiles natively, returning their bytes if to be kept.
+    # If an image buffer is given, tiles are decoded straight into it,
+    # at their positions within the settings.
+    library = _load_library()
+    urls = (ctypes.c_char_p * len(coordinates))(*(
+        _get_tile_url(panorama_id, zoom, x, y) for x, y in coordinates))
+    output = positions = None
+    width = height = 0
+    if image is not None:
+        min_x, min_y = settings.top_left
+        width = settings.width * TILE_WIDTH
+        height = settings.height * TILE_HEIGHT
+        output = (ctypes.c_char * len(image)).from_buffer(image)
+        positions = (ctypes.c_int * (2 * len(coordinates)))(*(
+            value for x, y in coordinates for value in (
+                (x - min_x) * TILE_WIDTH, (y - min_y) * TILE_HEIGHT)))
+    # Each request (and retry) is paced by the rate limiter, if any
+    # (else null), which the native loop calls back into (taking the
+    # GIL).
+    reserve = RESERVE_FUNCTION()
+    rate_limiter = panorama.get_rate_limiter()
+    if rate_limiter is not None:
+        reserve = RESERVE_FUNCTION(rate_limiter.reserve)
+    # The GIL is released for the duration of the download (including
+    # the decoding into the image, if any), during which all the tiles
+    # are in flight.
+    with (
+        stage(STAGE_DOWNLOAD), _trace_native(library),
+        in_flight(len(coordinates))
+    ):
+        fetch = library.fetch_tiles(
+            urls, len(coordinates), connections, MAX_RETRIES, positions,
+            output, width, height, reserve)
+    try:
+        if retries := library.fetch_retries(fetch):
+            count(RETRIES, retries)
+        error = library.fetch_error(fetch)
+        if error is not None:
+            raise rq.RequestException(error.decode())
+        # Sizes are read whether or not the tiles are kept.
+        size = ctypes.c_size_t()
+        tiles = []
+        total = 0
+        for i in range(len(coordinates)):
+            data = library.fetch_tile(fetch, i, ctypes.byref(size))
+            total += size.value
+            if keep:
+                tiles.append(ctypes.string_at(data, size.value))
+        count(TILES_DOWNLOADED, len(coordinates))
+        count(BYTES_DOWNLOADED, total)
+        return tiles if keep else None
+    finally:
+        library.free_fetch(fetch)
+
+
+def get_tiles(
+    panorama_id: str, settings: PanoramaSettings = None,
+    cache: PanoramaCache = None, journal: TileJournal = None,
+    connections: int = DEFAULT_CONNECTIONS
+) -> list[list[bytes]]:
+    """
+    Native equivalent of panorama.get_tiles, downloading the tiles over
+    at most the given number of connections (multiplexed over HTTP/2
+    where the server supports it). Cache and journal usage is the same.
+    """
+    settings = validate_download(panorama_id, settings)
+    min_x, min_y = settings.top_left
+    images = [[None] * settings.width for _ in range(settings.height)]
+    cached, missing = get_cached_tiles(
+        panorama_id, settings, cache, journal)
+    for x, y, tile in cached:
+        images[y-min_y][x-min_x] = tile
+    if not missing:
+        return images
+    tiles = _fetch_tiles(panorama_id, settings.zoom, missing, connections)
+    for (x, y), tile in zip(missing, tiles):
+        store_tile(panorama_id, settings.zoom, x, y, tile, cache, journal)
+        images[y-min_y][x-min_x] = tile
+    return images
+
+
+def get_pil_panorama(
+    panorama_id: str, settings: PanoramaSettings = None,
+    crop_black_edges: bool = True, cache: PanoramaCache = None,
+    journal: TileJournal = None, connections: int = DEFAULT_CONNECTIONS
+) -> Image.Image:
+    """
+    Native equivalent of panorama.get_pil_panorama, decoding each tile
+    straight into the panorama as soon as it has downloaded.
+    All tiles in the settings are downloaded, black edges or not.
+    """
+    settings = validate_download(panorama_id, settings)
+    if settings.width > MAX_TILES_WIDTH or settings.height > MAX_TILES_HEIGHT:
+        raise ValueError(
+            f"A full image can only be up to {MAX_TILES_WIDTH} tiles in width "
+            f"and {MAX_TILES_HEIGHT} tiles in height.")
+    library = _load_library()
+    min_x, min_y = settings.top_left
+    width = settings.width * TILE_WIDTH
+    height = settings.height * TILE_HEIGHT
+    image = bytearray(width * height * CHANNELS)
+    output = (ctypes.c_char * len(image)).from_buffer(image)
+    cached, missing = get_cached_tiles(
+        panorama_id, settings, cache, journal)
+    for x, y, tile in cached:
+        with stage(STAGE_DECODE):
+            result = library.decode_tile(
+                tile, len(tile), output, width, height,
+                (x - min_x) * TILE_WIDTH, (y - min_y) * TILE_HEIGHT)
+        if result:
+            raise ValueError("Tile could not be decoded.")
+    if missing:
+        # Tile bytes are only needed if they are to be stored.
+        keep = cache is not None or journal is not None
+        tiles = _fetch_tiles(
+            panorama_id, settings.zoom, missing, connections, keep, image,
+            settings)
+        if keep:
+            for (x, y), tile in zip(missing, tiles):
+                store_tile(
+                    panorama_id, settings.zoom, x, y, tile, cache, journal)
+    pil_image = Image.frombuffer("RGB", (width, height), image, "raw")
+    return crop_black_image_edges(pil_image) if crop_black_edges else pil_image
+
+
+def encode_jpeg_view(
+    image: Image.Image, quality: int, subsampling: int, threads: int = 0
+) -> memoryview:
+    """
+    Encodes an image as a baseline JPEG in horizontal strips, on the
+    given number of threads (0 for all cores). Quality [1-100] and chroma
+    subsampling (0: 4:4:4, 1: 4:2:2, 2: 4:2:0) are as for PIL.
+    Returns a view of the encoder's output buffer (not copied), which is
+    released once no longer referenced.
+    """
+    validate_jpeg_options(quality, subsampling)
+    library = _load_library()
+    if image.mode != "RGB":
+        image = image.convert("RGB")
+    pixels = image.tobytes()
+    data = ctypes.c_void_p()
+    with _trace_native(library):
+        size = library.encode_jpeg(
+            pixels, image.width, image.height, quality, subsampling,
+            threads, ctypes.byref(data))
+    if not size:
+        raise ValueError("Image could not be encoded.")
+    buffer = (ctypes.c_char * size).from_address(data.value)
+    weakref.finalize(buffer, library.free_jpeg, data.value)
+    # Views reference the buffer, keeping it alive.
+    return memoryview(buffer).cast("B")
+
+
+def encode_jpeg(
+    image: Image.Image, quality: int, subsampling: int, threads: int = 0
+) -> bytes:
+    """As encode_jpeg_view, but returns a copy of the JPEG as bytes."""
+    return bytes(encode_jpeg_view(image, quality, subsampling, threads))
+
+
+def _get_equirectangular(
+    source: Image.Image | RawPanorama
+) -> tuple[bytes | ctypes.Array, int, int]:
+    # Returns the pixels of an equirectangular panorama (2:1) for the
+    # native kernels, as a view of the mapping if a raw file, and its size.
+    if isinstance(source, RawPanorama) and source.is_cubemap:
+        raise ValueError("Source must be an equirectangular panorama.")
+    width, height = source.width, source.height
+    if width < 4 or height != width // 2:
+        raise ValueError("Panorama must be 2:1 and at least 4 pixels wide.")
+    if isinstance(source, RawPanorama):
+        pixels = (ctypes.c_char * source.data_size).from_buffer(
+            source.buffer, source.data_offset)
+        return pixels, width, height
+    if source.mode != "RGB":
+        source = source.convert("RGB")
+    return source.tobytes(), width, height
+
+
+def get_cubemap(source: Image.Image | RawPanorama) -> list[Image.Image]:
+    """
+    Converts an equirectangular panorama (2:1), as an image or a raw
+    panorama file (read without decoding or copying), to the six faces
+    of a cubemap, each a quarter of the panorama width square, in the
+    order of CUBEMAP_FACES. Faces are upright as seen from the inside;
+    the faces looking down and up adjoin the front face.
+    """
+    library = _load_library()
+    pixels, width, height = _get_equirectangular(source)
+    edge = width // 4
+    face_size = edge * edge * CHANNELS
+    output = bytearray(len(CUBEMAP_FACES) * face_size)
+    # The GIL is released while the cubemap is computed.
+    with stage(STAGE_CUBEMAP), _trace_native(library):
+        library.set_cubemap(
+            pixels, width, height,
+            (ctypes.c_char * len(output)).from_buffer(output))
+    count(BYTES_ALLOCATED, len(output))
+    count(CUBEMAP_PIXELS, len(output) // CHANNELS)
+    view = memoryview(output)
+    return [
+        Image.frombuffer(
+            "RGB", (edge, edge), view[i * face_size:(i + 1) * face_size],
+            "raw")
+        for i in range(len(CUBEMAP_FACES))]
+
+
+def download_cubemap(
+    panorama_id: str, settings: PanoramaSettings = None,
+    crop_black_edges: bool = True, cache: PanoramaCache = None,
+    hedge: HedgePolicy = None, journal: TileJournal = None
+) -> list[Image.Image]:
+    """
+    Downloads a panorama (see panorama.get_pil_panorama) and converts
+    it to a cubemap as get_cubemap, stretching it to 2:1 if it is not,
+    such as once black edges are cropped. If a cache is provided, a
+    cached cubemap is returned directly (shared, so do not modify its
+    faces in place), else the cubemap is cached.
+    """
+    if settings is None:
+        settings = PanoramaSettings()
+    if cache is not None:
+        key = get_panorama_key(panorama_id, settings, crop_black_edges)
+        faces = cache.cubemaps.get(key)
+        count(CACHE_MISSES if faces is None else CACHE_HITS)
+        if faces is not None:
+            return faces
+    image = panorama.get_pil_panorama(
+        panorama_id, settings, crop_black_edges=crop_black_edges,
+        cache=cache, hedge=hedge, journal=journal)
+    if image.height != image.width // 2:
+        image = image.resize((image.width, image.width // 2))
+    faces = get_cubemap(image)
+    if cache is not None:
+        cache.cubemaps.put(key, faces)
+    return faces
+
+
+def validate_view_size(width: int, height: int) -> None:
+    """Raises an error if a view size is invalid."""
+    if not isinstance(width, int) or not isinstance(height, int):
+        raise TypeError("Width and height must be integers.")
+    if width < 1 or height < 1:
+        raise ValueError("Width and height must be positive.")
+
+
+def project(
+    source: Image.Image | RawPanorama, width: int, height: int,
+    pitch: float, yaw: float, fov: float
+) -> Image.Image:
+    """
+    Renders a view (width x height) of a panorama at the pitch, yaw
+    and field of view (degrees) as taken by the projection kernel
+    (cpp/projection.cpp). The source is an equirectangular image or
+    raw panorama file, or a raw cubemap file, which is fastest, the
+    view being looked up from the faces rather than computed.
+    Raw files are read through their mapping, without decoding.
+    """
+    validate_view_size(width, height)
+    library = _load_library()
+    output = bytearray(width * height * CHANNELS)
+    if isinstance(source, RawPanorama) and source.is_cubemap:
+        pixels = None
+        # The base of each face in the mapping (faces are padded).
+        faces = [
+            (ctypes.c_char * (source.width * source.height * CHANNELS))
+            .from_buffer(source.buffer, offset)
+            for offset in source.face_offsets]
+        cubemap = (ctypes.c_void_p * len(faces))(
+            *map(ctypes.addressof, faces))
+        # Faces are a quarter of the equirectangular width.
+        input_width, input_height = 4 * source.width, 2 * source.width
+    else:
+        cubemap = None
+        pixels, input_width, input_height = _get_equirectangular(source)
+    with stage(STAGE_PROJECT), _trace_native(library):
+        library.project(
+            pixels, input_width, input_height,
+            (ctypes.c_char * len(output)).from_buffer(output), width,
+            height, pitch, yaw, fov, cubemap)
+    count(BYTES_ALLOCATED, len(output))
+    count(PROJECT_PIXELS, width * height)
+    return Image.frombuffer("RGB", (width, height), output, "raw")
+
@@ -5,16 +5,37 @@ the panorama IDs for the panoramas they wish to download.
 Also, zooming in/out is supported, alongside partial downloading.
 """
 import asyncio
+import contextvars
+import functools
 import io
-import itertools
+import math
+import queue
+import socket
 import string
+import sys
+import threading
 import time
+from concurrent.futures import Future, ThreadPoolExecutor
+from typing import (
+    Any, AsyncIterator, BinaryIO, Callable, Coroutine, Iterator)
 
 import aiohttp
 import requests as rq
 from PIL import Image
 
-from _utils import _split_array
+from cache import LRUCache, PanoramaCache
+from encoding import (
+    DEFAULT_QUALITY, DEFAULT_SUBSAMPLING, Encoder, JpegEncoder, encode_jpeg)
+from hedging import HedgePolicy
+from http2 import Http2Settings
+from journal import TileJournal
+from ratelimit import RateLimiter
+from stats import (
+    BYTES_DOWNLOADED, CACHE_HITS, CACHE_MISSES, RETRIES, STAGE_CROP,
+    STAGE_DECODE, STAGE_DOWNLOAD, STAGE_PASTE, TILES_CACHED,
+    TILES_DOWNLOADED, TILES_SKIPPED, count, count_image, count_status,
+    in_flight, stage)
+from tracing import trace_async
 
 
 MIN_ZOOM = 0
@@ -28,8 +49,19 @@ PANORAMA_ID_LENGTH = 22
 PANORAMA_DOWNLOAD_API = "https://streetviewpixels-pa.googleapis.com/v1/tile"
 MAX_RETRIES = 2
 MAX_ASYNC_COROUTINES = 8
+# Seconds between checks for a stopped iteration in the background thread.
+THREAD_POLL_INTERVAL = 0.1
 TILE_WIDTH = 512
 TILE_HEIGHT = 512
+# Panoramas are probed for their extent from zoom 0 at this zoom or above.
+EXTENT_PROBE_MIN_ZOOM = 3
+# Safety margin (in tiles at the requested zoom) added to extents, since
+# they are only as exact as the zoom 0 tile or crop they were found from,
+# which can take dark content (such as at night) for a black edge.
+EXTENT_MARGIN = 1
+# Image.info key of the number of tiles skipped as black edges.
+SKIPPED_TILES_INFO = "skipped_tiles"
+MAX_EXTENT_RECORDS = 65536
 
 
 def get_max_coordinates(zoom: int) -> tuple[int, int]:
@@ -161,155 +193,652 @@ def validate_panorama_id(panorama_id: str) -> None:
             "and dashes/underscores.")
 
 
-async def _get_async_images_batch(
-    array: list[list], batch: list[tuple], panorama_id: str,
-    settings: PanoramaSettings
+def get_panorama_key(
+    panorama_id: str, settings: PanoramaSettings, crop_black_edges: bool
+) -> tuple:
+    """
+    Returns the key of a panorama (or of its cubemap) downloaded with
+    the settings, in the panorama and cubemap levels of a cache.
+    """
+    return (
+        panorama_id, settings.zoom, settings.top_left,
+        settings.bottom_right, crop_black_edges)
+
+
+# Process-wide rate limiter for tile requests (None for no limit).
+_rate_limiter = None
+
+
+def set_rate_limiter(rate_limiter: RateLimiter | None) -> None:
+    """
+    Sets the rate limiter all tile requests of this process must pass,
+    or removes it if None. Share one limiter between processes to
+    limit their total request rate.
+    """
+    global _rate_limiter
+    _rate_limiter = rate_limiter
+
+
+def get_rate_limiter() -> RateLimiter | None:
+    """
+    Returns the rate limiter tile requests of this process must pass,
+    or None if there is no limit.
+    """
+    return _rate_limiter
+
+
+# Tiles currently downloading in this process, by (panorama ID, zoom, x, y),
+# so that concurrent requesters of a tile share a single download.
+_in_flight = {}
+_in_flight_lock = threading.Lock()
+
+
+class _AbandonedFlight(Exception):
+    # Raised to requesters sharing a download which was cancelled.
+    pass
+
+
+def _join_flight(key: tuple[str, int, int, int]) -> tuple[Future, bool]:
+    # Returns the future of the in-flight download of a tile, and whether
+    # the caller is the leader, responsible for downloading the tile.
+    with _in_flight_lock:
+        future = _in_flight.get(key)
+        if future is not None:
+            return future, False
+        future = Future()
+        # A running future cannot be cancelled by followers.
+        future.set_running_or_notify_cancel()
+        _in_flight[key] = future
+        return future, True
+
+
+def _land_flight(
+    key: tuple[str, int, int, int], future: Future, tile: bytes = None,
+    error: BaseException = None
 ) -> None:
-    min_x, min_y = settings.top_left
-    async with aiohttp.ClientSession() as session:
-        for y, x in batch:
-            params = {
-                "cb_client": "maps_sv.tactile", "panoid": panorama_id,
-                "x": x, "y": y, "zoom": settings.zoom
-            }
-            retries = MAX_RETRIES
-            while True:
-                try:
-                    async with session.get(
-                        PANORAMA_DOWNLOAD_API, params=params
-                    ) as response:
-                        match response.status:
-                            case 200:
-                                array[y-min_y][x-min_x] = await response.read()
-                                break
-                            case 400:
-                                raise rq.RequestException("400 - Bad Request")
-                            case _:
-                                raise rq.RequestException(
-                                    f"{response.status} "
-                                    "- something went wrong.")
-                except Exception as e:
-                    if not retries:
-                        raise e
-                    time.sleep(1)
-                retries -= 1
-    
+    # Completes an in-flight download, passing its outcome to followers.
+    with _in_flight_lock:
+        del _in_flight[key]
+    if error is None:
+        future.set_result(tile)
+    elif isinstance(error, Exception):
+        future.set_exception(error)
+    else:
+        # The leader was cancelled, so another requester must take over.
+        future.set_exception(_AbandonedFlight())
+
+
+async def _get_shared_async_tile(
+    panorama_id: str, zoom: int, x: int, y: int,
+    download: Callable[[], Coroutine[Any, Any, bytes]]
+) -> bytes:
+    # Downloads a tile unless it is already downloading, in which case
+    # the in-flight download is awaited instead (from any thread/loop).
+    key = (panorama_id, zoom, x, y)
+    while True:
+        future, leader = _join_flight(key)
+        if leader:
+            try:
+                tile = await download()
+            except BaseException as e:
+                _land_flight(key, future, error=e)
+                raise e
+            _land_flight(key, future, tile)
+            return tile
+        try:
+            return await asyncio.wrap_future(future)
+        except _AbandonedFlight:
+            continue
+
+
+def _get_shared_tile(
+    panorama_id: str, zoom: int, x: int, y: int,
+    download: Callable[[], bytes]
+) -> bytes:
+    # Synchronous equivalent of `_get_shared_async_tile`.
+    key = (panorama_id, zoom, x, y)
+    while True:
+        future, leader = _join_flight(key)
+        if leader:
+            try:
+                tile = download()
+            except BaseException as e:
+                _land_flight(key, future, error=e)
+                raise e
+            _land_flight(key, future, tile)
+            return tile
+        try:
+            return future.result()
+        except _AbandonedFlight:
+            continue
+
+
+# Process-wide HTTP/2 client settings (None for HTTP/1.1 only).
+_http2 = None
+
+
+def set_http2(settings: Http2Settings | None) -> None:
+    """
+    Sets tile requests of this process to be made over HTTP/2 with the
+    given settings, or over HTTP/1.1 (the default) if None.
+    """
+    global _http2
+    _http2 = settings
+
+
+def get_http2() -> Http2Settings | None:
+    """
+    Returns the HTTP/2 client settings of this process, or None if
+    requests are made over HTTP/1.1.
+    """
+    return _http2
+
+
+def get_tile_params(panorama_id: str, zoom: int, x: int, y: int) -> dict:
+    """Returns the query parameters of a tile download request."""
+    return {
+        "cb_client": "maps_sv.tactile", "panoid": panorama_id,
+        "x": x, "y": y, "zoom": zoom
+    }
+
 
-async def _get_async_images(
-    array: list[list], panorama_id: str, settings: PanoramaSettings
+async def _get_async_response(
+    session: "aiohttp.ClientSession | httpx.AsyncClient", params: dict
+) -> tuple[int, bytes]:
+    # Sends a tile request with either client, returning the status code
+    # and content.
+    if isinstance(session, aiohttp.ClientSession):
+        async with session.get(
+            PANORAMA_DOWNLOAD_API, params=params
+        ) as response:
+            return response.status, await response.read()
+    response = await session.get(PANORAMA_DOWNLOAD_API, params=params)
+    return response.status_code, response.content
+
+
+async def _get_async_tile(
+    session: "aiohttp.ClientSession | httpx.AsyncClient", panorama_id: str,
+    zoom: int, x: int, y: int
+) -> bytes:
+    # Downloads a single tile asynchronously.
+    params = get_tile_params(panorama_id, zoom, x, y)
+    retries = MAX_RETRIES
+    with (
+        trace_async("tile", panorama_id=panorama_id, zoom=zoom, x=x, y=y),
+        in_flight()
+    ):
+        while True:
+            try:
+                if _rate_limiter is not None:
+                    await _rate_limiter.acquire_async()
+                status, content = await _get_async_response(session, params)
+                count_status(status)
+                match status:
+                    case 200:
+                        count(BYTES_DOWNLOADED, len(content))
+                        return content
+                    case 400:
+                        raise rq.RequestException("400 - Bad Request")
+                    case _:
+                        raise rq.RequestException(
+                            f"{status} - something went wrong.")
+            except Exception as e:
+                if not retries:
+                    raise e
+                count(RETRIES)
+                await asyncio.sleep(1)
+            retries -= 1
+
+
+async def _get_hedged_tile(
+    session: "aiohttp.ClientSession | httpx.AsyncClient", panorama_id: str,
+    zoom: int, x: int, y: int, hedge: HedgePolicy
+) -> bytes:
+    # Downloads a single tile, sending a duplicate request if the
+    # original is slow and the budget allows, using the first to finish.
+    start = time.perf_counter()
+    original = asyncio.create_task(
+        _get_async_tile(session, panorama_id, zoom, x, y))
+    pending = {original}
+    delay = hedge.delay()
+    if delay is not None:
+        done, _ = await asyncio.wait(pending, timeout=delay)
+        if not done and hedge.try_hedge():
+            pending.add(asyncio.create_task(
+                _get_async_tile(session, panorama_id, zoom, x, y)))
+    try:
+        while True:
+            done, pending = await asyncio.wait(
+                pending, return_when=asyncio.FIRST_COMPLETED)
+            for task in done:
+                if task.exception() is None:
+                    hedge.record(
+                        time.perf_counter() - start, task is not original)
+                    return task.result()
+            if not pending:
+                # All requests failed.
+                raise task.exception()
+    finally:
+        for task in pending:
+            task.cancel()
+
+
+async def _tile_worker(
+    session: "aiohttp.ClientSession | httpx.AsyncClient",
+    coordinates: asyncio.Queue, results: asyncio.Queue, panorama_id: str,
+    zoom: int, hedge: HedgePolicy | None
 ) -> None:
-    # Splits required tiles into batches.
-    batches = _split_array(
-        list(itertools.product(
-            range(settings.top_left[1], settings.bottom_right[1]),
-            range(settings.top_left[0], settings.bottom_right[0]))), 
-        MAX_ASYNC_COROUTINES)
-    await asyncio.gather(
-        *(_get_async_images_batch(array, batch, panorama_id, settings)
-        for batch in batches))
+    # Downloads tiles until none are left, passing on any error.
+    while not coordinates.empty():
+        x, y = coordinates.get_nowait()
+        if hedge is None:
+            download = functools.partial(
+                _get_async_tile, session, panorama_id, zoom, x, y)
+        else:
+            download = functools.partial(
+                _get_hedged_tile, session, panorama_id, zoom, x, y, hedge)
+        try:
+            tile = await _get_shared_async_tile(
+                panorama_id, zoom, x, y, download)
+        except Exception as e:
+            await results.put(e)
+            return
+        await results.put((x, y, tile))
 
 
-def get_tiles(
-    panorama_id: str, settings: PanoramaSettings = None, use_async: bool = True
-) -> list[list[bytes]]:
+def _get_tile(panorama_id: str, zoom: int, x: int, y: int) -> bytes:
+    # Downloads a single tile serially.
+    params = get_tile_params(panorama_id, zoom, x, y)
+    retries = MAX_RETRIES
+    with (
+        trace_async("tile", panorama_id=panorama_id, zoom=zoom, x=x, y=y),
+        in_flight()
+    ):
+        while True:
+            try:
+                if _rate_limiter is not None:
+                    _rate_limiter.acquire()
+                if _http2 is None:
+                    response = rq.get(PANORAMA_DOWNLOAD_API, params)
+                    status, content = response.status_code, response.content
+                else:
+                    status, content = _http2.get(PANORAMA_DOWNLOAD_API, params)
+                count_status(status)
+                match status:
+                    case 200:
+                        count(BYTES_DOWNLOADED, len(content))
+                        return content
+                    case 400:
+                        raise rq.RequestException("400 - Bad Request")
+                    case _:
+                        raise rq.RequestException(
+                            f"{status} - something went wrong.")
+            except Exception as e:
+                if not retries:
+                    raise e
+                count(RETRIES)
+                time.sleep(1)
+            retries -= 1
+
+
+def validate_download(
+    panorama_id: str, settings: PanoramaSettings | None
+) -> PanoramaSettings:
     """
-    Returns a 2D list of images in bytes, where each element is
-    one tile at one (x, y) coordinate, as defined in the settings.
-    If settings are not provided, use the default settings.
-    If use_async is set to True, then speed up image downloads using
-    asynchronous processing. Otherwise, use standard, serial requests.
+    Validates the arguments of a panorama download, returning the
+    settings to use (the defaults if None).
     """
     validate_panorama_id(panorama_id)
     if settings is None:
         settings = PanoramaSettings()
     if not isinstance(settings, PanoramaSettings):
         raise TypeError("Settings must be a PanoramaSettings object.")
-    if use_async and settings.tiles > 1:
-        images = [[None] * settings.width for _ in range(settings.height)]
+    return settings
+
+
+def get_cached_tiles(
+    panorama_id: str, settings: PanoramaSettings, cache: PanoramaCache | None,
+    journal: TileJournal | None
+) -> tuple[list[tuple[int, int, bytes]], list[tuple[int, int]]]:
+    """
+    Splits the tiles of the settings into those available from the cache
+    or journal, as (x, y, tile bytes), and those which must be
+    downloaded, as (x, y). Cache hits and misses are counted.
+    """
+    # Imported here to avoid a circular import.
+    from pyramid import derive_tile
+    cached = []
+    missing = []
+    for y in range(settings.top_left[1], settings.bottom_right[1]):
+        for x in range(settings.top_left[0], settings.bottom_right[0]):
+            tile = None
+            if cache is not None:
+                tile = (
+                    cache.tiles.get((panorama_id, settings.zoom, x, y))
+                    or derive_tile(cache, panorama_id, settings.zoom, x, y))
+                count(CACHE_MISSES if tile is None else CACHE_HITS)
+            if tile is None and journal is not None:
+                tile = journal.get(panorama_id, settings.zoom, x, y)
+                if tile is not None and cache is not None:
+                    cache.tiles.put((panorama_id, settings.zoom, x, y), tile)
+            if tile is None:
+                missing.append((x, y))
+            else:
+                cached.append((x, y, tile))
+    if cached:
+        count(TILES_CACHED, len(cached))
+    return cached, missing
+
+
+def store_tile(
+    panorama_id: str, zoom: int, x: int, y: int, tile: bytes,
+    cache: PanoramaCache | None, journal: TileJournal | None
+) -> None:
+    """Adds a downloaded tile to the cache and journal, where given."""
+    if cache is not None:
+        cache.tiles.put((panorama_id, zoom, x, y), tile)
+    if journal is not None:
+        journal.put(panorama_id, zoom, x, y, tile)
+
+
+def _run_async(coroutine: Coroutine) -> Any:
+    # Runs a coroutine in a new event loop.
+    if sys.platform == "win32":
         asyncio.set_event_loop_policy(asyncio.WindowsSelectorEventLoopPolicy())
-        asyncio.run(_get_async_images(images, panorama_id, settings))
+    return asyncio.run(coroutine)
+
+
+async def iter_tiles_async(
+    panorama_id: str, settings: PanoramaSettings = None,
+    cache: PanoramaCache = None, buffer: int = MAX_ASYNC_COROUTINES,
+    hedge: HedgePolicy = None, journal: TileJournal = None
+) -> AsyncIterator[tuple[int, int, bytes]]:
+    """
+    Asynchronously yields (x, y, tile bytes) for each tile defined in
+    the settings, in order of completion (cached tiles first).
+    At most `buffer` downloaded tiles wait to be consumed, after which
+    downloading pauses until the consumer catches up.
+    If a cache is provided, downloaded tiles are added to it.
+    If a hedge policy is provided, slow tile requests are hedged.
+    If a journal is provided, checkpointed tiles are not downloaded
+    again, and downloaded tiles are checkpointed.
+    """
+    settings = validate_download(panorama_id, settings)
+    if not isinstance(buffer, int) or buffer < 1:
+        raise ValueError("Buffer must be a positive integer.")
+    cached, missing = get_cached_tiles(
+        panorama_id, settings, cache, journal)
+    for tile_info in cached:
+        yield tile_info
+    if not missing:
+        return
+    coordinates = asyncio.Queue()
+    for x, y in missing:
+        coordinates.put_nowait((x, y))
+    results = asyncio.Queue(buffer)
+    if _http2 is None:
+        session = aiohttp.ClientSession()
+        concurrency = MAX_ASYNC_COROUTINES
+    else:
+        # Requests are multiplexed, so many more can be in flight.
+        session = _http2.create_async_client()
+        concurrency = _http2.streams
+    async with session:
+        workers = [
+            asyncio.create_task(_tile_worker(
+                session, coordinates, results, panorama_id, settings.zoom,
+                hedge))
+            for _ in range(min(concurrency, len(missing)))]
+        try:
+            for _ in range(len(missing)):
+                result = await results.get()
+                if isinstance(result, Exception):
+                    raise result
+                x, y, tile = result
+                count(TILES_DOWNLOADED)
+                store_tile(
+                    panorama_id, settings.zoom, x, y, tile, cache, journal)
+                yield x, y, tile
+        finally:
+            # Stops remaining downloads if finished early or failed.
+            for worker in workers:
+                worker.cancel()
+            await asyncio.gather(*workers, return_exceptions=True)
+
+
+def iter_tiles(
+    panorama_id: str, settings: PanoramaSettings = None,
+    cache: PanoramaCache = None, buffer: int = MAX_ASYNC_COROUTINES,
+    hedge: HedgePolicy = None, journal: TileJournal = None
+) -> Iterator[tuple[int, int, bytes]]:
+    """
+    Synchronous wrapper of iter_tiles_async, yielding (x, y, tile bytes)
+    in order of completion. The downloads run on a background thread,
+    pausing whenever `buffer` tiles are waiting to be consumed.
+    """
+    results = queue.Queue(buffer)
+    stop = threading.Event()
+    # Marks the end of the tiles.
+    end = object()
+
+    def put(item: Any) -> bool:
+        # Blocks until the item is queued, unless iteration stopped.
+        while not stop.is_set():
+            try:
+                results.put(item, timeout=THREAD_POLL_INTERVAL)
+                return True
+            except queue.Full:
+                pass
+        return False
+
+    async def produce() -> None:
+        # Queues from a worker thread, so that the event loop keeps
+        # downloading (and timing hedges and rate limits) while waiting
+        # for a slow consumer.
+        try:
+            async for tile_info in iter_tiles_async(
+                panorama_id, settings, cache, buffer, hedge, journal
+            ):
+                if not await asyncio.to_thread(put, tile_info):
+                    return
+        except Exception as e:
+            await asyncio.to_thread(put, e)
+            return
+        await asyncio.to_thread(put, end)
+
+    # In a copy of this context, so that stats collecting around the
+    # caller (see stats.collect) record the downloads.
+    thread = threading.Thread(
+        target=contextvars.copy_context().run,
+        args=(_run_async, produce()), daemon=True)
+    thread.start()
+    try:
+        while (item := results.get()) is not end:
+            if isinstance(item, Exception):
+                raise item
+            yield item
+    finally:
+        stop.set()
+        thread.join()
+
+
+async def _collect_tiles(
+    images: list[list], panorama_id: str, settings: PanoramaSettings,
+    cache: PanoramaCache | None, hedge: HedgePolicy | None,
+    journal: TileJournal | None
+) -> None:
+    min_x, min_y = settings.top_left
+    async for x, y, tile in iter_tiles_async(
+        panorama_id, settings, cache, hedge=hedge, journal=journal
+    ):
+        images[y-min_y][x-min_x] = tile
+
+
+def _get_tiles(
+    panorama_id: str, settings: PanoramaSettings, use_async: bool,
+    cache: PanoramaCache | None, hedge: HedgePolicy | None,
+    journal: TileJournal | None
+) -> list[list[bytes]]:
+    # Downloads the tiles of validated settings (see get_tiles).
+    min_x, min_y = settings.top_left
+    images = [[None] * settings.width for _ in range(settings.height)]
+    if use_async and settings.tiles > 1:
+        _run_async(
+            _collect_tiles(
+                images, panorama_id, settings, cache, hedge, journal))
         return images
     # Serial requests.
-    images = []
-    for y in range(settings.top_left[1], settings.bottom_right[1]):
-        image_row = []
-        for x in range(settings.top_left[0], settings.bottom_right[0]):
-            params = {
-                "cb_client": "maps_sv.tactile", "panoid": panorama_id,
-                "x": x, "y": y, "zoom": settings.zoom
-            }
-            retries = MAX_RETRIES
-            while True:
-                try:
-                    response = rq.get(PANORAMA_DOWNLOAD_API, params)
-                    match response.status_code:
-                        case 200:
-                            image_data = response.content
-                            image_row.append(image_data)
-                            break
-                        case 400:
-                            raise rq.RequestException("400 - Bad Request")
-                        case _:
-                            raise rq.RequestException(
-                                f"{response.status_code} "
-                                "- something went wrong.")
-                except Exception as e:
-                    if not retries:
-                        raise e
-                    time.sleep(1)
-                retries -= 1
-        images.append(image_row)
+    cached, missing = get_cached_tiles(
+        panorama_id, settings, cache, journal)
+    for x, y, tile in cached:
+        images[y-min_y][x-min_x] = tile
+    for x, y in missing:
+        tile = _get_shared_tile(
+            panorama_id, settings.zoom, x, y,
+            functools.partial(_get_tile, panorama_id, settings.zoom, x, y))
+        count(TILES_DOWNLOADED)
+        store_tile(panorama_id, settings.zoom, x, y, tile, cache, journal)
+        images[y-min_y][x-min_x] = tile
     return images
 
 
+def get_tiles(
+    panorama_id: str, settings: PanoramaSettings = None,
+    use_async: bool = True, cache: PanoramaCache = None,
+    hedge: HedgePolicy = None, journal: TileJournal = None
+) -> list[list[bytes]]:
+    """
+    Returns a 2D list of images in bytes, where each element is
+    one tile at one (x, y) coordinate, as defined in the settings.
+    If settings are not provided, use the default settings.
+    If use_async is set to True, then speed up image downloads using
+    asynchronous processing. Otherwise, use standard, serial requests.
+    If a cache is provided, only tiles not already cached are downloaded,
+    and downloaded tiles are then added to the cache. Tiles which can be
+    synthesised from cached higher zoom tiles are not downloaded either.
+    If a hedge policy is provided, slow asynchronous tile requests
+    are duplicated as per the policy.
+    If a journal is provided, each downloaded tile is checkpointed, so
+    that if downloading fails, a rerun only downloads the missing tiles.
+    """
+    settings = validate_download(panorama_id, settings)
+    with stage(STAGE_DOWNLOAD):
+        return _get_tiles(
+            panorama_id, settings, use_async, cache, hedge, journal)
+
+
 def get_pil_tiles(
-    panorama_id: str, settings: PanoramaSettings = None, use_async: bool = True
+    panorama_id: str, settings: PanoramaSettings = None,
+    use_async: bool = True, cache: PanoramaCache = None,
+    hedge: HedgePolicy = None, journal: TileJournal = None
 ) -> list[list[Image.Image]]:
     """
     Returns a 2D list of PIL Image objects, where each Image represents a tile
     at a particular (x, y) coordinate specified in the settings.
     If settings are not provided, use the default settings.
     """
-    tiles = get_tiles(panorama_id, settings, use_async)
+    tiles = get_tiles(
+        panorama_id, settings, use_async, cache, hedge, journal)
     return [[Image.open(io.BytesIO(tile)) for tile in row] for row in tiles]
 
 
-def get_pil_panorama(
-    panorama_id: str, settings: PanoramaSettings = None,
-    use_async: bool = True, crop_black_edges: bool = True,
-) -> Image.Image:
+# Known extents of panoramas by panorama ID.
+_extents = LRUCache(MAX_EXTENT_RECORDS, lambda _: 1)
+
+
+def get_content_tiles(
+    zoom: int, extent: tuple[float, float]
+) -> tuple[int, int]:
     """
-    Downloads all required tiles of a panorama,
-    and then merges the tiles together, returning a single PIL Image.
-    The maximum width is 16 tiles, the maximum height is 8 tiles
-    (entire zoom <= 4 possible, partial zoom = 5 possible).
-    By default, also remove black edges seen in some panoramas.
+    Returns the bottom-right coordinates of the tiles at a given zoom
+    containing any content, for a panorama with a given extent.
+    Tiles outside are entirely black so never need to be downloaded,
+    but for a margin of EXTENT_MARGIN tiles.
     """
-    if settings is None:
-        settings = PanoramaSettings()
-    if settings.width > MAX_TILES_WIDTH or settings.height > MAX_TILES_HEIGHT:
-        raise ValueError(
-            f"A full image can only be up to {MAX_TILES_WIDTH} tiles in width "
-            f"and {MAX_TILES_HEIGHT} tiles in height.")
-    tiles = get_tiles(panorama_id, settings, use_async)
+    max_x, max_y = get_max_coordinates(zoom)
+    if zoom == 0:
+        return (max_x, max_y)
+    x = math.ceil(extent[0] * max_x) + EXTENT_MARGIN
+    y = math.ceil(extent[1] * max_y) + EXTENT_MARGIN
+    return (min(max(x, 1), max_x), min(max(y, 1), max_y))
+
+
+def get_extent(
+    panorama_id: str, probe: bool = True, cache: PanoramaCache = None
+) -> tuple[float, float] | None:
+    """
+    Returns the (width, height) proportions of the tile grid which
+    contain content, since some panoramas are smaller than the grid,
+    leaving black bottom/right edges. At zoom 0, the proportions are of
+    the top 512x256 half of the tile, where the whole panorama lies.
+    Known extents are recorded. Otherwise, if probe is True, the extent
+    is detected from the zoom 0 tile, else None is returned.
+    """
+    extent = _extents.get(panorama_id)
+    if extent is not None or not probe:
+        return extent
+    tile = get_tiles(panorama_id, PanoramaSettings(0), cache=cache)[0][0]
+    bounding_box = Image.open(io.BytesIO(tile)).getbbox()
+    if bounding_box is None:
+        # Entirely black, so no extent can be deduced.
+        return (1.0, 1.0)
+    extent = (
+        bounding_box[2] / TILE_WIDTH,
+        min(bounding_box[3] / (TILE_HEIGHT // 2), 1.0))
+    _extents.put(panorama_id, extent)
+    return extent
+
+
+def _record_extent(
+    panorama_id: str, settings: PanoramaSettings, image: Image.Image
+) -> None:
+    # Records the exact extent from a cropped full panorama.
+    max_x, max_y = get_max_coordinates(settings.zoom)
+    if settings.top_left != MIN_COORDINATES or (
+        settings.bottom_right != (max_x, max_y)
+    ):
+        return
+    height = TILE_HEIGHT // 2 if settings.zoom == 0 else max_y * TILE_HEIGHT
+    _extents.put(panorama_id, (
+        image.width / (max_x * TILE_WIDTH), min(image.height / height, 1.0)))
+
+
+def _stitch_tiles(tiles: list[list[bytes | None]]) -> Image.Image:
     # Concatenates rows into single images and then
     # concatenates the rows into a single image.
+    # Missing (None) tiles are left black.
     rows = []
     for row in tiles:
-        row_image = Image.new("RGB", (TILE_WIDTH * len(row), TILE_HEIGHT))
+        row_image = count_image(
+            Image.new("RGB", (TILE_WIDTH * len(row), TILE_HEIGHT)))
         for i, tile in enumerate(row):
-            tile = Image.open(io.BytesIO(tile))
-            row_image.paste(
-                tile, (TILE_WIDTH * i, 0, TILE_WIDTH * (i+1), TILE_HEIGHT))
+            if tile is None:
+                continue
+            with stage(STAGE_DECODE):
+                tile = Image.open(io.BytesIO(tile))
+                tile.load()
+            count_image(tile)
+            with stage(STAGE_PASTE):
+                row_image.paste(
+                    tile,
+                    (TILE_WIDTH * i, 0, TILE_WIDTH * (i+1), TILE_HEIGHT))
         rows.append(row_image)
     width, _ = rows[0].size
     height = TILE_HEIGHT * len(rows)
-    image = Image.new("RGB", (width, height))
-    for i, row in enumerate(rows):
-        image.paste(row, (0, TILE_HEIGHT * i, width, TILE_HEIGHT * (i+1)))
-    if not crop_black_edges:
-        return image
-    # Checks for bottom/right black edges and crops if necessary.
+    image = count_image(Image.new("RGB", (width, height)))
+    with stage(STAGE_PASTE):
+        for i, row in enumerate(rows):
+            image.paste(
+                row, (0, TILE_HEIGHT * i, width, TILE_HEIGHT * (i+1)))
+    return image
+
+
+def crop_black_image_edges(image: Image.Image) -> Image.Image:
+    """
+    Crops any black edges from the bottom and right of an image,
+    returning the image itself if there are none.
+    """
+    width, height = image.size
     pixels = image.load()
     for y in range(height - 1, -1, -1):
         if any(any(pixels[x_, y]) for x_ in range(width)):
@@ -323,19 +852,127 @@ def get_pil_panorama(
     return image.crop(crop_box)
 
 
+def get_pil_panorama(
+    panorama_id: str, settings: PanoramaSettings = None,
+    use_async: bool = True, crop_black_edges: bool = True,
+    cache: PanoramaCache = None, hedge: HedgePolicy = None,
+    journal: TileJournal = None
+) -> Image.Image:
+    """
+    Downloads all required tiles of a panorama,
+    and then merges the tiles together, returning a single PIL Image.
+    The maximum width is 16 tiles, the maximum height is 8 tiles
+    (entire zoom <= 4 possible, partial zoom = 5 possible).
+    By default, also remove black edges seen in some panoramas, in
+    which case tiles known to lie entirely in such black edges are not
+    downloaded, and are counted in the image's info (see
+    SKIPPED_TILES_INFO). From zoom 3, an unknown extent is probed from
+    the zoom 0 tile (see get_extent) while the first row downloads.
+    If a cache is provided, a cached panorama is returned directly
+    (shared, so do not modify it in place).
+    """
+    if settings is None:
+        settings = PanoramaSettings()
+    if settings.width > MAX_TILES_WIDTH or settings.height > MAX_TILES_HEIGHT:
+        raise ValueError(
+            f"A full image can only be up to {MAX_TILES_WIDTH} tiles in width "
+            f"and {MAX_TILES_HEIGHT} tiles in height.")
+    if cache is not None:
+        key = get_panorama_key(panorama_id, settings, crop_black_edges)
+        image = cache.panoramas.get(key)
+        count(CACHE_MISSES if image is None else CACHE_HITS)
+        if image is not None:
+            return image
+    tiles = [[None] * settings.width for _ in range(settings.height)]
+    min_x, min_y = settings.top_left
+    max_x, max_y = settings.bottom_right
+    # Rows downloaded before the extent is known.
+    rows = 0
+    extent = None
+    if crop_black_edges:
+        extent = get_extent(panorama_id, False)
+        if extent is None and settings.zoom >= EXTENT_PROBE_MIN_ZOOM:
+            # The zoom 0 probe runs alongside the first row of tiles,
+            # rather than delaying the download.
+            with ThreadPoolExecutor(1) as executor:
+                probe = executor.submit(
+                    contextvars.copy_context().run, get_extent,
+                    panorama_id, True, cache)
+                row_settings = PanoramaSettings(
+                    settings.zoom, settings.top_left, (max_x, min_y + 1))
+                tiles[0] = get_tiles(
+                    panorama_id, row_settings, use_async, cache, hedge,
+                    journal)[0]
+                extent = probe.result()
+            rows = 1
+    if extent is not None:
+        content_x, content_y = get_content_tiles(settings.zoom, extent)
+        max_x, max_y = min(max_x, content_x), min(max_y, content_y)
+    skipped = settings.tiles - rows * settings.width
+    if max_x > min_x and max_y > min_y + rows:
+        content_settings = PanoramaSettings(
+            settings.zoom, (min_x, min_y + rows), (max_x, max_y))
+        skipped -= content_settings.tiles
+        content_tiles = get_tiles(
+            panorama_id, content_settings, use_async, cache, hedge, journal)
+        for i, row in enumerate(content_tiles):
+            tiles[rows + i][:len(row)] = row
+    if skipped:
+        count(TILES_SKIPPED, skipped)
+    image = _stitch_tiles(tiles)
+    if crop_black_edges:
+        with stage(STAGE_CROP):
+            cropped = crop_black_image_edges(image)
+        if cropped is not image:
+            image = count_image(cropped)
+        _record_extent(panorama_id, settings, image)
+    image.info[SKIPPED_TILES_INFO] = skipped
+    if cache is not None:
+        cache.panoramas.put(key, image)
+    return image
+
+
 def get_panorama(
     panorama_id: str, settings: PanoramaSettings = None,
-    use_async: bool = True, crop_black_edges = True
+    use_async: bool = True, crop_black_edges = True,
+    cache: PanoramaCache = None, hedge: HedgePolicy = None,
+    journal: TileJournal = None, quality: int = DEFAULT_QUALITY,
+    subsampling: int = DEFAULT_SUBSAMPLING, encoder: Encoder = None
 ) -> bytes:
     """
     Downloads all required tiles of a panorama and returns the image
-    with the merged tiles, in bytes.
+    with the merged tiles, in bytes (JPEG, with the given quality and
+    chroma subsampling, encoded in parallel where possible).
+    If an encoder is given (see encoding.py), the image is encoded
+    by it instead, for example as WebP or AVIF.
     The maximum width is 16 tiles, the maximum height is 8 tiles
     (entire zoom <= 4 possible, partial zoom = 5 possible).
     By default, also remove black edges seen in some panoramas.
     """
     image = get_pil_panorama(
-        panorama_id, settings, use_async, crop_black_edges)
-    with io.BytesIO() as f:
-        image.save(f, format="jpeg")
-        return f.getvalue()
+        panorama_id, settings, use_async, crop_black_edges, cache, hedge,
+        journal)
+    if encoder is not None:
+        return encoder.encode(image)
+    return encode_jpeg(image, quality, subsampling)
+
+
+def save_panorama(
+    panorama_id: str, sink: int | socket.socket | BinaryIO,
+    settings: PanoramaSettings = None, use_async: bool = True,
+    crop_black_edges: bool = True, cache: PanoramaCache = None,
+    hedge: HedgePolicy = None, journal: TileJournal = None,
+    encoder: Encoder = None
+) -> int:
+    """
+    As get_panorama, but writes the encoded panorama (JPEG by default)
+    straight from the encoder's buffer to a sink: a file descriptor,
+    socket, file object or writable mmap (see encoding.write_output).
+    Returns the number of bytes written.
+    """
+    if encoder is None:
+        encoder = JpegEncoder()
+    image = get_pil_panorama(
+        panorama_id, settings, use_async, crop_black_edges, cache, hedge,
+        journal)
+    return encoder.encode_to(image, sink)
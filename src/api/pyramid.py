@@ -0,0 +1,142 @@
+"""
+This module synthesises lower zoom tiles locally from cached higher zoom
+tiles, so that a panorama downloaded once at a high zoom can be served
+at any lower zoom without further network requests.
+The tile grid follows `get_max_coordinates`: at zoom >= 1, one tile at
+zoom z covers a 2^(s-z) by 2^(s-z) block of tiles at zoom s. At zoom 0,
+the single tile holds the whole panorama scaled to 512x256, with the
+bottom half of the tile black.
+"""
+import io
+
+from PIL import Image
+
+from cache import PanoramaCache
+from panorama import (
+    MAX_ZOOM, TILE_WIDTH, TILE_HEIGHT, get_max_coordinates,
+    validate_panorama_id)
+
+
+BOX = Image.Resampling.BOX
+LANCZOS = Image.Resampling.LANCZOS
+RESAMPLING_METHODS = (BOX, LANCZOS)
+JPEG_QUALITY = 90
+
+
+def get_source_tiles(
+    zoom: int, x: int, y: int, source_zoom: int
+) -> tuple[tuple[int, int], tuple[int, int]]:
+    """
+    Returns the top-left (inclusive) and bottom-right (exclusive) tile
+    coordinates at the source zoom covered by tile (x, y) at a lower zoom.
+    """
+    if not zoom < source_zoom <= MAX_ZOOM:
+        raise ValueError(
+            f"Source zoom must be greater than the zoom and {MAX_ZOOM} "
+            "or less.")
+    if zoom == 0:
+        # Zoom 0 tile covers the entire panorama.
+        return ((0, 0), get_max_coordinates(source_zoom))
+    factor = 2 ** (source_zoom - zoom)
+    return ((x * factor, y * factor), ((x + 1) * factor, (y + 1) * factor))
+
+
+def _downsample(
+    tiles: list[list[bytes]], factor: int, resample: Image.Resampling
+) -> Image.Image:
+    # Merges the source tiles, scaled down by the factor, into one image.
+    width = TILE_WIDTH * len(tiles[0]) // factor
+    height = TILE_HEIGHT * len(tiles) // factor
+    if resample == BOX:
+        # Tile edges align with the box boundaries, so each tile can be
+        # reduced independently, keeping memory usage low.
+        image = Image.new("RGB", (width, height))
+        tile_width = TILE_WIDTH // factor
+        tile_height = TILE_HEIGHT // factor
+        for i, row in enumerate(tiles):
+            for j, tile in enumerate(row):
+                tile = Image.open(io.BytesIO(tile)).reduce(factor)
+                image.paste(tile, (tile_width * j, tile_height * i))
+        return image
+    # Lanczos filtering crosses tile edges, so merge the tiles first.
+    mosaic = Image.new(
+        "RGB", (TILE_WIDTH * len(tiles[0]), TILE_HEIGHT * len(tiles)))
+    for i, row in enumerate(tiles):
+        for j, tile in enumerate(row):
+            tile = Image.open(io.BytesIO(tile))
+            mosaic.paste(tile, (TILE_WIDTH * j, TILE_HEIGHT * i))
+    return mosaic.resize((width, height), resample)
+
+
+def downsample_tiles(
+    tiles: list[list[bytes]], zoom: int, source_zoom: int,
+    resample: Image.Resampling = BOX
+) -> bytes:
+    """
+    Synthesises one tile at the given zoom from the 2D list of source
+    tiles it covers at the source zoom, returning the JPEG bytes.
+    """
+    if resample not in RESAMPLING_METHODS:
+        raise ValueError("Resampling must be BOX or LANCZOS.")
+    if zoom == 0:
+        # Scale to 512x256 and place at the top of a black tile.
+        image = _downsample(tiles, 2 ** source_zoom, resample)
+        tile = Image.new("RGB", (TILE_WIDTH, TILE_HEIGHT))
+        tile.paste(image, (0, 0))
+    else:
+        tile = _downsample(tiles, 2 ** (source_zoom - zoom), resample)
+    with io.BytesIO() as f:
+        tile.save(f, format="jpeg", quality=JPEG_QUALITY)
+        return f.getvalue()
+
+
+def derive_tile(
+    cache: PanoramaCache, panorama_id: str, zoom: int, x: int, y: int,
+    resample: Image.Resampling = BOX
+) -> bytes | None:
+    """
+    Synthesises tile (x, y) at the given zoom from the lowest higher zoom
+    with all covering tiles cached, adding it to the cache.
+    Returns None if no higher zoom is sufficiently cached.
+    """
+    for source_zoom in range(zoom + 1, MAX_ZOOM + 1):
+        top_left, bottom_right = get_source_tiles(zoom, x, y, source_zoom)
+        keys = [
+            [(panorama_id, source_zoom, x_, y_)
+                for x_ in range(top_left[0], bottom_right[0])]
+            for y_ in range(top_left[1], bottom_right[1])]
+        if not all(key in cache.tiles for row in keys for key in row):
+            continue
+        tiles = [[cache.tiles.get(key) for key in row] for row in keys]
+        if any(tile is None for row in tiles for tile in row):
+            # Evicted in the meantime by another thread.
+            continue
+        tile = downsample_tiles(tiles, zoom, source_zoom, resample)
+        cache.tiles.put((panorama_id, zoom, x, y), tile)
+        return tile
+    return None
+
+
+def build_pyramid(
+    cache: PanoramaCache, panorama_id: str, source_zoom: int,
+    resample: Image.Resampling = BOX
+) -> None:
+    """
+    Synthesises every tile of every zoom below the source zoom into the
+    cache, from the cached tiles of the entire panorama at the source zoom.
+    Each level is derived from the level directly above it.
+    """
+    validate_panorama_id(panorama_id)
+    width, height = get_max_coordinates(source_zoom)
+    if not all(
+        (panorama_id, source_zoom, x, y) in cache.tiles
+        for x in range(width) for y in range(height)
+    ):
+        raise ValueError("All source zoom tiles must be cached.")
+    for zoom in range(source_zoom - 1, -1, -1):
+        width, height = get_max_coordinates(zoom)
+        for x in range(width):
+            for y in range(height):
+                tile = derive_tile(cache, panorama_id, zoom, x, y, resample)
+                if tile is None:
+                    raise RuntimeError("Tiles were evicted from the cache.")
@@ -0,0 +1,62 @@
+"""
+This module provides a token bucket rate limiter which can be shared
+between processes, keeping the total request rate of a multi-process
+job under control. The bucket state lives in shared memory.
+"""
+import asyncio
+import multiprocessing
+import time
+
+
+class RateLimiter:
+    """
+    Token bucket allowing `rate` requests per second on average,
+    with bursts of up to `burst` requests. Pass to worker processes
+    on creation (e.g. as Pool initializer arguments) to share it.
+    """
+
+    def __init__(self, rate: float, burst: int = None) -> None:
+        if rate <= 0:
+            raise ValueError("Rate must be positive.")
+        if burst is None:
+            burst = max(1, round(rate))
+        if burst < 1:
+            raise ValueError("Burst must be at least 1.")
+        self._rate = rate
+        self._burst = burst
+        # Available tokens and the time they were last updated.
+        self._state = multiprocessing.Array("d", (burst, time.monotonic()))
+
+    def reserve(self) -> float:
+        """
+        Takes a token without waiting, returning the seconds to wait
+        until the request is allowed (for callers which schedule their
+        own requests, such as the native fetcher).
+        """
+        # Tokens may go negative, queueing requests in order.
+        with self._state.get_lock():
+            now = time.monotonic()
+            tokens, updated = self._state
+            tokens = min(self._burst, tokens + (now - updated) * self._rate)
+            tokens -= 1
+            self._state[0] = tokens
+            self._state[1] = now
+        return max(0, -tokens / self._rate)
+
+    def acquire(self) -> None:
+        """Blocks until a request is allowed."""
+        time.sleep(self.reserve())
+
+    async def acquire_async(self) -> None:
+        """Waits asynchronously until a request is allowed."""
+        await asyncio.sleep(self.reserve())
+
+    @property
+    def rate(self) -> float:
+        """Average requests per second allowed."""
+        return self._rate
+
+    @property
+    def burst(self) -> int:
+        """Maximum requests allowed at once."""
+        return self._burst
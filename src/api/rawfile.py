@@ -0,0 +1,198 @@
+"""
+This module reads and writes raw panorama files (.svraw), holding
+decoded pixels that can be memory-mapped, so that rendering more views
+of a panorama costs no decoding, only page cache. A file is a header
+(120 bytes, zero-padded to the mapping granularity) followed by the
+pixels: either one equirectangular image, or the six faces of a
+cubemap in native.CUBEMAP_FACES order, each padded to the next
+boundary, with the offset of each face in the header. The pixels, and
+each face, start on a boundary of the mapping granularity
+(mmap.ALLOCATIONGRANULARITY, at least a page), so that each face can
+be mapped or read on its own, and the native kernels are given the
+base of each face.
+All integers are little-endian:
+magic (8 bytes), version (u16), layout (u8), pixel format (u8),
+channels (u8), zoom (i8, -1 if unknown), 2 bytes padding,
+width and height (u32, of each face for cubemaps), data offset and
+size (u64, including the padding between faces), six face offsets
+(u64, 0 for equirectangular images) and the panorama ID (32 bytes,
+UTF-8, NUL-padded).
+"""
+import mmap
+import pathlib
+import struct
+
+from PIL import Image
+
+from journal import open_atomic
+
+
+MAGIC = b"SVPANRAW"
+VERSION = 1
+HEADER = struct.Struct("<8sHBBBbxxIIQQ6Q32s")
+HEADER_SIZE = HEADER.size
+# Offset boundary of the pixels and of each face.
+ALIGNMENT = mmap.ALLOCATIONGRANULARITY
+EXTENSION = ".svraw"
+LAYOUT_EQUIRECTANGULAR = 0
+LAYOUT_CUBEMAP = 1
+LAYOUTS = (LAYOUT_EQUIRECTANGULAR, LAYOUT_CUBEMAP)
+PIXEL_FORMAT_RGB8 = 0
+CHANNELS = 3
+CUBEMAP_FACE_COUNT = 6
+MAX_PANORAMA_ID_LENGTH = 32
+
+
+def write_raw(
+    path: str | pathlib.Path, source: Image.Image | list[Image.Image],
+    panorama_id: str = "", zoom: int = None
+) -> None:
+    """
+    Writes an equirectangular panorama, or the six (equal, square) faces
+    of a cubemap as returned by native.get_cubemap, to a raw file.
+    The file is replaced atomically and durably (see
+    journal.write_atomic).
+    """
+    if isinstance(source, Image.Image):
+        layout = LAYOUT_EQUIRECTANGULAR
+        planes = [source]
+    else:
+        layout = LAYOUT_CUBEMAP
+        planes = list(source)
+        if len(planes) != CUBEMAP_FACE_COUNT or any(
+            face.size != planes[0].size for face in planes
+        ) or planes[0].width != planes[0].height:
+            raise ValueError("A cubemap must be six equal square faces.")
+    encoded_id = panorama_id.encode()
+    if len(encoded_id) > MAX_PANORAMA_ID_LENGTH:
+        raise ValueError(
+            f"Panorama ID must be at most {MAX_PANORAMA_ID_LENGTH} bytes.")
+    if zoom is not None and not 0 <= zoom <= 127:
+        raise ValueError("Zoom must be between 0 and 127.")
+    width, height = planes[0].size
+    plane_size = width * height * CHANNELS
+    padding = -plane_size % ALIGNMENT
+    face_offsets = [0] * CUBEMAP_FACE_COUNT
+    if layout == LAYOUT_CUBEMAP:
+        face_offsets = [
+            ALIGNMENT + i * (plane_size + padding)
+            for i in range(CUBEMAP_FACE_COUNT)]
+    # The last plane is not padded.
+    data_size = len(planes) * (plane_size + padding) - padding
+    header = HEADER.pack(
+        MAGIC, VERSION, layout, PIXEL_FORMAT_RGB8, CHANNELS,
+        -1 if zoom is None else zoom, width, height, ALIGNMENT, data_size,
+        *face_offsets, encoded_id)
+    with open_atomic(pathlib.Path(path)) as f:
+        f.write(header.ljust(ALIGNMENT, b"\0"))
+        for i, plane in enumerate(planes):
+            if i:
+                f.write(bytes(padding))
+            if plane.mode != "RGB":
+                plane = plane.convert("RGB")
+            f.write(plane.tobytes())
+
+
+class RawPanorama:
+    """
+    A raw panorama file, memory-mapped (copy-on-write, so the file is
+    never modified). The pixels are views of the mapping; release any
+    views taken before closing the file.
+    """
+
+    def __init__(self, path: str | pathlib.Path) -> None:
+        self.path = pathlib.Path(path)
+        with self.path.open("rb") as f:
+            self._map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_COPY)
+        try:
+            self._parse_header()
+        except ValueError:
+            self._map.close()
+            raise
+
+    def _parse_header(self) -> None:
+        if len(self._map) < HEADER_SIZE:
+            raise ValueError("Not a raw panorama file.")
+        (
+            magic, version, layout, pixel_format, channels, zoom,
+            self.width, self.height, self.data_offset, self.data_size,
+            *face_offsets, panorama_id
+        ) = HEADER.unpack_from(self._map)
+        if magic != MAGIC:
+            raise ValueError("Not a raw panorama file.")
+        if version != VERSION:
+            raise ValueError(f"Unsupported raw panorama version: {version}")
+        if (
+            layout not in LAYOUTS or pixel_format != PIXEL_FORMAT_RGB8
+            or channels != CHANNELS
+        ):
+            raise ValueError("Unsupported layout or pixel format.")
+        plane_size = self.width * self.height * CHANNELS
+        if layout == LAYOUT_CUBEMAP:
+            planes = face_offsets
+            data_size_valid = self.data_size >= plane_size * len(planes)
+        else:
+            planes = [self.data_offset]
+            data_size_valid = self.data_size == plane_size
+        data_end = self.data_offset + self.data_size
+        if not data_size_valid or data_end > len(self._map) or any(
+            not self.data_offset <= offset <= data_end - plane_size
+            for offset in planes
+        ):
+            raise ValueError("Raw panorama file is truncated or corrupt.")
+        self.layout = layout
+        self.zoom = None if zoom < 0 else zoom
+        self.face_offsets = face_offsets if self.is_cubemap else []
+        self.panorama_id = panorama_id.rstrip(b"\0").decode()
+
+    @property
+    def is_cubemap(self) -> bool:
+        return self.layout == LAYOUT_CUBEMAP
+
+    @property
+    def pixels(self) -> memoryview:
+        """
+        Returns a view of all pixels (all faces for a cubemap, with the
+        padding between them).
+        """
+        return memoryview(self._map)[
+            self.data_offset:self.data_offset + self.data_size]
+
+    @property
+    def buffer(self) -> mmap.mmap:
+        """Returns the (writable, copy-on-write) mapping of the file."""
+        return self._map
+
+    def get_face(self, index: int) -> memoryview:
+        """Returns a view of the pixels of a cubemap face."""
+        if not self.is_cubemap:
+            raise ValueError("Not a cubemap.")
+        offset = self.face_offsets[index]
+        return memoryview(self._map)[
+            offset:offset + self.width * self.height * CHANNELS]
+
+    def to_images(self) -> list[Image.Image]:
+        """
+        Returns the pixels as PIL images (copied): the panorama, or the
+        six faces of a cubemap.
+        """
+        if self.is_cubemap:
+            views = [
+                self.get_face(i) for i in range(CUBEMAP_FACE_COUNT)]
+        else:
+            views = [self.pixels]
+        images = [
+            Image.frombytes("RGB", (self.width, self.height), view)
+            for view in views]
+        for view in views:
+            view.release()
+        return images
+
+    def close(self) -> None:
+        self._map.close()
+
+    def __enter__(self) -> "RawPanorama":
+        return self
+
+    def __exit__(self, *_) -> None:
+        self.close()
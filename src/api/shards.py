@@ -0,0 +1,264 @@
+"""
+This module writes images into size-capped tar shards (as read by
+WebDataset), rather than as millions of individual files. Each record
+is an image member <key><extension> followed by a JSON metadata member
+<key>.json, and each shard <name>-<number>.tar has a sidecar index
+<name>-<number>.idx (JSON lines) of the offset and size of every member,
+so that any record can be read directly without scanning the tar.
+Each writing thread appends to its own shard, so threads never wait
+on each other, and processes can share a folder and shard name, each
+shard file being created exclusively by one writer.
+A shard is a complete tar after every record, even after a crash or
+power loss part way through writing one: each record is flushed to disk
+before the end of the archive is overwritten to include it, and before
+it is indexed, so the index only lists complete records (see
+read_shard_keys, to skip records already written when resuming).
+"""
+import itertools
+import json
+import mmap
+import os
+import pathlib
+import tarfile
+import threading
+import time
+from typing import Iterator
+
+from journal import fsync_directory
+
+
+DEFAULT_SHARD_NAME = "shard"
+DEFAULT_MAX_SIZE = 1 << 30
+SHARD_EXTENSION = ".tar"
+INDEX_EXTENSION = ".idx"
+METADATA_EXTENSION = ".json"
+BLOCK_SIZE = tarfile.BLOCKSIZE
+# Two empty blocks end a tar archive.
+END_OF_ARCHIVE = bytes(2 * BLOCK_SIZE)
+
+
+def validate_key(key: str) -> None:
+    """
+    Raises an error if a record key is invalid. Keys cannot contain
+    dots, which separate the key from the extension in WebDataset.
+    """
+    if not isinstance(key, str):
+        raise TypeError("Key must be a string.")
+    if not key or any(character in key for character in "./\\\n"):
+        raise ValueError(
+            "Key must be non-empty, without dots, slashes or newlines.")
+
+
+def _get_header(name: str, size: int) -> bytes:
+    # Returns the tar header block of a regular file member.
+    info = tarfile.TarInfo(name)
+    info.size = size
+    info.mtime = int(time.time())
+    info.mode = 0o644
+    return info.tobuf(tarfile.USTAR_FORMAT)
+
+
+def _sync(f: object) -> None:
+    # Flushes a file to disk.
+    f.flush()
+    os.fsync(f.fileno())
+
+
+def _read_index(path: pathlib.Path) -> Iterator[dict]:
+    # Yields the records listed in the index of a shard.
+    with path.with_suffix(INDEX_EXTENSION).open(encoding="utf8") as f:
+        for line in f:
+            if line.endswith("\n"):
+                # Lines cut short by a crash are skipped.
+                yield json.loads(line)
+
+
+def read_shard_keys(
+    folder: str | pathlib.Path, name: str = DEFAULT_SHARD_NAME
+) -> set[str]:
+    """Returns the keys of all complete records in the shards named."""
+    keys = set()
+    for path in pathlib.Path(folder).glob(f"{name}-*{SHARD_EXTENSION}"):
+        if path.with_suffix(INDEX_EXTENSION).is_file():
+            keys.update(record["key"] for record in _read_index(path))
+    return keys
+
+
+class _Shard:
+    # A shard being written by one thread, with its index.
+
+    def __init__(self, path: pathlib.Path) -> None:
+        # Exclusive creation, so that no other writer uses the shard.
+        self.path = path
+        self.file = path.open("xb")
+        self.index = path.with_suffix(INDEX_EXTENSION).open(
+            "w", encoding="utf8")
+        # An empty archive, until the first record.
+        self.file.write(END_OF_ARCHIVE)
+        _sync(self.file)
+        fsync_directory(path.parent)
+        self.size = 0
+        self.records = 0
+
+    def _write_member(self, name: str, data: bytes | memoryview) -> None:
+        # Writes a member at the current position.
+        size = memoryview(data).nbytes
+        self.file.write(_get_header(name, size))
+        self.file.write(data)
+        self.file.write(bytes(-size % BLOCK_SIZE))
+
+    def append(
+        self, key: str, extension: str, data: bytes | memoryview,
+        metadata: bytes
+    ) -> None:
+        # The record is written after the first block of the end of the
+        # archive, which the record's first header overwrites once the
+        # rest is on disk, so that the archive ends before the record
+        # until it is complete.
+        size = memoryview(data).nbytes
+        offset = self.size + BLOCK_SIZE
+        metadata_offset = offset + size + -size % BLOCK_SIZE + BLOCK_SIZE
+        self.file.seek(offset)
+        self.file.write(data)
+        self.file.write(bytes(-size % BLOCK_SIZE))
+        self._write_member(f"{key}{METADATA_EXTENSION}", metadata)
+        end = self.file.tell()
+        self.file.write(END_OF_ARCHIVE)
+        _sync(self.file)
+        self.file.seek(self.size)
+        self.file.write(_get_header(f"{key}{extension}", size))
+        _sync(self.file)
+        self.size = end
+        self.index.write(json.dumps({
+            "key": key, "extension": extension, "offset": offset,
+            "size": size, "metadata_offset": metadata_offset,
+            "metadata_size": len(metadata)}) + "\n")
+        _sync(self.index)
+        self.records += 1
+
+    def close(self) -> None:
+        self.file.close()
+        self.index.close()
+
+
+class ShardWriter:
+    """
+    Appends records to tar shards in a folder, named <name>-<number>,
+    starting a new shard before one would exceed max_size bytes (a shard
+    holds at least one record). Each thread writes its own shard.
+    Close the writer (or use it as a context manager) once all threads
+    have finished writing.
+    """
+
+    def __init__(
+        self, folder: str | pathlib.Path, name: str = DEFAULT_SHARD_NAME,
+        max_size: int = DEFAULT_MAX_SIZE
+    ) -> None:
+        validate_key(name)
+        if not isinstance(max_size, int) or max_size < 1:
+            raise ValueError("Max size must be a positive integer.")
+        self.folder = pathlib.Path(folder)
+        self.folder.mkdir(parents=True, exist_ok=True)
+        self.name = name
+        self.max_size = max_size
+        # Shard numbers, taken atomically (no lock) by each thread.
+        self._numbers = itertools.count()
+        self._local = threading.local()
+        self._shards = []
+        self.closed = False
+
+    def _open_shard(self) -> _Shard:
+        # Opens the next shard not yet created (by any writer).
+        while True:
+            number = next(self._numbers)
+            path = self.folder / f"{self.name}-{number:06}{SHARD_EXTENSION}"
+            try:
+                shard = _Shard(path)
+            except FileExistsError:
+                continue
+            self._shards.append(shard)
+            return shard
+
+    def write(
+        self, key: str, data: bytes | memoryview, metadata: dict = None,
+        extension: str = ".jpg"
+    ) -> pathlib.Path:
+        """
+        Appends a record of the data (such as encoded image bytes) and
+        its JSON metadata under a key unique within the dataset,
+        returning the path of the shard written to.
+        """
+        if self.closed:
+            raise ValueError("Writer is closed.")
+        validate_key(key)
+        if not extension.startswith(".") or extension == METADATA_EXTENSION:
+            raise ValueError(
+                "Extension must start with a dot and not be .json.")
+        metadata = json.dumps(metadata or {}).encode()
+        record_size = (
+            2 * BLOCK_SIZE + memoryview(data).nbytes + len(metadata)
+            + 2 * BLOCK_SIZE + len(END_OF_ARCHIVE))
+        shard = getattr(self._local, "shard", None)
+        if shard is not None and (
+            shard.records and shard.size + record_size > self.max_size
+        ):
+            shard.close()
+            shard = None
+        if shard is None:
+            shard = self._local.shard = self._open_shard()
+        shard.append(key, extension, data, metadata)
+        return shard.path
+
+    def close(self) -> None:
+        """Closes all shards."""
+        self.closed = True
+        for shard in self._shards:
+            shard.close()
+
+    def __enter__(self) -> "ShardWriter":
+        return self
+
+    def __exit__(self, *_) -> None:
+        self.close()
+
+
+class ShardReader:
+    """
+    Reads records of a shard by key, in constant time through its index,
+    mapping the shard into memory.
+    """
+
+    def __init__(self, path: str | pathlib.Path) -> None:
+        self.path = pathlib.Path(path)
+        self._records = {
+            record["key"]: record for record in _read_index(self.path)}
+        with self.path.open("rb") as f:
+            self._map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+    def get(self, key: str) -> tuple[bytes, dict]:
+        """Returns the data and metadata of the record with the key."""
+        record = self._records[key]
+        offset = record["offset"]
+        data = self._map[offset:offset + record["size"]]
+        offset = record["metadata_offset"]
+        metadata = self._map[offset:offset + record["metadata_size"]]
+        return data, json.loads(metadata)
+
+    def keys(self) -> list[str]:
+        """Returns the keys of all records, in the order written."""
+        return list(self._records)
+
+    def close(self) -> None:
+        self._map.close()
+
+    def __contains__(self, key: str) -> bool:
+        return key in self._records
+
+    def __len__(self) -> int:
+        return len(self._records)
+
+    def __enter__(self) -> "ShardReader":
+        return self
+
+    def __exit__(self, *_) -> None:
+        self.close()
@@ -0,0 +1,284 @@
+"""
+This module accounts for where the time and memory of downloading and
+rendering panoramas go. Stages (downloading tiles, decoding them,
+pasting them together, cropping, encoding and the native kernels)
+record their wall and CPU time, and counters record the tiles
+downloaded, taken from the cache or journal, or skipped as lying in
+black edges (see panorama.get_content_tiles), tiles in flight (up as
+each download starts and down as it ends, see in_flight), retries,
+bytes downloaded and bytes allocated for decoded and stitched images
+(pixels x channels), cache hits and misses, pixels output by the native
+kernels, and the responses received by HTTP status code.
+A Stats object collects everything recorded while it is active, either
+process-wide (see set_stats), aggregating across all calls, or around
+particular calls (see collect), including their tile downloads on
+background threads. Observers (such as metrics.Metrics) also receive
+everything recorded in the process. When nothing is recording,
+recording costs a single check, so stats can be left on in production.
+CPU time is that of the thread running a stage, so work a stage hands
+to other threads (such as parallel native encoding) is not included.
+"""
+import contextlib
+import contextvars
+import threading
+import time
+from dataclasses import dataclass
+from typing import Iterator
+
+from PIL import Image
+
+
+STAGE_DOWNLOAD = "download"
+STAGE_DECODE = "decode"
+STAGE_PASTE = "paste"
+STAGE_CROP = "crop"
+STAGE_ENCODE = "encode"
+STAGE_CUBEMAP = "cubemap"
+STAGE_PROJECT = "project"
+TILES_DOWNLOADED = "tiles_downloaded"
+TILES_CACHED = "tiles_cached"
+TILES_SKIPPED = "tiles_skipped"
+RETRIES = "retries"
+BYTES_DOWNLOADED = "bytes_downloaded"
+BYTES_ALLOCATED = "bytes_allocated"
+CACHE_HITS = "cache_hits"
+CACHE_MISSES = "cache_misses"
+CUBEMAP_PIXELS = "cubemap_pixels"
+PROJECT_PIXELS = "project_pixels"
+TILES_IN_FLIGHT = "tiles_in_flight"
+COUNTERS = (
+    TILES_DOWNLOADED, TILES_CACHED, TILES_SKIPPED, RETRIES,
+    BYTES_DOWNLOADED, BYTES_ALLOCATED, CACHE_HITS, CACHE_MISSES,
+    CUBEMAP_PIXELS, PROJECT_PIXELS, TILES_IN_FLIGHT)
+
+
+@dataclass
+class StageStats:
+    """Number of calls of a stage, and their total wall and CPU time."""
+    calls: int = 0
+    wall_time: float = 0.0
+    cpu_time: float = 0.0
+
+
+class Stats:
+    """
+    Per-stage times and counters, safe to record into from any thread.
+    Read stages and counters once recording is done, or take a
+    consistent snapshot at any time with to_dict.
+    """
+
+    def __init__(self) -> None:
+        self._lock = threading.Lock()
+        self.stages: dict[str, StageStats] = {}
+        self.counters = dict.fromkeys(COUNTERS, 0)
+        self.status_codes: dict[int, int] = {}
+
+    def add_stage(self, name: str, wall_time: float, cpu_time: float) -> None:
+        """Records one call of a stage, taking the given times."""
+        with self._lock:
+            stage = self.stages.get(name)
+            if stage is None:
+                stage = self.stages[name] = StageStats()
+            stage.calls += 1
+            stage.wall_time += wall_time
+            stage.cpu_time += cpu_time
+
+    def add(self, counter: str, value: int = 1) -> None:
+        """Increments a counter."""
+        with self._lock:
+            self.counters[counter] += value
+
+    def add_status(self, status: int) -> None:
+        """Counts a response with an HTTP status code."""
+        with self._lock:
+            self.status_codes[status] = self.status_codes.get(status, 0) + 1
+
+    def merge(self, other: "Stats") -> None:
+        """Adds the stages and counters of other stats to these."""
+        snapshot = other.to_dict()
+        with self._lock:
+            for name, values in snapshot["stages"].items():
+                stage = self.stages.get(name)
+                if stage is None:
+                    stage = self.stages[name] = StageStats()
+                stage.calls += values["calls"]
+                stage.wall_time += values["wall_time"]
+                stage.cpu_time += values["cpu_time"]
+            for counter, value in snapshot["counters"].items():
+                self.counters[counter] += value
+            for status, value in snapshot["status_codes"].items():
+                self.status_codes[status] = (
+                    self.status_codes.get(status, 0) + value)
+
+    def reset(self) -> None:
+        """Clears all stages and counters."""
+        with self._lock:
+            self.stages.clear()
+            self.counters = dict.fromkeys(COUNTERS, 0)
+            self.status_codes.clear()
+
+    def to_dict(self) -> dict:
+        """Returns the stages and counters as a (JSON-able) dictionary."""
+        with self._lock:
+            return {
+                "stages": {
+                    name: {
+                        "calls": stage.calls, "wall_time": stage.wall_time,
+                        "cpu_time": stage.cpu_time}
+                    for name, stage in self.stages.items()},
+                "counters": dict(self.counters),
+                "status_codes": dict(self.status_codes),
+            }
+
+    def __str__(self) -> str:
+        snapshot = self.to_dict()
+        lines = ["stage    |  calls |  wall (ms) |   CPU (ms)"]
+        for name, stage in snapshot["stages"].items():
+            lines.append(
+                f"{name:<8} | {stage['calls']:>6} | "
+                f"{stage['wall_time'] * 1000:>10.1f} | "
+                f"{stage['cpu_time'] * 1000:>10.1f}")
+        for counter, value in snapshot["counters"].items():
+            lines.append(f"{counter}: {value}")
+        for status, value in sorted(snapshot["status_codes"].items()):
+            lines.append(f"HTTP {status}: {value}")
+        return "\n".join(lines)
+
+
+# Process-wide stats (None for none).
+_process_stats = None
+# Stats collecting around calls in the current context (see collect).
+_collecting = contextvars.ContextVar("collecting", default=())
+# Observers of the whole process, replaced (not mutated) when changed,
+# so that recording need not lock.
+_observers = ()
+_observers_lock = threading.Lock()
+
+
+def set_stats(stats: Stats | None) -> None:
+    """
+    Sets stats which record all stages and counters of this process,
+    or stops recording them if None.
+    """
+    global _process_stats
+    _process_stats = stats
+
+
+def get_stats() -> Stats | None:
+    """Returns the process-wide stats, if any."""
+    return _process_stats
+
+
+def add_observer(observer: Stats) -> None:
+    """
+    Adds an observer of all stages and counters recorded in this process:
+    an object with the add_stage, add and add_status methods of Stats.
+    """
+    global _observers
+    with _observers_lock:
+        _observers = (*_observers, observer)
+
+
+def remove_observer(observer: Stats) -> None:
+    """Removes an observer added by add_observer."""
+    global _observers
+    with _observers_lock:
+        _observers = tuple(
+            current for current in _observers if current is not observer)
+
+
+def get_observers() -> tuple[Stats, ...]:
+    """Returns the observers added by add_observer."""
+    return _observers
+
+
+@contextlib.contextmanager
+def collect(stats: Stats = None) -> Iterator[Stats]:
+    """
+    Records the stages and counters of calls made within the context
+    into the given stats (new stats if None), which are yielded.
+    Calls made on threads started elsewhere (such as by an executor)
+    are not included, unless run in a copy of the context.
+    """
+    if stats is None:
+        stats = Stats()
+    token = _collecting.set(_collecting.get() + (stats,))
+    try:
+        yield stats
+    finally:
+        _collecting.reset(token)
+
+
+def _get_active() -> tuple[Stats, ...]:
+    # Returns all stats (and observers) recording in the current context.
+    active = _collecting.get()
+    if _process_stats is not None and _process_stats not in active:
+        active = (*active, _process_stats)
+    if _observers:
+        active = (*active, *_observers)
+    return active
+
+
+def count(counter: str, value: int = 1) -> None:
+    """Increments a counter of all active stats."""
+    for stats in _get_active():
+        stats.add(counter, value)
+
+
+def count_status(status: int) -> None:
+    """Counts a response with an HTTP status code in all active stats."""
+    for stats in _get_active():
+        stats.add_status(status)
+
+
+@contextlib.contextmanager
+def in_flight(tiles: int = 1) -> Iterator[None]:
+    """
+    Counts tiles as in flight (see TILES_IN_FLIGHT) in all active stats
+    for the duration of the context, in which they are downloaded.
+    """
+    count(TILES_IN_FLIGHT, tiles)
+    try:
+        yield
+    finally:
+        count(TILES_IN_FLIGHT, -tiles)
+
+
+def count_image(image: Image.Image) -> Image.Image:
+    """Counts the pixel bytes of a new image, which is returned."""
+    if _process_stats is not None or _observers or _collecting.get():
+        count(BYTES_ALLOCATED, image.width * image.height * len(
+            image.getbands()))
+    return image
+
+
+class _Stage:
+    # Times a stage on the current thread, for the given stats.
+
+    def __init__(self, name: str, active: tuple[Stats, ...]) -> None:
+        self.name = name
+        self.active = active
+
+    def __enter__(self) -> None:
+        self.start = time.perf_counter()
+        self.cpu_start = time.thread_time()
+
+    def __exit__(self, *_) -> None:
+        wall_time = time.perf_counter() - self.start
+        cpu_time = time.thread_time() - self.cpu_start
+        for stats in self.active:
+            stats.add_stage(self.name, wall_time, cpu_time)
+
+
+_NOT_RECORDING = contextlib.nullcontext()
+
+
+def stage(name: str) -> contextlib.AbstractContextManager:
+    """
+    Returns a context manager timing the stage it contains,
+    for all active stats (doing nothing if none are active).
+    """
+    active = _get_active()
+    if not active:
+        return _NOT_RECORDING
+    return _Stage(name, active)
@@ -0,0 +1,199 @@
+"""
+This module stitches panoramas of any size with bounded memory usage,
+writing the panorama to a file one row of tiles at a time rather than
+holding the entire image in memory. Hence, even entire zoom 5 panoramas
+(16384x8192) can be saved, in one of the following formats:
+- Tiled TIFF (uncompressed, 512x512 tiles).
+- PPM (binary RGB scanlines with a minimal header).
+- Raw RGB scanlines without any header.
+While one row is being written, the next row is downloading.
+Optionally, tiles known to lie in black panorama edges are not
+downloaded.
+"""
+import contextvars
+import io
+import pathlib
+import struct
+from concurrent.futures import ThreadPoolExecutor
+from typing import BinaryIO
+
+from PIL import Image
+
+from cache import PanoramaCache
+from hedging import HedgePolicy
+from journal import TileJournal
+from panorama import (
+    EXTENT_PROBE_MIN_ZOOM, TILE_WIDTH, TILE_HEIGHT, PanoramaSettings,
+    get_content_tiles, get_extent, get_tiles, validate_download)
+from stats import TILES_SKIPPED, count
+
+
+TIFF = "tiff"
+PPM = "ppm"
+RAW = "raw"
+FORMATS = (TIFF, PPM, RAW)
+CHANNELS = 3
+TILE_SIZE = TILE_WIDTH * TILE_HEIGHT * CHANNELS
+BLACK_TILE = bytes(TILE_SIZE)
+
+# TIFF tag IDs and field types.
+TIFF_SHORT = 3
+TIFF_LONG = 4
+TIFF_IMAGE_WIDTH = 256
+TIFF_IMAGE_LENGTH = 257
+TIFF_BITS_PER_SAMPLE = 258
+TIFF_COMPRESSION = 259
+TIFF_PHOTOMETRIC = 262
+TIFF_SAMPLES_PER_PIXEL = 277
+TIFF_PLANAR_CONFIGURATION = 284
+TIFF_TILE_WIDTH = 322
+TIFF_TILE_LENGTH = 323
+TIFF_TILE_OFFSETS = 324
+TIFF_TILE_BYTE_COUNTS = 325
+TIFF_HEADER_SIZE = 8
+TIFF_ENTRY_SIZE = 12
+
+
+def _get_tiff_header(settings: PanoramaSettings) -> bytes:
+    # Returns everything preceding the tile data of a tiled TIFF.
+    # Uncompressed tiles all have the same size, so all tile offsets are
+    # known in advance, allowing sequential writing (no seeking).
+    tiles = settings.tiles
+    entry_count = 11
+    ifd_size = 2 + entry_count * TIFF_ENTRY_SIZE + 4
+    bits_offset = TIFF_HEADER_SIZE + ifd_size
+    offsets_offset = bits_offset + 2 * CHANNELS
+    byte_counts_offset = offsets_offset + 4 * tiles
+    data_offset = byte_counts_offset + 4 * tiles
+    entries = (
+        (TIFF_IMAGE_WIDTH, TIFF_LONG, 1, settings.width * TILE_WIDTH),
+        (TIFF_IMAGE_LENGTH, TIFF_LONG, 1, settings.height * TILE_HEIGHT),
+        (TIFF_BITS_PER_SAMPLE, TIFF_SHORT, CHANNELS, bits_offset),
+        # No compression, RGB, interleaved (chunky) channels.
+        (TIFF_COMPRESSION, TIFF_SHORT, 1, 1),
+        (TIFF_PHOTOMETRIC, TIFF_SHORT, 1, 2),
+        (TIFF_SAMPLES_PER_PIXEL, TIFF_SHORT, 1, CHANNELS),
+        (TIFF_PLANAR_CONFIGURATION, TIFF_SHORT, 1, 1),
+        (TIFF_TILE_WIDTH, TIFF_LONG, 1, TILE_WIDTH),
+        (TIFF_TILE_LENGTH, TIFF_LONG, 1, TILE_HEIGHT),
+        (TIFF_TILE_OFFSETS, TIFF_LONG, tiles, offsets_offset),
+        (TIFF_TILE_BYTE_COUNTS, TIFF_LONG, tiles, byte_counts_offset))
+    if tiles == 1:
+        # A single value fits in the entry itself.
+        entries = (
+            *entries[:-2], (TIFF_TILE_OFFSETS, TIFF_LONG, 1, data_offset),
+            (TIFF_TILE_BYTE_COUNTS, TIFF_LONG, 1, TILE_SIZE))
+    header = bytearray(b"II*\0" + struct.pack("<I", TIFF_HEADER_SIZE))
+    header += struct.pack("<H", entry_count)
+    for tag, field_type, count, value in entries:
+        if field_type == TIFF_SHORT and count == 1:
+            header += struct.pack("<HHIHH", tag, field_type, count, value, 0)
+        else:
+            header += struct.pack("<HHII", tag, field_type, count, value)
+    # No further IFDs.
+    header += struct.pack("<I", 0)
+    header += struct.pack(f"<{CHANNELS}H", *(8,) * CHANNELS)
+    header += struct.pack(
+        f"<{tiles}I", *(data_offset + i * TILE_SIZE for i in range(tiles)))
+    header += struct.pack(f"<{tiles}I", *(TILE_SIZE,) * tiles)
+    return bytes(header)
+
+
+def _decode_tile(tile: bytes | None) -> bytes:
+    # Returns the raw RGB pixels of a tile (black if missing).
+    if tile is None:
+        return BLACK_TILE
+    return Image.open(io.BytesIO(tile)).convert("RGB").tobytes()
+
+
+def _write_row(
+    f: BinaryIO, row: list[bytes | None], image_format: str
+) -> None:
+    # Writes one row of tiles in the given format.
+    if image_format == TIFF:
+        for tile in row:
+            f.write(_decode_tile(tile))
+        return
+    # Scanlines span all tiles in the row, so decode the row as a whole.
+    row_image = Image.new("RGB", (TILE_WIDTH * len(row), TILE_HEIGHT))
+    for i, tile in enumerate(row):
+        if tile is not None:
+            row_image.paste(Image.open(io.BytesIO(tile)), (TILE_WIDTH * i, 0))
+    f.write(row_image.tobytes())
+
+
+def write_panorama(
+    panorama_id: str, file: str | pathlib.Path | BinaryIO,
+    settings: PanoramaSettings = None, image_format: str = TIFF,
+    use_async: bool = True, cache: PanoramaCache = None,
+    hedge: HedgePolicy = None, journal: TileJournal = None,
+    skip_black_tiles: bool = False
+) -> None:
+    """
+    Downloads the tiles of a panorama row by row, writing the stitched
+    panorama to a file path or binary file object in the given format,
+    without any size limit. Black edges are not cropped.
+    If skip_black_tiles is True, tiles known to lie entirely in black
+    edges (see panorama.get_extent, probed from zoom 3 while the first
+    row downloads) are written black rather than downloaded.
+    """
+    settings = validate_download(panorama_id, settings)
+    if image_format not in FORMATS:
+        raise ValueError(f"Image format must be one of: {FORMATS}")
+    if not hasattr(file, "write"):
+        with open(file, "wb") as f:
+            return write_panorama(
+                panorama_id, f, settings, image_format, use_async, cache,
+                hedge, journal, skip_black_tiles)
+    min_x, min_y = settings.top_left
+    max_x, max_y = settings.bottom_right
+    extent = probe = None
+    if skip_black_tiles:
+        extent = get_extent(panorama_id, False)
+
+    def get_row(y: int) -> tuple[list[bytes | None], int]:
+        # Downloads a row of tiles, leaving tiles without content as None,
+        # returning the row and the number of tiles skipped.
+        content_x, content_y = max_x, max_y
+        row_extent = extent
+        if probe is not None and y > min_y:
+            row_extent = probe.result()
+        if row_extent is not None:
+            content_x, content_y = get_content_tiles(
+                settings.zoom, row_extent)
+        content_max_x = min(max_x, content_x)
+        if y >= content_y or content_max_x <= min_x:
+            return [None] * settings.width, settings.width
+        row_settings = PanoramaSettings(
+            settings.zoom, (min_x, y), (content_max_x, y + 1))
+        row = get_tiles(
+            panorama_id, row_settings, use_async, cache, hedge, journal)[0]
+        return row + [None] * (max_x - content_max_x), max_x - content_max_x
+
+    width = settings.width * TILE_WIDTH
+    height = settings.height * TILE_HEIGHT
+    if image_format == TIFF:
+        file.write(_get_tiff_header(settings))
+    elif image_format == PPM:
+        file.write(f"P6\n{width} {height}\n255\n".encode())
+    skipped = 0
+    # Rows download one at a time, alongside the probe (if any).
+    with ThreadPoolExecutor(2) as executor:
+        if (
+            skip_black_tiles and extent is None
+            and settings.zoom >= EXTENT_PROBE_MIN_ZOOM
+        ):
+            # Only needed from the second row, so the first row need
+            # not wait for it.
+            probe = executor.submit(
+                contextvars.copy_context().run, get_extent, panorama_id,
+                True, cache)
+        next_row = executor.submit(get_row, min_y)
+        for y in range(min_y, max_y):
+            row, row_skipped = next_row.result()
+            skipped += row_skipped
+            if y + 1 < max_y:
+                next_row = executor.submit(get_row, y + 1)
+            _write_row(file, row, image_format)
+    if skipped:
+        count(TILES_SKIPPED, skipped)
@@ -0,0 +1,216 @@
+"""
+This module records a timeline of the pipeline as Chrome trace events
+(JSON), to be loaded into a trace viewer such as Perfetto
+(ui.perfetto.dev) or chrome://tracing, showing where work overlaps and
+where it waits. Every stage (see stats.py) is recorded on the thread
+running it, including native kernel and encoder calls, and if the
+native library is built with tracing, the events it records (such as
+bands of a kernel or strips of an encode, on their own threads) are
+added after each native call (see native.py).
+Each tile request is recorded as an asynchronous event, so that the
+requests of one event loop show concurrently rather than as one stack.
+Events are kept in a ring buffer of bounded size, so tracing a long
+run keeps only its most recent events, in bounded memory, and recording
+an event costs a tuple appended to the buffer. Only this process is
+traced (not batch worker processes).
+"""
+import collections
+import contextlib
+import itertools
+import json
+import os
+import pathlib
+import threading
+import time
+
+from stats import add_observer, remove_observer
+
+
+DEFAULT_CAPACITY = 1 << 18
+CATEGORY_STAGE = "stage"
+CATEGORY_REQUEST = "request"
+CATEGORY_NATIVE = "native"
+
+
+class Tracer:
+    """
+    Records trace events, while started (or used as a context manager),
+    into a ring buffer of the given capacity (events), the oldest events
+    being dropped once full. Save the trace (see save) once stopped.
+    """
+
+    def __init__(self, capacity: int = DEFAULT_CAPACITY) -> None:
+        if not isinstance(capacity, int) or capacity < 1:
+            raise ValueError("Capacity must be a positive integer.")
+        # Events as tuples of (phase, name, category, start, duration,
+        # thread ID, ID, arguments), with times in perf_counter seconds.
+        self._events = collections.deque(maxlen=capacity)
+        self._ids = itertools.count()
+        self._thread_names = {}
+        self._start = time.perf_counter()
+        self._recorded = 0
+
+    @property
+    def recorded(self) -> int:
+        """Number of events recorded, including any since dropped."""
+        return self._recorded
+
+    @property
+    def dropped(self) -> int:
+        """Number of events dropped from the full buffer."""
+        return self._recorded - len(self._events)
+
+    def _append(self, event: tuple) -> None:
+        # Appending to a deque is atomic, so needs no lock.
+        self._events.append(event)
+        self._recorded += 1
+        thread_id = event[5]
+        # Events of other threads (such as native threads, drained by
+        # this one) are left unnamed rather than named after this one.
+        if (
+            thread_id not in self._thread_names
+            and thread_id == threading.get_ident()
+        ):
+            self._thread_names[thread_id] = threading.current_thread().name
+
+    def add_complete(
+        self, name: str, category: str, start: float, duration: float,
+        args: dict = None, thread_id: int = None
+    ) -> None:
+        """
+        Records an event which ran for a duration (seconds) from a start
+        time (perf_counter seconds), on a thread (the current thread if
+        None).
+        """
+        if thread_id is None:
+            thread_id = threading.get_ident()
+        self._append(
+            ("X", name, category, start, duration, thread_id, None, args))
+
+    def add_async(self, name: str, category: str, args: dict = None) -> int:
+        """Records the start of an asynchronous event, returning its ID."""
+        event_id = next(self._ids)
+        self._append((
+            "b", name, category, time.perf_counter(), 0,
+            threading.get_ident(), event_id, args))
+        return event_id
+
+    def end_async(self, name: str, category: str, event_id: int) -> None:
+        """Records the end of an asynchronous event."""
+        self._append((
+            "e", name, category, time.perf_counter(), 0,
+            threading.get_ident(), event_id, None))
+
+    # Observes stats (see stats.add_observer).
+
+    def add_stage(self, name: str, wall_time: float, cpu_time: float) -> None:
+        self.add_complete(
+            name, CATEGORY_STAGE, time.perf_counter() - wall_time, wall_time,
+            {"cpu_ms": cpu_time * 1000})
+
+    def add(self, counter: str, value: int = 1) -> None:
+        pass
+
+    def add_status(self, status: int) -> None:
+        pass
+
+    def start(self) -> None:
+        """Starts recording stages and tile requests."""
+        global _tracers
+        with _tracers_lock:
+            _tracers = (*_tracers, self)
+        add_observer(self)
+
+    def stop(self) -> None:
+        """Stops recording."""
+        global _tracers
+        remove_observer(self)
+        with _tracers_lock:
+            _tracers = tuple(
+                tracer for tracer in _tracers if tracer is not self)
+
+    def to_dict(self) -> dict:
+        """Returns the trace in the Chrome trace event (JSON) format."""
+        pid = os.getpid()
+        events = [
+            {"ph": "M", "name": "thread_name", "pid": pid, "tid": thread_id,
+                "args": {"name": name}}
+            for thread_id, name in list(self._thread_names.items())]
+        for (
+            phase, name, category, start, duration, thread_id, event_id, args
+        ) in list(self._events):
+            event = {
+                "ph": phase, "name": name, "cat": category, "pid": pid,
+                "tid": thread_id,
+                "ts": round((start - self._start) * 1e6, 3)}
+            if phase == "X":
+                event["dur"] = round(duration * 1e6, 3)
+            if event_id is not None:
+                event["id"] = event_id
+            if args:
+                event["args"] = args
+            events.append(event)
+        return {
+            "traceEvents": events, "displayTimeUnit": "ms",
+            "otherData": {"dropped": self.dropped}}
+
+    def save(self, path: str | pathlib.Path) -> None:
+        """Saves the trace as JSON, to load into a trace viewer."""
+        with pathlib.Path(path).open("w", encoding="utf8") as f:
+            json.dump(self.to_dict(), f)
+
+    def __enter__(self) -> "Tracer":
+        self.start()
+        return self
+
+    def __exit__(self, *_) -> None:
+        self.stop()
+
+
+# Started tracers, replaced (not mutated) when changed.
+_tracers = ()
+_tracers_lock = threading.Lock()
+
+
+def get_tracers() -> tuple[Tracer, ...]:
+    """Returns the tracers recording."""
+    return _tracers
+
+
+class _AsyncEvent:
+    # Records an asynchronous event around its context, for tracers.
+
+    def __init__(
+        self, name: str, category: str, args: dict,
+        tracers: tuple[Tracer, ...]
+    ) -> None:
+        self.name = name
+        self.category = category
+        self.args = args
+        self.tracers = tracers
+
+    def __enter__(self) -> None:
+        self.ids = [
+            tracer.add_async(self.name, self.category, self.args)
+            for tracer in self.tracers]
+
+    def __exit__(self, *_) -> None:
+        for tracer, event_id in zip(self.tracers, self.ids):
+            tracer.end_async(self.name, self.category, event_id)
+
+
+_NOT_TRACING = contextlib.nullcontext()
+
+
+def trace_async(
+    name: str, category: str = CATEGORY_REQUEST, **args
+) -> contextlib.AbstractContextManager:
+    """
+    Returns a context manager recording an asynchronous event (such as
+    a request awaited by a coroutine) around its context, for all
+    tracers (doing nothing if none are recording).
+    """
+    tracers = _tracers
+    if not tracers:
+        return _NOT_TRACING
+    return _AsyncEvent(name, category, args, tracers)
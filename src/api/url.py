@@ -7,13 +7,20 @@ by the URL, which would be roughly seen on the web app.
 This includes handling pitch, yaw and zoom correctly.
 """
 import io
+import socket
 import time
 from dataclasses import dataclass
+from typing import BinaryIO
 
 import requests as rq
 from PIL import Image
 
+import panorama
+from encoding import (
+    DEFAULT_QUALITY, DEFAULT_SUBSAMPLING, Encoder, JpegEncoder, encode_jpeg)
 from panorama import validate_panorama_id
+from stats import (
+    BYTES_DOWNLOADED, RETRIES, STAGE_DOWNLOAD, count, count_status, stage)
 
 
 THUMBNAIL_API = "https://geo0.ggpht.com/cbk"
@@ -171,10 +178,20 @@ def get_pil_image(
     retries = MAX_RETRIES
     while True:
         try:
-            response = rq.get(THUMBNAIL_API, params=params)
-            match response.status_code:
+            # Uses the process-wide HTTP/2 client settings, if any.
+            http2 = panorama.get_http2()
+            with stage(STAGE_DOWNLOAD):
+                if http2 is None:
+                    response = rq.get(THUMBNAIL_API, params=params)
+                    status = response.status_code
+                    content = response.content
+                else:
+                    status, content = http2.get(THUMBNAIL_API, params)
+            count_status(status)
+            match status:
                 case 200:
-                    image = Image.open(io.BytesIO(response.content))
+                    count(BYTES_DOWNLOADED, len(content))
+                    image = Image.open(io.BytesIO(content))
                     if image.size == (width, height):
                         return image
                     return image.resize((width, height))
@@ -182,23 +199,44 @@ def get_pil_image(
                     raise rq.RequestException("400 - Bad Request")
                 case _:
                     raise rq.RequestException(
-                        f"{response.status_code} - something went wrong.")
+                        f"{status} - something went wrong.")
         except Exception as e:
             if not retries:
                 raise e
+            count(RETRIES)
             time.sleep(1)
         retries -= 1
 
 
 def get_image(
     url: str, width: int = DEFAULT_WIDTH, height: int = DEFAULT_HEIGHT,
+    quality: int = DEFAULT_QUALITY, subsampling: int = DEFAULT_SUBSAMPLING,
+    encoder: Encoder = None
 ) -> bytes:
     """
     Takes a valid Google Street View URL and returns the image bytes
     representing the display rendered at the given URL, based on
-    the camera yaw, pitch and zoom.
+    the camera yaw, pitch and zoom, as a JPEG with the given quality
+    and chroma subsampling, or as encoded by the encoder, if given.
     """
     image = get_pil_image(url, width, height)
-    with io.BytesIO() as f:
-        image.save(f, format="jpeg")
-        return f.getvalue()
+    if encoder is not None:
+        return encoder.encode(image)
+    return encode_jpeg(image, quality, subsampling)
+
+
+def save_image(
+    url: str, sink: int | socket.socket | BinaryIO,
+    width: int = DEFAULT_WIDTH, height: int = DEFAULT_HEIGHT,
+    encoder: Encoder = None
+) -> int:
+    """
+    As get_image, but writes the encoded image (JPEG by default)
+    straight from the encoder's buffer to a sink: a file descriptor,
+    socket, file object or writable mmap (see encoding.write_output).
+    Returns the number of bytes written.
+    """
+    if encoder is None:
+        encoder = JpegEncoder()
+    image = get_pil_image(url, width, height)
+    return encoder.encode_to(image, sink)
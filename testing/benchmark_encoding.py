@@ -0,0 +1,88 @@
+"""
+Benchmarks each registered encoder and preset on a panorama image,
+measuring encode time and output size (also relative to baseline JPEG).
+Without an image, a synthetic (noisy) panorama is used, which compresses
+far worse than real photos, so use a real panorama for file sizes.
+Run directly, for example:
+python benchmark_encoding.py --image panorama.jpg --formats jpeg avif
+"""
+import argparse
+import io
+import statistics
+import time
+
+from PIL import Image
+
+import __init__
+from encoding import ENCODERS, PRESETS, get_encoder
+from mock_server import get_synthetic_image
+
+
+def benchmark(
+    image: Image.Image, name: str, preset: str, quality: int | None,
+    threads: int, repeats: int
+) -> dict[str, float]:
+    """Times encoding the image in a format with a preset."""
+    encoder = get_encoder(name, quality, preset, threads)
+    durations = []
+    for _ in range(repeats):
+        start = time.perf_counter()
+        data = encoder.encode(image)
+        durations.append(time.perf_counter() - start)
+    duration = statistics.median(durations)
+    return {
+        "time (ms)": duration * 1000,
+        "megapixels/s": image.width * image.height / duration / 1e6,
+        "size (KB)": len(data) / 1000,
+        "bits/pixel": len(data) * 8 / (image.width * image.height),
+    }
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument(
+        "--image", default=None,
+        help="Image to encode, instead of a synthetic panorama.")
+    parser.add_argument(
+        "--size", type=int, nargs=2, default=[4096, 2048],
+        metavar=("WIDTH", "HEIGHT"), help="Size of the synthetic panorama.")
+    parser.add_argument(
+        "--formats", nargs="+", default=list(ENCODERS),
+        choices=list(ENCODERS))
+    parser.add_argument(
+        "--presets", nargs="+", default=list(PRESETS), choices=list(PRESETS))
+    parser.add_argument(
+        "--quality", type=int, default=None,
+        help="Quality of all formats (default: each codec's own).")
+    parser.add_argument(
+        "--threads", type=int, default=0, help="0 for all cores.")
+    parser.add_argument("--repeats", type=int, default=3)
+    args = parser.parse_args()
+
+    if args.image is not None:
+        image = Image.open(args.image).convert("RGB")
+    else:
+        image = Image.open(io.BytesIO(get_synthetic_image(*args.size, 0)))
+        image.load()
+    # Size of the default (baseline) JPEG encode.
+    baseline = len(
+        get_encoder("jpeg", args.quality, threads=args.threads).encode(image))
+    header = None
+    for name in args.formats:
+        for preset in args.presets:
+            results = benchmark(
+                image, name, preset, args.quality, args.threads,
+                args.repeats)
+            size = results["size (KB)"] * 1000
+            results["vs jpeg (%)"] = size / baseline * 100
+            if header is None:
+                header = ["format", "  preset", *results]
+                print(" | ".join(header))
+            print(" | ".join(
+                [f"{name:>6}", f"{preset:>8}"]
+                + [f"{value:>{len(key)}.1f}"
+                    for key, value in results.items()]))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,111 @@
+"""
+Benchmarks get_tiles against the local mock server, measuring tile
+throughput and p50/p99 latency at each zoom and concurrency level.
+Run directly, for example:
+python benchmark_panorama.py --zooms 0 1 2 3 --concurrency 1 8 32
+With --http2, concurrency is the number of multiplexed streams.
+"""
+import argparse
+import statistics
+import time
+
+import __init__
+import panorama
+from hedging import HedgePolicy
+from http2 import Http2Settings
+from mock_server import MockServer, MockServerSettings, lognormal
+
+
+PANORAMA_ID = "a" * panorama.PANORAMA_ID_LENGTH
+
+
+def percentile(values: list[float], percent: float) -> float:
+    """Returns the given percentile [0-100] of the values."""
+    values = sorted(values)
+    index = round((len(values) - 1) * percent / 100)
+    return values[index]
+
+
+def benchmark(
+    server: MockServer, zoom: int, concurrency: int, repeats: int,
+    hedge: HedgePolicy = None, http2_connections: int = None
+) -> dict[str, float]:
+    """
+    Times full-panorama get_tiles calls at a zoom and concurrency,
+    over HTTP/2 with the given connections, if any, else HTTP/1.1.
+    """
+    panorama.MAX_ASYNC_COROUTINES = concurrency
+    if http2_connections is not None:
+        panorama.set_http2(Http2Settings(
+            http2_connections, concurrency, prior_knowledge=True))
+    settings = panorama.PanoramaSettings(zoom)
+    server.settings.latencies.clear()
+    durations = []
+    try:
+        for _ in range(repeats):
+            start = time.perf_counter()
+            panorama.get_tiles(PANORAMA_ID, settings, hedge=hedge)
+            durations.append(time.perf_counter() - start)
+    finally:
+        panorama.set_http2(None)
+    tile_latencies = server.settings.latencies
+    return {
+        "tiles/s": settings.tiles * repeats / sum(durations),
+        "call p50 (ms)": statistics.median(durations) * 1000,
+        "call p99 (ms)": percentile(durations, 99) * 1000,
+        "tile p50 (ms)": statistics.median(tile_latencies) * 1000,
+        "tile p99 (ms)": percentile(tile_latencies, 99) * 1000,
+    }
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument(
+        "--zooms", type=int, nargs="+",
+        default=list(range(panorama.MIN_ZOOM, panorama.MAX_ZOOM + 1)))
+    parser.add_argument(
+        "--concurrency", type=int, nargs="+", default=[1, 4, 8, 16, 32])
+    parser.add_argument("--repeats", type=int, default=3)
+    parser.add_argument(
+        "--latency", type=float, default=20,
+        help="Median tile latency (ms), lognormally distributed.")
+    parser.add_argument(
+        "--sigma", type=float, default=0.5,
+        help="Shape of the latency distribution (larger = longer tail).")
+    parser.add_argument("--error-rate", type=float, default=0)
+    parser.add_argument(
+        "--bandwidth", type=int, default=None,
+        help="Bytes per second cap for each response.")
+    parser.add_argument(
+        "--hedge", type=float, default=None,
+        help="Hedge tile requests slower than this latency percentile.")
+    parser.add_argument(
+        "--http2", type=int, default=None, metavar="CONNECTIONS",
+        help="Multiplex requests over this many HTTP/2 connections.")
+    args = parser.parse_args()
+
+    settings = MockServerSettings(
+        lognormal(args.latency / 1000, args.sigma),
+        args.error_rate, args.bandwidth, http2=args.http2 is not None)
+    with MockServer(settings) as server:
+        panorama.PANORAMA_DOWNLOAD_API = server.tile_api
+        header = None
+        for zoom in args.zooms:
+            for concurrency in args.concurrency:
+                hedge = None
+                if args.hedge is not None:
+                    hedge = HedgePolicy(args.hedge)
+                results = benchmark(
+                    server, zoom, concurrency, args.repeats, hedge,
+                    args.http2)
+                if header is None:
+                    header = ["zoom", "concurrency", *results]
+                    print(" | ".join(header))
+                print(" | ".join(
+                    [f"{zoom:>4}", f"{concurrency:>11}"]
+                    + [f"{value:>{len(name)}.1f}"
+                        for name, value in results.items()]))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,329 @@
+"""
+Local HTTP stand-in for the panorama tile and thumbnail APIs, serving
+synthetic JPEG images so that the download path can be tested and
+benchmarked reproducibly and offline. The latency distribution,
+error rate and bandwidth cap of responses are configurable.
+HTTP/2 (with prior knowledge) can be served too, if h2 is installed.
+"""
+import contextlib
+import functools
+import http.server
+import io
+import random
+import threading
+import time
+import urllib.parse
+import zlib
+from dataclasses import dataclass, field
+from typing import Callable, Iterator
+
+from PIL import Image
+
+try:
+    import h2.config
+    import h2.connection
+    import h2.events
+    import h2.exceptions
+except ImportError:
+    h2 = None
+
+import __init__
+import panorama
+from panorama import TILE_WIDTH, TILE_HEIGHT, get_max_coordinates
+
+
+TILE_PATH = "/v1/tile"
+THUMBNAIL_PATH = "/cbk"
+# Bytes written at a time when the bandwidth is capped.
+CHUNK_SIZE = 4096
+# Start of every HTTP/2 connection, rather than an HTTP/1.1 request line.
+HTTP2_PREFACE = b"PRI * HTTP/2.0"
+HTTP2_READ_SIZE = 65536
+# Seconds between checks for a closed connection while awaiting
+# HTTP/2 flow control window updates.
+HTTP2_POLL_INTERVAL = 0.1
+
+
+def constant(seconds: float) -> Callable[[], float]:
+    """Latency distribution always returning the same latency."""
+    return lambda: seconds
+
+
+def uniform(minimum: float, maximum: float) -> Callable[[], float]:
+    """Latency distribution uniform between the minimum and maximum."""
+    return lambda: random.uniform(minimum, maximum)
+
+
+def lognormal(median: float, sigma: float) -> Callable[[], float]:
+    """Long-tailed latency distribution with a given median."""
+    return lambda: median * random.lognormvariate(0, sigma)
+
+
+@dataclass
+class MockServerSettings:
+    """Behaviour of the mock server's responses."""
+    # Returns the latency (seconds) before each response is sent.
+    latency: Callable[[], float] = constant(0)
+    # Probability [0-1] of a 500 response instead of an image.
+    error_rate: float = 0
+    # Maximum bytes per second for each response, or None for no cap.
+    bandwidth: int | None = None
+    # Whether HTTP/2 connections (prior knowledge) are accepted.
+    http2: bool = False
+    # (width, height) proportions of the tile grid with content,
+    # the rest being black as seen in some real panoramas.
+    extent: tuple[float, float] = (1.0, 1.0)
+    # Paths (with queries) of all requests received by the server.
+    requests: list[str] = field(default_factory=list)
+    # Time (perf_counter) each request was received.
+    request_times: list[float] = field(default_factory=list)
+    # Seconds taken to handle each successful request.
+    latencies: list[float] = field(default_factory=list)
+    # Protocol ("HTTP/1.1" or "HTTP/2") of each request received.
+    protocols: list[str] = field(default_factory=list)
+
+
+@functools.lru_cache(maxsize=1024)
+def get_synthetic_image(
+    width: int, height: int, seed: int, content: tuple[int, int] = None
+) -> bytes:
+    """
+    Returns a noisy JPEG image with its colour determined by the seed.
+    If the content size is given, the image is black outside it.
+    """
+    rng = random.Random(seed)
+    image = Image.effect_noise((width, height), 32).convert("RGB")
+    colour = Image.new(
+        "RGB", (width, height), tuple(rng.randrange(256) for _ in range(3)))
+    image = Image.blend(image, colour, 0.75)
+    if content is not None:
+        black = Image.new("RGB", (width, height))
+        black.paste(image.crop((0, 0, *content)), (0, 0))
+        image = black
+    with io.BytesIO() as f:
+        image.save(f, format="jpeg")
+        return f.getvalue()
+
+
+def get_tile_content(
+    zoom: int, x: int, y: int, extent: tuple[float, float]
+) -> tuple[int, int]:
+    """Returns the size of the non-black area of a tile."""
+    max_x, max_y = get_max_coordinates(zoom)
+    width = round(extent[0] * max_x * TILE_WIDTH)
+    if zoom == 0:
+        height = round(extent[1] * TILE_HEIGHT / 2)
+    else:
+        height = round(extent[1] * max_y * TILE_HEIGHT)
+    return (
+        min(max(width - x * TILE_WIDTH, 0), TILE_WIDTH),
+        min(max(height - y * TILE_HEIGHT, 0), TILE_HEIGHT))
+
+
+class MockRequestHandler(http.server.BaseHTTPRequestHandler):
+    """Handles tile and thumbnail requests as the real APIs would."""
+
+    protocol_version = "HTTP/1.1"
+    settings: MockServerSettings
+
+    def handle(self) -> None:
+        if (
+            self.settings.http2 and h2 is not None
+            and self.rfile.peek(len(HTTP2_PREFACE)).startswith(HTTP2_PREFACE)
+        ):
+            self._handle_http2()
+        else:
+            super().handle()
+
+    def _get_response(self, path: str, protocol: str) -> tuple[int, bytes]:
+        # Returns the status code and content for a request,
+        # after the configured latency.
+        self.settings.request_times.append(time.perf_counter())
+        self.settings.requests.append(path)
+        self.settings.protocols.append(protocol)
+        url = urllib.parse.urlparse(path)
+        query = dict(urllib.parse.parse_qsl(url.query))
+        content = None
+        try:
+            if url.path == TILE_PATH:
+                zoom, x, y = (int(query[name]) for name in ("zoom", "x", "y"))
+                key = f"{query['panoid']},{zoom},{x},{y}"
+                size = (TILE_WIDTH, TILE_HEIGHT)
+                content = get_tile_content(zoom, x, y, self.settings.extent)
+            elif url.path == THUMBNAIL_PATH:
+                key = f"{query['panoid']},{query['yaw']},{query['pitch']}"
+                size = (int(query["w"]), int(query["h"]))
+            else:
+                return 404, b""
+        except (KeyError, ValueError):
+            return 400, b""
+        time.sleep(self.settings.latency())
+        if random.random() < self.settings.error_rate:
+            return 500, b""
+        return 200, get_synthetic_image(
+            *size, zlib.crc32(key.encode()), content)
+
+    def _get_chunk_size(self, size: int) -> int:
+        # Limits the bytes written at a time when the bandwidth is capped.
+        if self.settings.bandwidth is None:
+            return size
+        return min(size, CHUNK_SIZE)
+
+    def _pace(self, chunk: bytes) -> None:
+        # Pauses after writing a chunk to respect the bandwidth cap.
+        if self.settings.bandwidth is not None:
+            time.sleep(len(chunk) / self.settings.bandwidth)
+
+    def do_GET(self) -> None:
+        start = time.perf_counter()
+        status, data = self._get_response(self.path, "HTTP/1.1")
+        if status != 200:
+            self.send_error(status)
+            return
+        try:
+            self.send_response(200)
+            self.send_header("Content-Type", "image/jpeg")
+            self.send_header("Content-Length", str(len(data)))
+            self.end_headers()
+            chunk_size = self._get_chunk_size(len(data))
+            for i in range(0, len(data), chunk_size):
+                chunk = data[i:i+chunk_size]
+                self.wfile.write(chunk)
+                self._pace(chunk)
+        except ConnectionError:
+            # Client gave up on the request (e.g. a cancelled hedge).
+            self.close_connection = True
+            return
+        self.settings.latencies.append(time.perf_counter() - start)
+
+    def _handle_http2(self) -> None:
+        # Serves an HTTP/2 connection, responding to each stream on its
+        # own thread so that latencies overlap, as with HTTP/1.1.
+        connection = h2.connection.H2Connection(
+            h2.config.H2Configuration(client_side=False))
+        # Guards the connection and socket, notified on window updates.
+        condition = threading.Condition()
+        closed = threading.Event()
+        with condition:
+            connection.initiate_connection()
+            self.wfile.write(connection.data_to_send())
+        try:
+            while data := self.rfile.read1(HTTP2_READ_SIZE):
+                with condition:
+                    events = connection.receive_data(data)
+                    self.wfile.write(connection.data_to_send())
+                    condition.notify_all()
+                for event in events:
+                    if isinstance(event, h2.events.RequestReceived):
+                        headers = dict(event.headers)
+                        threading.Thread(
+                            target=self._respond_http2,
+                            args=(
+                                connection, condition, closed,
+                                event.stream_id, headers[b":path"].decode()),
+                            daemon=True).start()
+                    elif isinstance(event, h2.events.ConnectionTerminated):
+                        return
+        except (ConnectionError, h2.exceptions.ProtocolError):
+            pass
+        finally:
+            closed.set()
+
+    def _respond_http2(
+        self, connection: "h2.connection.H2Connection",
+        condition: threading.Condition, closed: threading.Event,
+        stream_id: int, path: str
+    ) -> None:
+        # Sends the response to an HTTP/2 request within flow control.
+        start = time.perf_counter()
+        status, data = self._get_response(path, "HTTP/2")
+        headers = [(":status", str(status))]
+        if status == 200:
+            headers += [
+                ("content-type", "image/jpeg"),
+                ("content-length", str(len(data)))]
+        try:
+            with condition:
+                connection.send_headers(stream_id, headers, not data)
+                self.wfile.write(connection.data_to_send())
+            offset = 0
+            while offset < len(data):
+                with condition:
+                    window = min(
+                        connection.local_flow_control_window(stream_id),
+                        connection.max_outbound_frame_size)
+                    if window <= 0:
+                        if closed.is_set():
+                            return
+                        condition.wait(HTTP2_POLL_INTERVAL)
+                        continue
+                chunk = data[offset:offset+self._get_chunk_size(window)]
+                offset += len(chunk)
+                with condition:
+                    connection.send_data(
+                        stream_id, chunk, offset == len(data))
+                    self.wfile.write(connection.data_to_send())
+                self._pace(chunk)
+        except (ConnectionError, h2.exceptions.ProtocolError):
+            # Client gave up on the request (stream reset) or connection.
+            return
+        if status == 200:
+            self.settings.latencies.append(time.perf_counter() - start)
+
+    def log_message(self, *_) -> None:
+        # Silence per-request logging.
+        pass
+
+
+class MockServer:
+    """
+    Runs the mock server on a background thread, on a free local port.
+    Use as a context manager, patching the API URLs with the
+    `tile_api` and `thumbnail_api` properties.
+    """
+
+    def __init__(self, settings: MockServerSettings = None) -> None:
+        self.settings = settings or MockServerSettings()
+        handler = type(
+            "Handler", (MockRequestHandler,), {"settings": self.settings})
+        self._server = http.server.ThreadingHTTPServer(
+            ("127.0.0.1", 0), handler)
+        self._server.daemon_threads = True
+        self._thread = threading.Thread(
+            target=self._server.serve_forever, daemon=True)
+
+    def __enter__(self) -> "MockServer":
+        self._thread.start()
+        return self
+
+    def __exit__(self, *_) -> None:
+        self._server.shutdown()
+        self._server.server_close()
+
+    @property
+    def url(self) -> str:
+        """Base URL of the server."""
+        host, port = self._server.server_address
+        return f"http://{host}:{port}"
+
+    @property
+    def tile_api(self) -> str:
+        """Stand-in for PANORAMA_DOWNLOAD_API."""
+        return f"{self.url}{TILE_PATH}"
+
+    @property
+    def thumbnail_api(self) -> str:
+        """Stand-in for THUMBNAIL_API."""
+        return f"{self.url}{THUMBNAIL_PATH}"
+
+
+@contextlib.contextmanager
+def mock_api(settings: MockServerSettings = None) -> Iterator[MockServer]:
+    """Points the tile API at a mock server for the duration."""
+    live_api = panorama.PANORAMA_DOWNLOAD_API
+    with MockServer(settings) as server:
+        panorama.PANORAMA_DOWNLOAD_API = server.tile_api
+        try:
+            yield server
+        finally:
+            panorama.PANORAMA_DOWNLOAD_API = live_api
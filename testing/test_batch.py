@@ -0,0 +1,128 @@
+"""Unit Tests the batch.py module."""
+import shutil
+import time
+import unittest
+from urllib.parse import parse_qs, urlparse
+
+from __init__ import TEST_OUTPUT_FOLDER
+from batch import *
+from mock_server import MockServerSettings, constant, mock_api
+from shards import ShardReader
+
+
+BATCH_FOLDER = TEST_OUTPUT_FOLDER / "batch"
+
+
+class Test_batch(unittest.TestCase):
+
+    def setUp(self) -> None:
+        shutil.rmtree(BATCH_FOLDER, ignore_errors=True)
+
+    def test_download_batch(self) -> None:
+        panorama_ids = ["a"*22, "b"*22, "c"*22]
+        settings = MockServerSettings()
+        with mock_api(settings):
+            entries = download_batch(
+                panorama_ids[:2], BATCH_FOLDER, PanoramaSettings(1))
+            self.assertEqual(len(entries), 2)
+            requests = len(settings.requests)
+            # Resumes, only downloading the remaining panorama.
+            entries = download_batch(
+                panorama_ids, BATCH_FOLDER, PanoramaSettings(1))
+            self.assertEqual(
+                [entry["panorama_id"] for entry in entries], ["c"*22])
+            self.assertEqual(len(settings.requests), requests * 3 // 2)
+        for panorama_id in panorama_ids:
+            self.assertTrue(
+                (BATCH_FOLDER / f"{panorama_id}.jpg").is_file())
+        manifest = (BATCH_FOLDER / MANIFEST_FILENAME).read_text()
+        self.assertEqual(len(manifest.splitlines()), 3)
+
+    def test_download_batch_shards(self) -> None:
+        self.assertRaises(
+            ValueError, download_batch, [], BATCH_FOLDER, shard_size=0)
+        panorama_ids = [f"{i:0>22}" for i in range(6)]
+        with mock_api():
+            download_batch(
+                panorama_ids[:3], BATCH_FOLDER, PanoramaSettings(1),
+                shard_size=1 << 20)
+            # As if the run stopped after writing the last record, but
+            # before journaling it.
+            journal = BATCH_FOLDER / BATCH_JOURNAL_FILENAME
+            journal.write_text("".join(
+                f"{panorama_id}\n" for panorama_id in panorama_ids[:2]))
+            entries = download_batch(
+                panorama_ids, BATCH_FOLDER, PanoramaSettings(1),
+                processes=2, shard_size=1 << 20)
+        self.assertEqual(len(entries), 3)
+        self.assertFalse(list(BATCH_FOLDER.glob(f"*{PANORAMA_EXTENSION}")))
+        records = {}
+        for path in BATCH_FOLDER.glob("*.tar"):
+            with ShardReader(path) as reader:
+                for key in reader.keys():
+                    # Each panorama is written once.
+                    self.assertNotIn(key, records)
+                    records[key] = reader.get(key)
+        self.assertEqual(sorted(records), panorama_ids)
+        data, metadata = records[panorama_ids[0]]
+        self.assertEqual(metadata["zoom"], 1)
+        self.assertTrue(data.startswith(b"\xff\xd8"))
+        entry = entries[0]
+        self.assertTrue(entry["path"].endswith(".tar"))
+
+    def test_download_batch_processes(self) -> None:
+        self.assertRaises(
+            ValueError, download_batch, [], BATCH_FOLDER, processes=0)
+        panorama_ids = [f"{i:0>22}" for i in range(8)] + ["invalid"]
+        settings = MockServerSettings()
+        with mock_api(settings):
+            start = time.perf_counter()
+            entries = download_batch(
+                panorama_ids, BATCH_FOLDER, PanoramaSettings(2),
+                processes=4, rate=100, burst=1)
+            # 8 tiles for each of 8 panoramas at 100 requests per second.
+            self.assertGreater(time.perf_counter() - start, 0.6)
+        self.assertEqual(len(entries), 9)
+        statuses = {
+            entry["panorama_id"]: entry["status"] for entry in entries}
+        self.assertEqual(statuses.pop("invalid"), ERROR)
+        self.assertEqual(set(statuses.values()), {OK})
+        self.assertNotIn("invalid", BatchJournal(
+            BATCH_FOLDER / BATCH_JOURNAL_FILENAME))
+
+    def test_download_batch_memory_budget(self) -> None:
+        self.assertRaises(
+            ValueError, download_batch, [], BATCH_FOLDER, memory_budget=0)
+        panorama_ids = [f"{i:0>22}" for i in range(4)]
+        settings = PanoramaSettings(2)
+        server_settings = MockServerSettings(latency=constant(0.01))
+        with mock_api(server_settings):
+            # Admits one panorama at a time.
+            entries = download_batch(
+                panorama_ids, BATCH_FOLDER, settings, processes=2,
+                memory_budget=estimate_memory(settings))
+        # The requests of each panorama, from first to last, never
+        # overlap those of another.
+        spans = {}
+        for request, request_time in zip(
+            server_settings.requests, server_settings.request_times
+        ):
+            panorama_id = parse_qs(urlparse(request).query)["panoid"][0]
+            first, last = spans.get(panorama_id, (request_time,) * 2)
+            spans[panorama_id] = min(first, request_time), max(
+                last, request_time)
+        spans = sorted(spans.values())
+        self.assertEqual(len(spans), 4)
+        for (_, last), (first, _) in zip(spans, spans[1:]):
+            self.assertLess(last, first)
+        self.assertEqual(len(entries), 4)
+        for entry in entries:
+            self.assertEqual(entry["status"], OK)
+            self.assertEqual(
+                entry["estimated_bytes"], estimate_memory(settings))
+            if entry["peak_rss"] is not None:
+                self.assertGreater(entry["peak_rss"], 0)
+
+
+if __name__ == "__main__":
+    unittest.main()
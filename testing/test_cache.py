@@ -0,0 +1,77 @@
+"""Unit Tests the cache.py module."""
+import threading
+import unittest
+
+from PIL import Image
+
+import __init__
+from cache import *
+from panorama import PanoramaSettings, get_tiles
+
+
+class Test_cache(unittest.TestCase):
+
+    def test_LRUCache(self) -> None:
+        self.assertRaises(TypeError, LRUCache, 1.5)
+        self.assertRaises(ValueError, LRUCache, -1)
+        cache = LRUCache(10)
+        cache.put("a", b"1234")
+        cache.put("b", b"5678")
+        self.assertEqual(cache.get("a"), b"1234")
+        # "b" is now least recently used, so is evicted first.
+        cache.put("c", b"90")
+        cache.put("d", b"12")
+        self.assertNotIn("b", cache)
+        self.assertEqual(cache.size, 8)
+        self.assertEqual(len(cache), 3)
+        # Values larger than the budget are never stored.
+        cache.put("e", b"x" * 11)
+        self.assertIsNone(cache.get("e"))
+        cache.put("a", b"1")
+        self.assertEqual(cache.size, 5)
+        cache.discard("a")
+        self.assertNotIn("a", cache)
+        statistics = cache.statistics()
+        self.assertEqual(statistics.hits, 1)
+        self.assertEqual(statistics.misses, 1)
+        self.assertEqual(statistics.evictions, 1)
+        self.assertEqual(statistics.hit_rate, 0.5)
+        cache.clear()
+        self.assertEqual(cache.size, 0)
+
+    def test_LRUCache_threads(self) -> None:
+        cache = LRUCache(1000)
+        def work(thread: int) -> None:
+            for i in range(1000):
+                cache.put((thread, i), b"x" * 10)
+                cache.get((thread, i - 1))
+        threads = [
+            threading.Thread(target=work, args=(i,)) for i in range(8)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(cache.size, 1000)
+        self.assertEqual(cache.statistics().items, 100)
+
+    def test_PanoramaCache(self) -> None:
+        cache = PanoramaCache(tile_budget=1024)
+        settings = PanoramaSettings(zoom=1)
+        for x in range(2):
+            cache.tiles.put(("a"*22, 1, x, 0), bytes([x]))
+        # Fully cached, so no tiles are downloaded.
+        self.assertEqual(
+            get_tiles("a"*22, settings, cache=cache), [[b"\0", b"\1"]])
+        self.assertEqual(cache.statistics()["tiles"].hits, 2)
+        self.assertEqual(
+            set(cache.statistics()), {"tiles", "panoramas", "cubemaps"})
+        faces = [Image.new("RGB", (4, 4))] * 6
+        cache.cubemaps.put(("a"*22, 1), faces)
+        self.assertEqual(cache.cubemaps.size, 6 * 4 * 4 * 3)
+        cache.clear()
+        self.assertEqual(cache.tiles.size, 0)
+        self.assertEqual(cache.cubemaps.size, 0)
+
+
+if __name__ == "__main__":
+    unittest.main()
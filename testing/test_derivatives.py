@@ -0,0 +1,56 @@
+"""Unit Tests the derivatives.py module."""
+import io
+import unittest
+
+from PIL import Image
+
+import __init__
+from derivatives import *
+from encoding import ENCODERS, get_encoder
+from mock_server import get_synthetic_image, mock_api
+
+
+class Test_derivatives(unittest.TestCase):
+
+    def test_derivative(self) -> None:
+        self.assertRaises(ValueError, Derivative, "preview", 0)
+        self.assertEqual(
+            Derivative("full").get_size((2000, 1000)), (2000, 1000))
+        self.assertEqual(
+            Derivative("preview", 1024).get_size((2000, 1000)), (1024, 512))
+        self.assertEqual(
+            Derivative("preview", 1024).get_size((800, 400)), (800, 400))
+        self.assertEqual(
+            Derivative("tall", 100).get_size((50, 200)), (25, 100))
+
+    @unittest.skipUnless("webp" in ENCODERS, "WebP not supported by PIL.")
+    def test_get_derivatives(self) -> None:
+        image = Image.open(io.BytesIO(get_synthetic_image(2048, 1024, 0)))
+        self.assertRaises(
+            ValueError, get_derivatives, image,
+            (Derivative("a", 10), Derivative("a", 20)))
+        derivatives = get_derivatives(image, (
+            Derivative("thumbnail", 256), Derivative("full"),
+            Derivative("preview", 1000, get_encoder("webp"))), threads=2)
+        # In the order requested.
+        self.assertEqual(list(derivatives), ["thumbnail", "full", "preview"])
+        expected = {
+            "full": ("JPEG", (2048, 1024)),
+            "preview": ("WEBP", (1000, 500)),
+            "thumbnail": ("JPEG", (256, 128))}
+        for name, data in derivatives.items():
+            with Image.open(io.BytesIO(data)) as derivative:
+                self.assertEqual(
+                    (derivative.format, derivative.size), expected[name])
+
+    def test_download_derivatives_mock(self) -> None:
+        with mock_api():
+            derivatives = download_derivatives(
+                "d"*22, PanoramaSettings(zoom=2))
+        self.assertEqual(list(derivatives), ["full", "preview", "thumbnail"])
+        with Image.open(io.BytesIO(derivatives["thumbnail"])) as thumbnail:
+            self.assertEqual(thumbnail.width, 256)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,140 @@
+"""Unit Tests the encoding.py module."""
+import io
+import mmap
+import os
+import pathlib
+import socket
+import unittest
+from typing import BinaryIO
+
+from PIL import Image, JpegImagePlugin
+
+from __init__ import TEST_OUTPUT_FOLDER
+from encoding import *
+from mock_server import get_synthetic_image
+
+
+class Test_encoding(unittest.TestCase):
+
+    def test_validate_jpeg_options(self) -> None:
+        self.assertRaises(TypeError, validate_jpeg_options, 75.5, 2)
+        self.assertRaises(ValueError, validate_jpeg_options, 0, 2)
+        self.assertRaises(ValueError, validate_jpeg_options, 75, 3)
+        validate_jpeg_options(100, SUBSAMPLING_444)
+
+    def test_encode_jpeg(self) -> None:
+        image = Image.open(io.BytesIO(get_synthetic_image(640, 480, 1)))
+        sizes = []
+        for subsampling in SUBSAMPLING:
+            data = encode_jpeg(image, 90, subsampling)
+            with Image.open(io.BytesIO(data)) as encoded:
+                self.assertEqual(encoded.size, (640, 480))
+                self.assertEqual(
+                    JpegImagePlugin.get_sampling(encoded), subsampling)
+            sizes.append(len(data))
+        # Less chroma detail, smaller files.
+        self.assertEqual(sizes, sorted(sizes, reverse=True))
+        self.assertLess(len(encode_jpeg(image, 10)), len(encode_jpeg(image)))
+
+    def test_encode_jpeg_view(self) -> None:
+        image = Image.open(io.BytesIO(get_synthetic_image(320, 240, 4)))
+        view = encode_jpeg_view(image, 80)
+        self.assertIsInstance(view, memoryview)
+        self.assertEqual(view, encode_jpeg(image, 80))
+
+    def test_write_output(self) -> None:
+        data = get_synthetic_image(64, 64, 5)
+        self.assertRaises(TypeError, write_output, data, "file.jpg")
+        path = pathlib.Path(TEST_OUTPUT_FOLDER) / "write_output.jpg"
+        path.parent.mkdir(parents=True, exist_ok=True)
+        with path.open("wb") as f:
+            self.assertEqual(write_output(data, f), len(data))
+        self.assertEqual(path.read_bytes(), data)
+        fd = os.open(path, os.O_WRONLY | os.O_TRUNC)
+        try:
+            self.assertEqual(write_output(memoryview(data), fd), len(data))
+        finally:
+            os.close(fd)
+        self.assertEqual(path.read_bytes(), data)
+        with mmap.mmap(-1, len(data) + 1) as mapping:
+            self.assertEqual(write_output(data, mapping), len(data))
+            self.assertEqual(mapping[:len(data)], data)
+            # The mapping has only one byte left.
+            self.assertRaises(ValueError, write_output, data, mapping)
+        sender, receiver = socket.socketpair()
+        with sender, receiver:
+            # Small enough to fit in the socket buffer.
+            self.assertEqual(write_output(data, sender), len(data))
+            sender.shutdown(socket.SHUT_WR)
+            received = b"".join(iter(lambda: receiver.recv(65536), b""))
+        self.assertEqual(received, data)
+
+    def test_encode_to(self) -> None:
+        image = Image.open(io.BytesIO(get_synthetic_image(128, 64, 6)))
+        for name in ENCODERS:
+            encoder = get_encoder(name, preset=PRESET_FAST)
+            with io.BytesIO() as f:
+                self.assertEqual(
+                    encoder.encode_to(image, f), len(f.getvalue()))
+                self.assertEqual(f.getvalue(), encoder.encode(image))
+
+    def test_Encoder(self) -> None:
+        self.assertRaises(TypeError, JpegEncoder, 75.5)
+        self.assertRaises(ValueError, JpegEncoder, 101)
+        self.assertRaises(ValueError, JpegEncoder, preset="slowest")
+        self.assertRaises(ValueError, JpegEncoder, threads=-1)
+        self.assertRaises(ValueError, JpegEncoder, subsampling=3)
+        encoder = JpegEncoder(preset=PRESET_SMALL)
+        self.assertEqual(encoder.quality, DEFAULT_QUALITY)
+        self.assertEqual(encoder.preset, PRESET_SMALL)
+        self.assertEqual(encoder.subsampling, DEFAULT_SUBSAMPLING)
+
+    def test_get_encoder(self) -> None:
+        self.assertIn("jpeg", ENCODERS)
+        self.assertRaises(ValueError, get_encoder, "bmp")
+        image = Image.open(io.BytesIO(get_synthetic_image(256, 128, 2)))
+        for name in ENCODERS:
+            for preset in PRESETS:
+                encoder = get_encoder(name, preset=preset, threads=2)
+                self.assertIsInstance(encoder, ENCODERS[name])
+                data = encoder.encode(image)
+                with Image.open(io.BytesIO(data)) as encoded:
+                    self.assertEqual(encoded.format.lower(), name)
+                    self.assertEqual(encoded.size, (256, 128))
+
+    def test_encode_presets(self) -> None:
+        image = Image.open(io.BytesIO(get_synthetic_image(512, 256, 3)))
+        sizes = [
+            len(get_encoder("jpeg", preset=preset).encode(image))
+            for preset in PRESETS]
+        # Optimised Huffman tables only in the small preset.
+        self.assertEqual(sizes[0], sizes[1])
+        self.assertLess(sizes[2], sizes[1])
+
+    @unittest.skipUnless("webp" in ENCODERS, "WebP not supported by PIL.")
+    def test_WebpEncoder(self) -> None:
+        image = Image.new("RGB", (WEBP_MAX_SIZE + 1, 16))
+        self.assertRaises(ValueError, WebpEncoder().encode, image)
+
+    def test_register_encoder(self) -> None:
+        self.assertRaises(TypeError, register_encoder, object)
+
+        class PngEncoder(Encoder):
+            name = "png"
+            extension = ".png"
+
+            def _save(self, image: Image.Image, f: BinaryIO) -> None:
+                image.save(f, format="png")
+
+        try:
+            self.assertIs(register_encoder(PngEncoder), PngEncoder)
+            image = Image.new("RGB", (8, 8))
+            data = get_encoder("png").encode(image)
+            self.assertTrue(data.startswith(b"\x89PNG"))
+            self.assertEqual(get_encoder("png").encode_view(image), data)
+        finally:
+            del ENCODERS["png"]
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,32 @@
+"""Unit Tests the hedging.py module."""
+import unittest
+
+import __init__
+from hedging import *
+
+
+class Test_hedging(unittest.TestCase):
+
+    def test_HedgePolicy(self) -> None:
+        self.assertRaises(ValueError, HedgePolicy, 0)
+        self.assertRaises(ValueError, HedgePolicy, 95, 1.5)
+        self.assertRaises(ValueError, HedgePolicy, 95, 0.1, 10, 20)
+        policy = HedgePolicy(percentile=90, budget=0.25, min_samples=10)
+        self.assertIsNone(policy.delay())
+        for latency in range(1, 11):
+            policy.record(latency / 100)
+        self.assertEqual(policy.delay(), 0.09)
+        # 2 requests registered so far: no hedge until a 4th request.
+        self.assertFalse(policy.try_hedge())
+        policy.delay()
+        policy.delay()
+        self.assertTrue(policy.try_hedge())
+        self.assertFalse(policy.try_hedge())
+        policy.record(0.05, hedge_won=True)
+        self.assertEqual(policy.requests, 4)
+        self.assertEqual(policy.hedges, 1)
+        self.assertEqual(policy.hedge_wins, 1)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,45 @@
+"""Unit Tests the http2.py module."""
+import unittest
+
+import __init__
+from http2 import *
+from mock_server import MockServer, MockServerSettings
+
+
+@unittest.skipUnless(is_available(), "httpx[http2] not installed.")
+class Test_http2(unittest.TestCase):
+
+    def test_Http2Settings(self) -> None:
+        self.assertRaises(ValueError, Http2Settings, 0)
+        self.assertRaises(ValueError, Http2Settings, 1, 0)
+        settings = Http2Settings(2, 32)
+        self.assertEqual(settings.connections, 2)
+        self.assertEqual(settings.streams, 32)
+        self.assertFalse(settings.prior_knowledge)
+
+    def test_get_mock(self) -> None:
+        params = {"panoid": "a"*22, "yaw": 0, "pitch": 0, "w": 64, "h": 32}
+        for http2 in (True, False):
+            server_settings = MockServerSettings(http2=http2)
+            with MockServer(server_settings) as server:
+                settings = Http2Settings(prior_knowledge=http2)
+                try:
+                    status, content = settings.get(
+                        server.thumbnail_api, params)
+                    self.assertEqual(status, 200)
+                    # The connection is reused.
+                    self.assertEqual(
+                        settings.get(server.thumbnail_api, params),
+                        (status, content))
+                    self.assertEqual(
+                        settings.get(f"{server.url}/missing", params)[0],
+                        404)
+                finally:
+                    settings.close()
+            self.assertEqual(
+                server_settings.protocols,
+                ["HTTP/2" if http2 else "HTTP/1.1"] * 3)
+
+
+if __name__ == "__main__":
+    unittest.main()
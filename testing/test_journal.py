@@ -0,0 +1,68 @@
+"""Unit Tests the journal.py module."""
+import multiprocessing
+import shutil
+import unittest
+
+from __init__ import TEST_OUTPUT_FOLDER
+from journal import *
+
+
+JOURNAL_FOLDER = TEST_OUTPUT_FOLDER / "journal"
+
+
+class Test_journal(unittest.TestCase):
+
+    def setUp(self) -> None:
+        shutil.rmtree(JOURNAL_FOLDER, ignore_errors=True)
+
+    def test_write_atomic(self) -> None:
+        JOURNAL_FOLDER.mkdir(parents=True)
+        path = JOURNAL_FOLDER / "file.jpg"
+        write_atomic(path, b"first")
+        write_atomic(path, memoryview(b"second"))
+        self.assertEqual(path.read_bytes(), b"second")
+        # No temporary files are left behind.
+        self.assertEqual(list(JOURNAL_FOLDER.iterdir()), [path])
+        with self.assertRaises(ValueError):
+            with open_atomic(path) as f:
+                f.write(b"partial")
+                raise ValueError
+        self.assertEqual(path.read_bytes(), b"second")
+        self.assertEqual(list(JOURNAL_FOLDER.iterdir()), [path])
+        # Processes writing the same file at once do not collide.
+        with multiprocessing.Pool(2) as pool:
+            pool.starmap(write_atomic, [(path, b"third" * 1000)] * 200)
+        self.assertEqual(path.read_bytes(), b"third" * 1000)
+        self.assertEqual(list(JOURNAL_FOLDER.iterdir()), [path])
+
+    def test_TileJournal(self) -> None:
+        journal = TileJournal(JOURNAL_FOLDER)
+        self.assertIsNone(journal.get("a"*22, 3, 1, 2))
+        journal.put("a"*22, 3, 1, 2, b"tile")
+        self.assertEqual(journal.get("a"*22, 3, 1, 2), b"tile")
+        # Checkpoints persist across journal objects.
+        self.assertEqual(
+            TileJournal(JOURNAL_FOLDER).get("a"*22, 3, 1, 2), b"tile")
+        journal.clear("a"*22)
+        self.assertIsNone(journal.get("a"*22, 3, 1, 2))
+
+    def test_BatchJournal(self) -> None:
+        JOURNAL_FOLDER.mkdir(parents=True)
+        path = JOURNAL_FOLDER / "batch.txt"
+        journal = BatchJournal(path)
+        journal.commit("first")
+        journal.commit("second")
+        self.assertRaises(ValueError, journal.commit, "a\nb")
+        self.assertIn("second", BatchJournal(path))
+        # Simulates a crash part way through writing a line.
+        with path.open("a") as f:
+            f.write("thi")
+        journal = BatchJournal(path)
+        self.assertEqual(len(journal), 2)
+        self.assertNotIn("thi", journal)
+        journal.commit("third")
+        self.assertEqual(path.read_text(), "first\nsecond\nthird\n")
+
+
+if __name__ == "__main__":
+    unittest.main()
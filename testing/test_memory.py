@@ -0,0 +1,93 @@
+"""Unit Tests the memory.py module."""
+import threading
+import time
+import unittest
+
+import __init__
+from memory import *
+
+
+class Test_memory(unittest.TestCase):
+
+    def test_estimate_memory(self) -> None:
+        tile = TILE_WIDTH * TILE_HEIGHT * TILE_CHANNELS
+        estimate = estimate_memory(PanoramaSettings(0))
+        self.assertGreater(estimate, 3 * tile)
+        self.assertEqual(estimate, estimate_memory())
+        # Proportional to the tiles, once encoding dominates.
+        full = estimate_memory(PanoramaSettings(4))
+        part = estimate_memory(PanoramaSettings(4, (0, 0), (8, 8)))
+        self.assertEqual(full, 2 * part)
+        self.assertLess(full, 128 * estimate)
+        self.assertLessEqual(
+            estimate_memory(PanoramaSettings(4), False), full)
+
+    def test_memory_budget(self) -> None:
+        self.assertRaises(ValueError, MemoryBudget, 0)
+        budget = MemoryBudget(100)
+        self.assertRaises(ValueError, budget.acquire, -1)
+        self.assertTrue(budget.acquire(60))
+        self.assertTrue(budget.acquire(40))
+        self.assertFalse(budget.acquire(1, 0.01))
+        self.assertEqual((budget.reserved, budget.jobs), (100, 2))
+        admitted = []
+
+        def run(size: int) -> None:
+            with budget.reserve(size):
+                admitted.append(size)
+
+        thread = threading.Thread(target=run, args=(50,))
+        thread.start()
+        time.sleep(0.05)
+        # Waits until enough is released.
+        self.assertEqual(admitted, [])
+        budget.release(40)
+        time.sleep(0.05)
+        self.assertEqual(admitted, [])
+        budget.release(60)
+        thread.join()
+        self.assertEqual(admitted, [50])
+        self.assertEqual((budget.reserved, budget.jobs), (0, 0))
+        # A job larger than the budget is admitted alone.
+        self.assertTrue(budget.acquire(1000, 0))
+        self.assertFalse(budget.acquire(1, 0))
+        budget.release(1000)
+
+    def test_memory_budget_order(self) -> None:
+        budget = MemoryBudget(100)
+        budget.acquire(90)
+        admitted = []
+
+        def run(size: int) -> None:
+            budget.acquire(size)
+            admitted.append(size)
+
+        threads = []
+        for size in (50, 10):
+            threads.append(threading.Thread(target=run, args=(size,)))
+            threads[-1].start()
+            time.sleep(0.05)
+        # The small job fits but waits behind the large one.
+        self.assertEqual(admitted, [])
+        budget.release(90)
+        for thread in threads:
+            thread.join()
+        self.assertEqual(admitted, [50, 10])
+
+    def test_peak_rss(self) -> None:
+        reset = reset_peak_rss()
+        peak = get_peak_rss()
+        if peak is None:
+            self.skipTest("Peak RSS unavailable.")
+        data = b"\x01" * (64 << 20)
+        self.assertGreaterEqual(get_peak_rss(), len(data))
+        if reset:
+            # Without the reset, the peak may predate this test.
+            self.assertGreater(get_peak_rss(), peak + len(data) // 2)
+            del data
+            self.assertTrue(reset_peak_rss())
+            self.assertLess(get_peak_rss(), peak + (32 << 20))
+
+
+if __name__ == "__main__":
+    unittest.main()
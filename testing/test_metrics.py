@@ -0,0 +1,98 @@
+"""Unit Tests the metrics.py module."""
+import shutil
+import unittest
+import urllib.error
+import urllib.request
+
+from __init__ import TEST_OUTPUT_FOLDER
+from batch import download_batch
+from metrics import *
+from mock_server import MockServerSettings, mock_api
+from panorama import PanoramaSettings, get_tiles
+from stats import STAGE_DECODE, TILES_IN_FLIGHT, get_observers
+
+
+def get_samples(text: str) -> dict[str, float]:
+    # Parses the samples of the text format by name (with labels).
+    samples = {}
+    for line in text.splitlines():
+        if line and not line.startswith("#"):
+            name, value = line.rsplit(" ", 1)
+            samples[name] = float(value)
+    return samples
+
+
+class Test_metrics(unittest.TestCase):
+
+    def test_Metrics(self) -> None:
+        self.assertRaises(ValueError, Metrics, (1, 0.5))
+        metrics = Metrics((0.1, 1))
+        metrics.add_stage(STAGE_DECODE, 0.05, 0.04)
+        metrics.add_stage(STAGE_DECODE, 0.5, 0.4)
+        metrics.add_stage(STAGE_DECODE, 5, 0.5)
+        metrics.add(TILES_DOWNLOADED, 3)
+        metrics.add(TILES_IN_FLIGHT, 2)
+        metrics.add(TILES_IN_FLIGHT, -1)
+        metrics.add_status(200)
+        samples = get_samples(metrics.render())
+        self.assertEqual(samples["streetview_tiles_in_flight"], 1)
+        self.assertEqual(
+            samples['streetview_tiles_total{source="downloaded"}'], 3)
+        self.assertEqual(
+            samples['streetview_http_responses_total{code="200"}'], 1)
+        for bound, value in (("0.1", 1), ("1", 2), ("+Inf", 3)):
+            self.assertEqual(samples[
+                "streetview_stage_duration_seconds_bucket"
+                f'{{stage="decode",le="{bound}"}}'], value)
+        self.assertEqual(samples[
+            'streetview_stage_duration_seconds_sum{stage="decode"}'], 5.55)
+        self.assertAlmostEqual(samples[
+            'streetview_stage_cpu_seconds_total{stage="decode"}'], 0.94)
+        # Snapshots move metrics between processes.
+        total = Metrics((0.1, 1))
+        total.merge(metrics.take())
+        self.assertEqual(get_samples(total.render()), samples)
+        self.assertEqual(
+            get_samples(metrics.render())[
+                'streetview_tiles_total{source="downloaded"}'], 0)
+        self.assertRaises(ValueError, Metrics().merge, total.take())
+
+    def test_MetricsServer_mock(self) -> None:
+        with MetricsServer(port=0) as server:
+            self.assertIn(server.metrics, get_observers())
+            url = f"http://{DEFAULT_HOST}:{server.port}"
+            with mock_api(MockServerSettings(error_rate=0.1)):
+                get_tiles("m"*22, PanoramaSettings(2))
+            with urllib.request.urlopen(f"{url}{METRICS_PATH}") as response:
+                self.assertEqual(
+                    response.headers["Content-Type"], CONTENT_TYPE)
+                samples = get_samples(response.read().decode())
+            with self.assertRaises(urllib.error.HTTPError):
+                urllib.request.urlopen(f"{url}/other")
+        self.assertNotIn(server.metrics, get_observers())
+        self.assertEqual(
+            samples['streetview_tiles_total{source="downloaded"}'], 8)
+        self.assertEqual(
+            samples['streetview_http_responses_total{code="200"}'], 8)
+        self.assertEqual(
+            samples.get('streetview_http_responses_total{code="500"}', 0),
+            samples["streetview_retries_total"])
+        self.assertEqual(samples["streetview_tiles_in_flight"], 0)
+
+    def test_download_batch_metrics_mock(self) -> None:
+        # Metrics of worker processes are forwarded.
+        folder = TEST_OUTPUT_FOLDER / "batch_metrics"
+        shutil.rmtree(folder, ignore_errors=True)
+        with MetricsServer(port=0) as server, mock_api():
+            download_batch(
+                [f"{i:0>22}" for i in range(4)], folder, PanoramaSettings(1),
+                processes=2)
+        samples = get_samples(server.metrics.render())
+        self.assertEqual(
+            samples['streetview_tiles_total{source="downloaded"}'], 8)
+        self.assertEqual(samples[
+            'streetview_stage_duration_seconds_count{stage="encode"}'], 4)
+
+
+if __name__ == "__main__":
+    unittest.main()
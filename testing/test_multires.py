@@ -0,0 +1,132 @@
+"""Unit Tests the multires.py module (requires the native library)."""
+import io
+import json
+import shutil
+import unittest
+
+from PIL import Image
+
+from __init__ import TEST_OUTPUT_FOLDER
+from cache import PanoramaCache
+from encoding import ENCODERS, PRESET_FAST, get_encoder
+from mock_server import MockServerSettings, get_synthetic_image, mock_api
+from multires import *
+import native
+from native import is_available
+from rawfile import EXTENSION, RawPanorama, write_raw
+from shards import ShardReader, ShardWriter
+
+
+@unittest.skipUnless(is_available(), "Native library not built.")
+class Test_multires(unittest.TestCase):
+
+    def test_get_levels(self) -> None:
+        self.assertEqual(get_levels(256, 512), 1)
+        self.assertEqual(get_levels(512, 512), 1)
+        self.assertEqual(get_levels(1024, 512), 2)
+        self.assertEqual(get_levels(3328, 512), 4)
+        self.assertEqual(get_levels(4096, 512), 4)
+
+    @unittest.skipUnless("webp" in ENCODERS, "WebP not supported by PIL.")
+    def test_export_cubemap(self) -> None:
+        folder = TEST_OUTPUT_FOLDER / "cubemap"
+        shutil.rmtree(folder, ignore_errors=True)
+        image = Image.open(io.BytesIO(get_synthetic_image(512, 256, 3)))
+        self.assertRaises(
+            ValueError, export_cubemap, [image] * 5, folder)
+        reports = []
+        export_cubemap(
+            image, folder, threads=3,
+            progress=lambda *report: reports.append(report))
+        self.assertEqual(reports, [(i, 6) for i in range(1, 7)])
+        for name in native.CUBEMAP_FACES:
+            with Image.open(folder / f"{name}.jpg") as face:
+                self.assertEqual(face.size, (128, 128))
+        # Faces of a raw cubemap, into shards.
+        path = TEST_OUTPUT_FOLDER / f"export_cubemap{EXTENSION}"
+        write_raw(path, native.get_cubemap(image), "c"*22)
+        shard_folder = TEST_OUTPUT_FOLDER / "cubemap_shards"
+        shutil.rmtree(shard_folder, ignore_errors=True)
+        with RawPanorama(path) as raw, ShardWriter(shard_folder) as writer:
+            self.assertRaises(ValueError, export_cubemap, raw, writer)
+            export_cubemap(
+                raw, writer, get_encoder("webp"), key=raw.panorama_id,
+                metadata={"panorama_id": raw.panorama_id})
+        records = {}
+        for shard in shard_folder.glob("*.tar"):
+            with ShardReader(shard) as reader:
+                for key in reader.keys():
+                    records[key] = reader.get(key)
+        self.assertEqual(
+            sorted(records),
+            sorted(f"{'c'*22}_{name}" for name in native.CUBEMAP_FACES))
+        data, metadata = records[f"{'c'*22}_front"]
+        self.assertEqual(metadata, {"panorama_id": "c"*22, "face": "front"})
+        with Image.open(io.BytesIO(data)) as face:
+            self.assertEqual((face.format, face.size), ("WEBP", (128, 128)))
+
+    def test_export_multires(self) -> None:
+        folder = TEST_OUTPUT_FOLDER / "multires"
+        shutil.rmtree(folder, ignore_errors=True)
+        image = Image.open(io.BytesIO(get_synthetic_image(2048, 1024, 1)))
+        self.assertRaises(ValueError, export_multires, image, folder, 0)
+        reports = []
+        config = export_multires(
+            image, folder, 128,
+            progress=lambda *report: reports.append(report))
+        # 6 faces of 16 + 4 + 1 tiles.
+        self.assertEqual(reports[-1], (126, 126))
+        self.assertEqual(len(reports), 126)
+        self.assertEqual(config["multiRes"]["cubeResolution"], 512)
+        self.assertEqual(config["multiRes"]["maxLevel"], 3)
+        self.assertEqual(config["multiRes"]["extension"], "jpg")
+        self.assertEqual(
+            json.loads((folder / CONFIG_FILENAME).read_text()), config)
+        # 4x4, 2x2 and 1x1 tiles per face.
+        for level, count in ((3, 4), (2, 2), (1, 1)):
+            paths = sorted((folder / str(level)).iterdir())
+            self.assertEqual(len(paths), 6 * count * count)
+            for face in FACE_NAMES.values():
+                for row in range(count):
+                    for column in range(count):
+                        path = f"{level}/{face}{row}_{column}.jpg"
+                        with Image.open(folder / path) as tile:
+                            self.assertEqual(tile.size, (128, 128))
+
+    @unittest.skipUnless("webp" in ENCODERS, "WebP not supported by PIL.")
+    def test_export_multires_edges(self) -> None:
+        # Cropped (not 2:1) panorama, faces not a multiple of the tiles.
+        folder = TEST_OUTPUT_FOLDER / "multires_edges"
+        shutil.rmtree(folder, ignore_errors=True)
+        image = Image.open(io.BytesIO(get_synthetic_image(800, 380, 2)))
+        encoder = get_encoder("webp", preset=PRESET_FAST)
+        config = export_multires(image, folder, 128, encoder, threads=2)
+        self.assertEqual(config["multiRes"]["cubeResolution"], 200)
+        self.assertEqual(config["multiRes"]["maxLevel"], 2)
+        with Image.open(folder / "2" / "f1_1.webp") as tile:
+            self.assertEqual(tile.size, (72, 72))
+        with Image.open(folder / "1" / "u0_0.webp") as tile:
+            self.assertEqual(tile.size, (100, 100))
+
+    def test_download_multires_mock(self) -> None:
+        folder = TEST_OUTPUT_FOLDER / "multires_download"
+        shutil.rmtree(folder, ignore_errors=True)
+        settings = MockServerSettings()
+        cache = PanoramaCache()
+        with mock_api(settings):
+            config = download_multires(
+                "m"*22, folder, PanoramaSettings(zoom=2), 256, cache=cache)
+            requests = len(settings.requests)
+            # The cubemap is cached, so not computed again.
+            faces = native.download_cubemap(
+                "m"*22, PanoramaSettings(zoom=2), cache=cache)
+            self.assertEqual(len(settings.requests), requests)
+        self.assertEqual(config["multiRes"]["cubeResolution"], 512)
+        self.assertEqual(len(list((folder / "2").iterdir())), 24)
+        self.assertEqual(cache.statistics()["cubemaps"].hits, 1)
+        self.assertEqual(len(faces), 6)
+        self.assertEqual(faces[0].size, (512, 512))
+
+
+if __name__ == "__main__":
+    unittest.main()
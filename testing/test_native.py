@@ -0,0 +1,209 @@
+"""Unit Tests the native.py module (requires the native library)."""
+import io
+import random
+import threading
+import time
+import unittest
+
+import requests as rq
+from PIL import Image, ImageChops, JpegImagePlugin
+
+from __init__ import TEST_OUTPUT_FOLDER
+from cache import PanoramaCache
+from mock_server import MockServerSettings, get_synthetic_image, mock_api
+from native import *
+from panorama import get_pil_panorama as get_python_pil_panorama
+from panorama import get_tiles as get_python_tiles
+from panorama import get_rate_limiter, set_rate_limiter
+from ratelimit import RateLimiter
+from rawfile import EXTENSION, RawPanorama, write_raw
+from stats import TILES_IN_FLIGHT, collect
+from tracing import Tracer
+
+
+@unittest.skipUnless(is_available(), "Native library not built.")
+class Test_native(unittest.TestCase):
+
+    def test_get_tiles_mock(self) -> None:
+        settings = PanoramaSettings(zoom=3)
+        server_settings = MockServerSettings(error_rate=0.02)
+        with mock_api(server_settings):
+            cache = PanoramaCache()
+            images = get_tiles("n"*22, settings, cache)
+            self.assertEqual(images, get_python_tiles("n"*22, settings))
+            self.assertEqual(len(cache.tiles), 32)
+            # Cached tiles are not downloaded again.
+            request_count = len(server_settings.requests)
+            self.assertEqual(get_tiles("n"*22, settings, cache), images)
+            self.assertEqual(len(server_settings.requests), request_count)
+        with mock_api(MockServerSettings(error_rate=1)):
+            self.assertRaises(
+                rq.RequestException, get_tiles, "n"*22, settings)
+
+    def test_get_tiles_rate_limited_mock(self) -> None:
+        settings = PanoramaSettings(zoom=2)
+        server_settings = MockServerSettings()
+        previous_rate_limiter = get_rate_limiter()
+        set_rate_limiter(RateLimiter(50, 1))
+        try:
+            with mock_api(server_settings):
+                start = time.perf_counter()
+                get_tiles("r"*22, settings)
+        finally:
+            set_rate_limiter(previous_rate_limiter)
+        # Requests are paced by the rate limiter, not sent in a burst:
+        # after the first, one every 20 ms at most. Times are from the
+        # start, as the first request may be delayed by connecting.
+        times = server_settings.request_times
+        self.assertEqual(len(times), settings.tiles)
+        for i, request_time in enumerate(times):
+            self.assertGreater(request_time - start, i * 0.02 - 0.005)
+
+    def test_get_pil_panorama_mock(self) -> None:
+        settings = PanoramaSettings(zoom=2, top_left=(1, 0))
+        with mock_api(MockServerSettings(extent=(1.0, 0.6))):
+            image = get_pil_panorama("o"*22, settings, False)
+            expected = get_python_pil_panorama(
+                "o"*22, settings, crop_black_edges=False)
+            self.assertEqual(image.size, (1536, 1024))
+            # Both are decoded by libjpeg, but perhaps different versions.
+            difference = sum(
+                abs(a - b)
+                for a, b in zip(image.tobytes(), expected.tobytes()))
+            self.assertLess(difference / len(image.tobytes()), 1)
+            self.assertEqual(
+                get_pil_panorama("o"*22, settings).size,
+                get_python_pil_panorama("o"*22, settings).size)
+
+    def test_get_pil_panorama_stats_mock(self) -> None:
+        settings = PanoramaSettings(zoom=1)
+        with mock_api(), collect() as stats:
+            # Tiles are not kept without a cache or journal.
+            get_pil_panorama("s"*22, settings)
+            tiles = get_tiles("s"*22, settings)
+        self.assertEqual(stats.stages[STAGE_DOWNLOAD].calls, 2)
+        self.assertEqual(stats.counters[TILES_DOWNLOADED], 4)
+        self.assertEqual(
+            stats.counters[BYTES_DOWNLOADED], 2 * sum(map(len, tiles[0])))
+        self.assertEqual(stats.counters[RETRIES], 0)
+        with mock_api(MockServerSettings(error_rate=1)), collect() as stats:
+            self.assertRaises(
+                rq.RequestException, get_tiles, "s"*22, PanoramaSettings())
+        self.assertEqual(stats.counters[RETRIES], MAX_RETRIES)
+        self.assertEqual(stats.counters[TILES_DOWNLOADED], 0)
+        self.assertEqual(stats.counters[TILES_IN_FLIGHT], 0)
+
+    def test_get_cubemap(self) -> None:
+        self.assertRaises(ValueError, get_cubemap, Image.new("RGB", (64, 64)))
+        # Upper half white, lower half black, a red column at the centre.
+        image = Image.new("RGB", (512, 256))
+        image.paste((255, 255, 255), (0, 0, 512, 128))
+        image.paste((255, 0, 0), (248, 0, 264, 256))
+        faces = dict(zip(CUBEMAP_FACES, get_cubemap(image)))
+        for face in faces.values():
+            self.assertEqual(face.size, (128, 128))
+        self.assertEqual(faces["bottom"].getpixel((10, 64)), (255, 255, 255))
+        self.assertEqual(faces["top"].getpixel((10, 64)), (0, 0, 0))
+        for name in ("front", "back", "right", "left"):
+            self.assertEqual(
+                faces[name].getpixel((10, 10)), (255, 255, 255))
+            self.assertEqual(faces[name].getpixel((10, 117)), (0, 0, 0))
+        # The panorama centre is the centre of the front face.
+        self.assertEqual(faces["front"].getpixel((64, 32)), (255, 0, 0))
+        self.assertEqual(faces["back"].getpixel((64, 32)), (255, 255, 255))
+
+    def test_project(self) -> None:
+        image = Image.open(io.BytesIO(get_synthetic_image(512, 256, 7)))
+        self.assertRaises(ValueError, project, image, 0, 100, 45, 30, 90)
+        self.assertRaises(
+            ValueError, project, Image.new("RGB", (64, 64)), 8, 8, 0, 0, 90)
+        view = project(image, 160, 120, 45, 30, 90)
+        self.assertEqual(view.size, (160, 120))
+        equirectangular = TEST_OUTPUT_FOLDER / f"project{EXTENSION}"
+        cubemap = TEST_OUTPUT_FOLDER / f"project_cubemap{EXTENSION}"
+        write_raw(equirectangular, image)
+        write_raw(cubemap, get_cubemap(image))
+        # Raw files (through their mapping) give the same results.
+        with RawPanorama(equirectangular) as raw:
+            self.assertIsNone(ImageChops.difference(
+                project(raw, 160, 120, 45, 30, 90), view).getbbox())
+            for face, raw_face in zip(get_cubemap(image), get_cubemap(raw)):
+                self.assertEqual(face.tobytes(), raw_face.tobytes())
+        with RawPanorama(cubemap) as raw:
+            self.assertRaises(ValueError, get_cubemap, raw)
+            self.assertIsNone(ImageChops.difference(
+                project(raw, 160, 120, 45, 30, 90), view).getbbox())
+        # Faces (130 x 130) not a multiple of the boundary are padded.
+        image = image.resize((520, 260))
+        write_raw(cubemap, get_cubemap(image))
+        with RawPanorama(cubemap) as raw:
+            self.assertGreater(
+                raw.face_offsets[1] - raw.face_offsets[0], 130 * 130 * 3)
+            self.assertIsNone(ImageChops.difference(
+                project(raw, 160, 120, 45, 30, 90),
+                project(image, 160, 120, 45, 30, 90)).getbbox())
+
+    def test_trace(self) -> None:
+        image = Image.open(io.BytesIO(get_synthetic_image(512, 256, 7)))
+        with Tracer() as tracer:
+            project(image, 160, 130, 45, 30, 90)
+        events = [
+            event for event in tracer.to_dict()["traceEvents"]
+            if event.get("cat") == CATEGORY_NATIVE]
+        if not is_tracing_available():
+            # Built without tracing, nothing is recorded.
+            self.assertEqual(events, [])
+            self.assertEqual(drain_trace(), [])
+            return
+        # The call, and bands of 64 rows.
+        self.assertEqual(
+            sorted((event["name"], event["args"]["pixels"])
+                for event in events),
+            [("project", 160 * 130), ("project band", 160 * 2),
+                ("project band", 160 * 64), ("project band", 160 * 64)])
+        call = next(event for event in events if event["name"] == "project")
+        self.assertEqual(call["args"]["path"], "computed")
+        self.assertEqual(call["tid"], threading.get_ident())
+        # Not recorded once the tracer stops.
+        project(image, 16, 16, 0, 0, 90)
+        self.assertEqual(drain_trace(), [])
+
+    def test_encode_jpeg(self) -> None:
+        # Random rectangles, with a height not a multiple of the strips.
+        image = Image.new("RGB", (1000, 1100))
+        generator = random.Random(0)
+        for _ in range(200):
+            x, y = generator.randrange(1000), generator.randrange(1100)
+            image.paste(
+                tuple(generator.randrange(256) for _ in range(3)),
+                (x, y, x + generator.randrange(1, 200),
+                    y + generator.randrange(1, 200)))
+        for subsampling in (0, 1, 2):
+            data = encode_jpeg(image, 95, subsampling, threads=4)
+            # Restart markers join the strips.
+            self.assertIn(b"\xff\xd7", data)
+            with Image.open(io.BytesIO(data)) as encoded:
+                self.assertEqual(encoded.size, image.size)
+                self.assertEqual(
+                    JpegImagePlugin.get_sampling(encoded), subsampling)
+                # Decodes to the same pixels as a single pass encode by
+                # PIL (the strips only add restart markers).
+                with io.BytesIO() as f:
+                    image.save(
+                        f, "JPEG", quality=95, subsampling=subsampling)
+                    with Image.open(f) as single_pass:
+                        self.assertIsNone(ImageChops.difference(
+                            encoded.convert("RGB"),
+                            single_pass.convert("RGB")).getbbox())
+                difference = ImageChops.difference(image, encoded)
+                # Histograms of each band, one after another.
+                mean = sum(
+                    i % 256 * count
+                    for i, count in enumerate(difference.histogram())
+                ) / (image.width * image.height * 3)
+                self.assertLess(mean, 3)
+        self.assertRaises(ValueError, encode_jpeg, image, 0, 2)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -1,8 +1,18 @@
 """Unit Tests the panorama.py module."""
+import io
+import shutil
 import unittest
+from concurrent.futures import ThreadPoolExecutor
 
-import __init__
+from __init__ import TEST_OUTPUT_FOLDER
+from encoding import ENCODERS, PRESET_FAST, get_encoder
+from hedging import HedgePolicy
+from http2 import Http2Settings, is_available as is_http2_available
+from journal import TileJournal
+from mock_server import MockServerSettings, constant, lognormal, mock_api
 from panorama import *
+from panorama import _extents
+from stats import TILES_SKIPPED, collect
 
 
 class Test_panorama(unittest.TestCase):
@@ -48,6 +58,182 @@ class Test_panorama(unittest.TestCase):
         count = sum(map(len, images))
         self.assertEqual(count, 3)
 
+    def test_get_tiles_mock(self) -> None:
+        with mock_api(MockServerSettings(error_rate=0.02)):
+            settings = PanoramaSettings(zoom=3)
+            images = get_tiles("a"*22, settings)
+            self.assertEqual(sum(map(len, images)), settings.tiles)
+            self.assertEqual(images, get_tiles("a"*22, settings, False))
+
+    def test_iter_tiles_mock(self) -> None:
+        settings = PanoramaSettings(zoom=2)
+        with mock_api():
+            tiles = list(iter_tiles("a"*22, settings, buffer=1))
+            self.assertEqual(len(tiles), settings.tiles)
+            self.assertEqual(
+                {(x, y) for x, y, _ in tiles},
+                {(x, y) for x in range(4) for y in range(2)})
+            # Stopping early cancels the remaining downloads.
+            for _ in iter_tiles("a"*22, settings):
+                break
+            async def collect() -> list:
+                return [
+                    tile async for tile in iter_tiles_async("a"*22, settings)]
+            self.assertEqual(
+                len(asyncio.run(collect())), settings.tiles)
+        with mock_api(MockServerSettings(error_rate=1)):
+            with self.assertRaises(rq.RequestException):
+                list(iter_tiles("a"*22, settings))
+
+    def test_get_tiles_hedged_mock(self) -> None:
+        settings = PanoramaSettings(zoom=3)
+        policy = HedgePolicy(percentile=50, budget=0.5)
+        with mock_api(MockServerSettings(lognormal(0.01, 1))):
+            # Generate the synthetic tiles first, so that only the mock
+            # latency varies.
+            get_tiles("a"*22, settings)
+            for _ in range(2):
+                images = get_tiles("a"*22, settings, hedge=policy)
+                self.assertNotIn(None, sum(images, []))
+        self.assertGreater(policy.hedges, 0)
+        self.assertLessEqual(policy.hedges, policy.requests * 0.5)
+
+    def test_get_tiles_journal_mock(self) -> None:
+        folder = TEST_OUTPUT_FOLDER / "tile_journal"
+        shutil.rmtree(folder, ignore_errors=True)
+        journal = TileJournal(folder)
+        settings = PanoramaSettings(zoom=2)
+        for x in range(4):
+            journal.put("a"*22, 2, x, 0, bytes([x]))
+        with mock_api() as server:
+            images = get_tiles("a"*22, settings, journal=journal)
+            # Only the tiles missing from the journal are downloaded.
+            self.assertEqual(images[0], [b"\0", b"\1", b"\2", b"\3"])
+            self.assertEqual(len(server.settings.requests), 4)
+            self.assertEqual(journal.get("a"*22, 2, 3, 1), images[1][3])
+
+    def test_get_tiles_single_flight_mock(self) -> None:
+        settings = MockServerSettings(constant(0.2))
+        # Multiple tiles, so that async downloads take the async path,
+        # overlapping serial downloads of each single tile (serial
+        # downloads of several tiles would only overlap on the first).
+        panorama_settings = PanoramaSettings(zoom=1)
+        tile_settings = [
+            PanoramaSettings(1, (x, 0), (x + 1, 1)) for x in range(2)]
+        with mock_api(settings):
+            # Overlapping async and serial downloads on separate threads.
+            with ThreadPoolExecutor(6) as executor:
+                downloads = [
+                    executor.submit(
+                        get_tiles, "s"*22, panorama_settings, True)
+                    for _ in range(2)]
+                tile_downloads = [
+                    executor.submit(get_tiles, "s"*22, single, False)
+                    for single in tile_settings * 2]
+                results = [download.result() for download in downloads]
+                tile_results = [
+                    download.result()[0][0] for download in tile_downloads]
+            self.assertEqual(results[0], results[1])
+            self.assertEqual(tile_results, results[0][0] * 2)
+            # Each tile is only requested once.
+            self.assertEqual(
+                len(settings.requests), panorama_settings.tiles)
+
+    @unittest.skipUnless(is_http2_available(), "httpx[http2] not installed.")
+    def test_get_tiles_http2_mock(self) -> None:
+        settings = PanoramaSettings(zoom=2)
+        for http2 in (True, False):
+            server_settings = MockServerSettings(http2=http2)
+            with mock_api(server_settings):
+                # Without prior knowledge (or TLS), HTTP/1.1 is used.
+                set_http2(Http2Settings(prior_knowledge=http2))
+                try:
+                    for use_async in (True, False):
+                        images = get_tiles(
+                            f"{use_async:d}{http2:d}"*11, settings,
+                            use_async)
+                        self.assertNotIn(None, sum(images, []))
+                finally:
+                    set_http2(None)
+            self.assertEqual(len(server_settings.requests), 16)
+            self.assertEqual(
+                set(server_settings.protocols),
+                {"HTTP/2" if http2 else "HTTP/1.1"})
+
+    def test_get_content_tiles(self) -> None:
+        self.assertEqual(get_content_tiles(0, (0.5, 0.5)), (1, 1))
+        self.assertEqual(get_content_tiles(3, (1.0, 1.0)), (8, 4))
+        # A margin of one tile beyond the extent.
+        self.assertEqual(get_content_tiles(5, (1.0, 209 / 256)), (32, 15))
+        self.assertEqual(get_content_tiles(3, (0.5, 0.25)), (5, 2))
+        self.assertEqual(get_content_tiles(2, (0.0, 0.0)), (1, 1))
+
+    def test_get_pil_panorama_extent_mock(self) -> None:
+        # Panorama with black bottom edge: 2/3 of zoom 3 tile rows empty.
+        settings = MockServerSettings(extent=(1.0, 0.3))
+        with mock_api(settings):
+            with collect() as stats:
+                image = get_pil_panorama("e"*22, PanoramaSettings(zoom=3))
+            # Recorded from the cropped panorama (JPEG blurs edges a little).
+            extent = get_extent("e"*22, False)
+            self.assertEqual(extent[0], 1.0)
+            self.assertAlmostEqual(extent[1], 0.3, delta=0.01)
+            # Zoom 0 probe (alongside the first row) and the top 2 rows
+            # of 8 tiles, plus a row of margin.
+            self.assertEqual(len(settings.requests), 1 + 24)
+            self.assertEqual(image.info[SKIPPED_TILES_INFO], 8)
+            self.assertEqual(stats.counters[TILES_SKIPPED], 8)
+            self.assertEqual(image.size[0], 4096)
+            self.assertAlmostEqual(image.size[1], 614, delta=16)
+            # Without cropping, all tiles are downloaded.
+            image = get_pil_panorama(
+                "e"*22, PanoramaSettings(zoom=3), crop_black_edges=False)
+            self.assertEqual(image.size, (4096, 2048))
+            self.assertEqual(image.info[SKIPPED_TILES_INFO], 0)
+            self.assertEqual(len(settings.requests), 1 + 24 + 32)
+
+    def test_get_pil_panorama_full_extent_mock(self) -> None:
+        # Content to the bottom row, with a dark bottom edge taken for a
+        # black edge by the zoom 0 tile.
+        settings = MockServerSettings()
+        with mock_api(settings):
+            _extents.put("g"*22, (1.0, 0.7))
+            image = get_pil_panorama("g"*22, PanoramaSettings(zoom=3))
+            # The margin still covers the bottom row.
+            self.assertEqual(len(settings.requests), 32)
+            self.assertEqual(image.info[SKIPPED_TILES_INFO], 0)
+            self.assertEqual(image.size, (4096, 2048))
+            self.assertNotEqual(image.getpixel((4000, 2000)), (0, 0, 0))
+            # Nothing is skipped from the raw grid, whatever the extent.
+            _extents.put("g"*22, (0.1, 0.1))
+            image = get_pil_panorama(
+                "g"*22, PanoramaSettings(zoom=3), crop_black_edges=False)
+            self.assertEqual(len(settings.requests), 64)
+            self.assertNotEqual(image.getpixel((4000, 2000)), (0, 0, 0))
+            image = get_pil_panorama("h"*22, PanoramaSettings(zoom=3))
+            self.assertEqual(image.size, (4096, 2048))
+            self.assertEqual(image.info[SKIPPED_TILES_INFO], 0)
+
+    @unittest.skipUnless("webp" in ENCODERS, "WebP not supported by PIL.")
+    def test_get_panorama_encoder_mock(self) -> None:
+        with mock_api():
+            data = get_panorama(
+                "a"*22, PanoramaSettings(zoom=1),
+                encoder=get_encoder("webp", preset=PRESET_FAST))
+            with Image.open(io.BytesIO(data)) as image:
+                self.assertEqual(image.format, "WEBP")
+                self.assertEqual(image.size, (1024, 512))
+
+    def test_save_panorama_mock(self) -> None:
+        path = TEST_OUTPUT_FOLDER / "save_panorama.jpg"
+        with mock_api():
+            with path.open("wb") as f:
+                size = save_panorama("a"*22, f, PanoramaSettings(zoom=1))
+            self.assertEqual(path.stat().st_size, size)
+            self.assertEqual(
+                path.read_bytes(),
+                get_panorama("a"*22, PanoramaSettings(zoom=1)))
+
     def test_get_pil_tiles(self) -> None:
         images = get_pil_tiles("xbK9YuuJe1GMpPPMqGFocA", PanoramaSettings(2))
         for row in images:
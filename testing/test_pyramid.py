@@ -0,0 +1,62 @@
+"""Unit Tests the pyramid.py module."""
+import io
+import unittest
+
+import __init__
+from pyramid import *
+from panorama import PanoramaSettings, get_tiles
+
+
+def get_solid_tile(colour: tuple[int, int, int]) -> bytes:
+    with io.BytesIO() as f:
+        Image.new("RGB", (TILE_WIDTH, TILE_HEIGHT), colour).save(
+            f, format="jpeg")
+        return f.getvalue()
+
+
+class Test_pyramid(unittest.TestCase):
+
+    def test_get_source_tiles(self) -> None:
+        self.assertRaises(ValueError, get_source_tiles, 2, 0, 0, 2)
+        self.assertRaises(ValueError, get_source_tiles, 2, 0, 0, 6)
+        self.assertEqual(get_source_tiles(2, 1, 1, 4), ((4, 4), (8, 8)))
+        self.assertEqual(get_source_tiles(1, 1, 0, 2), ((2, 0), (4, 2)))
+        self.assertEqual(get_source_tiles(0, 0, 0, 3), ((0, 0), (8, 4)))
+
+    def test_downsample_tiles(self) -> None:
+        red = get_solid_tile((255, 0, 0))
+        blue = get_solid_tile((0, 0, 255))
+        tile = Image.open(io.BytesIO(
+            downsample_tiles([[red, blue], [red, blue]], 1, 2)))
+        self.assertEqual(tile.size, (TILE_WIDTH, TILE_HEIGHT))
+        self.assertGreater(tile.getpixel((10, 10))[0], 240)
+        self.assertGreater(tile.getpixel((500, 500))[2], 240)
+        tile = Image.open(io.BytesIO(
+            downsample_tiles([[red, blue]], 0, 1, LANCZOS)))
+        self.assertEqual(tile.size, (TILE_WIDTH, TILE_HEIGHT))
+        self.assertGreater(tile.getpixel((10, 10))[0], 240)
+        # Bottom half of the zoom 0 tile is black.
+        self.assertLess(max(tile.getpixel((10, 400))), 16)
+        self.assertRaises(
+            ValueError, downsample_tiles, [[red]], 0, 1,
+            Image.Resampling.NEAREST)
+
+    def test_build_pyramid(self) -> None:
+        cache = PanoramaCache()
+        panorama_id = "b"*22
+        self.assertRaises(ValueError, build_pyramid, cache, panorama_id, 2)
+        self.assertIsNone(derive_tile(cache, panorama_id, 1, 0, 0))
+        tile = get_solid_tile((0, 255, 0))
+        width, height = get_max_coordinates(2)
+        for x in range(width):
+            for y in range(height):
+                cache.tiles.put((panorama_id, 2, x, y), tile)
+        # Synthesised from zoom 2 without any download.
+        tiles = get_tiles(panorama_id, PanoramaSettings(zoom=1), cache=cache)
+        self.assertEqual(len(tiles[0]), 2)
+        build_pyramid(cache, panorama_id, 2)
+        self.assertIn((panorama_id, 0, 0, 0), cache.tiles)
+
+
+if __name__ == "__main__":
+    unittest.main()
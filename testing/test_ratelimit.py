@@ -0,0 +1,46 @@
+"""Unit Tests the ratelimit.py module."""
+import asyncio
+import multiprocessing
+import time
+import unittest
+
+import __init__
+from ratelimit import *
+
+
+def acquire_many(rate_limiter: RateLimiter, count: int) -> None:
+    for _ in range(count):
+        rate_limiter.acquire()
+
+
+class Test_ratelimit(unittest.TestCase):
+
+    def test_RateLimiter(self) -> None:
+        self.assertRaises(ValueError, RateLimiter, 0)
+        self.assertRaises(ValueError, RateLimiter, 10, 0)
+        rate_limiter = RateLimiter(100, 10)
+        start = time.perf_counter()
+        # The burst is immediate, then 100 requests per second.
+        acquire_many(rate_limiter, 10)
+        self.assertLess(time.perf_counter() - start, 0.05)
+        acquire_many(rate_limiter, 20)
+        self.assertGreater(time.perf_counter() - start, 0.18)
+        asyncio.run(rate_limiter.acquire_async())
+
+    def test_RateLimiter_processes(self) -> None:
+        rate_limiter = RateLimiter(100, 1)
+        processes = [
+            multiprocessing.Process(
+                target=acquire_many, args=(rate_limiter, 10))
+            for _ in range(3)]
+        start = time.perf_counter()
+        for process in processes:
+            process.start()
+        for process in processes:
+            process.join()
+        # 30 requests in total at 100 per second.
+        self.assertGreater(time.perf_counter() - start, 0.28)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,74 @@
+"""Unit Tests the rawfile.py module."""
+import io
+import unittest
+
+from PIL import Image, ImageChops
+
+from __init__ import TEST_OUTPUT_FOLDER
+from mock_server import get_synthetic_image
+from rawfile import *
+
+
+class Test_rawfile(unittest.TestCase):
+
+    def test_write_raw(self) -> None:
+        path = TEST_OUTPUT_FOLDER / f"equirectangular{EXTENSION}"
+        image = Image.open(io.BytesIO(get_synthetic_image(512, 256, 1)))
+        self.assertRaises(ValueError, write_raw, path, image, "a"*33)
+        self.assertRaises(ValueError, write_raw, path, image, "a"*22, 200)
+        write_raw(path, image, "a"*22, 0)
+        with RawPanorama(path) as raw:
+            self.assertFalse(raw.is_cubemap)
+            self.assertEqual((raw.width, raw.height), (512, 256))
+            self.assertEqual((raw.panorama_id, raw.zoom), ("a"*22, 0))
+            self.assertEqual(raw.data_offset % ALIGNMENT, 0)
+            self.assertEqual(raw.face_offsets, [])
+            pixels = raw.pixels
+            self.assertEqual(pixels, image.tobytes())
+            pixels.release()
+            self.assertRaises(ValueError, raw.get_face, 0)
+            (copy,) = raw.to_images()
+            self.assertIsNone(ImageChops.difference(copy, image).getbbox())
+
+    def test_write_raw_cubemap(self) -> None:
+        path = TEST_OUTPUT_FOLDER / f"cubemap{EXTENSION}"
+        faces = [Image.new("RGB", (50, 50), (i, i, i)) for i in range(6)]
+        self.assertRaises(ValueError, write_raw, path, faces[:5])
+        small_face = Image.new("RGB", (8, 8))
+        self.assertRaises(
+            ValueError, write_raw, path, faces[:5] + [small_face])
+        write_raw(path, faces)
+        with RawPanorama(path) as raw:
+            self.assertTrue(raw.is_cubemap)
+            self.assertEqual((raw.panorama_id, raw.zoom), ("", None))
+            self.assertEqual(len(raw.face_offsets), 6)
+            for i, offset in enumerate(raw.face_offsets):
+                # 50 x 50 RGB faces are padded to the boundary.
+                self.assertEqual(offset % ALIGNMENT, 0)
+                face = raw.get_face(i)
+                self.assertEqual(face, faces[i].tobytes())
+                face.release()
+            self.assertEqual(
+                [face.getpixel((0, 0)) for face in raw.to_images()],
+                [(i, i, i) for i in range(6)])
+
+    def test_RawPanorama_invalid(self) -> None:
+        path = TEST_OUTPUT_FOLDER / f"invalid{EXTENSION}"
+        path.write_bytes(bytes(HEADER_SIZE))
+        self.assertRaises(ValueError, RawPanorama, path)
+        write_raw(path, Image.new("RGB", (64, 32)))
+        data = path.read_bytes()
+        path.write_bytes(data[:-1])
+        self.assertRaises(ValueError, RawPanorama, path)
+        # A face offset beyond the pixels.
+        faces = [Image.new("RGB", (50, 50))] * 6
+        write_raw(path, faces)
+        data = bytearray(path.read_bytes())
+        offset = HEADER.size - 32 - 8
+        data[offset:offset + 8] = (len(data) - 100).to_bytes(8, "little")
+        path.write_bytes(data)
+        self.assertRaises(ValueError, RawPanorama, path)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,105 @@
+"""Unit Tests the shards.py module."""
+import shutil
+import tarfile
+import unittest
+from concurrent.futures import ThreadPoolExecutor
+
+from __init__ import TEST_OUTPUT_FOLDER
+from shards import *
+
+
+SHARDS_FOLDER = TEST_OUTPUT_FOLDER / "shards"
+
+
+class Test_shards(unittest.TestCase):
+
+    def setUp(self) -> None:
+        shutil.rmtree(SHARDS_FOLDER, ignore_errors=True)
+
+    def test_validate_key(self) -> None:
+        self.assertRaises(TypeError, validate_key, 5)
+        self.assertRaises(ValueError, validate_key, "")
+        self.assertRaises(ValueError, validate_key, "a.b")
+        self.assertRaises(ValueError, validate_key, "a/b")
+        validate_key("a"*22 + "_90_-10")
+
+    def test_ShardWriter(self) -> None:
+        self.assertRaises(ValueError, ShardWriter, SHARDS_FOLDER, "a.b")
+        self.assertRaises(ValueError, ShardWriter, SHARDS_FOLDER, max_size=0)
+        records = {f"key{i}": bytes([i]) * (1000 * i + 1) for i in range(10)}
+        with ShardWriter(SHARDS_FOLDER, max_size=8192) as writer:
+            self.assertRaises(
+                ValueError, writer.write, "key", b"", None, "jpg")
+            self.assertRaises(
+                ValueError, writer.write, "key", b"", None, ".json")
+            for key, data in records.items():
+                writer.write(key, memoryview(data), {"key": key})
+        self.assertRaises(ValueError, writer.write, "key", b"")
+        paths = sorted(SHARDS_FOLDER.glob(f"*{SHARD_EXTENSION}"))
+        self.assertGreater(len(paths), 1)
+        read = {}
+        for path in paths:
+            # Records fit, unless a single record is larger.
+            with ShardReader(path) as reader:
+                if len(reader) > 1:
+                    self.assertLessEqual(path.stat().st_size, 8192)
+                keys = reader.keys()
+                for key in keys:
+                    data, metadata = reader.get(key)
+                    self.assertEqual(metadata, {"key": key})
+                    read[key] = data
+            # Readable as a plain tar, image then metadata of each record.
+            with tarfile.open(path) as tar:
+                self.assertEqual(tar.getnames(), [
+                    f"{key}{extension}" for key in keys
+                    for extension in (".jpg", METADATA_EXTENSION)])
+                for key in keys:
+                    self.assertEqual(
+                        tar.extractfile(f"{key}.jpg").read(), records[key])
+        self.assertEqual(read, records)
+
+    def test_ShardWriter_threads(self) -> None:
+        def write(i: int) -> None:
+            writer.write(f"key{i}", bytes(100), {"i": i}, ".bin")
+
+        with ShardWriter(SHARDS_FOLDER, "views") as writer:
+            with ThreadPoolExecutor(4) as executor:
+                list(executor.map(write, range(200)))
+        keys = []
+        for path in SHARDS_FOLDER.glob(f"views-*{SHARD_EXTENSION}"):
+            with ShardReader(path) as reader:
+                keys.extend(reader.keys())
+        self.assertEqual(sorted(keys), sorted(f"key{i}" for i in range(200)))
+
+    def test_ShardWriter_shared_folder(self) -> None:
+        # A second writer (e.g. in another process) skips existing shards.
+        with ShardWriter(SHARDS_FOLDER) as first:
+            with ShardWriter(SHARDS_FOLDER) as second:
+                path1 = first.write("a", b"1")
+                path2 = second.write("b", b"2")
+        self.assertNotEqual(path1, path2)
+        with ShardReader(path2) as reader:
+            self.assertEqual(reader.get("b"), (b"2", {}))
+            self.assertNotIn("a", reader)
+
+    def test_ShardWriter_crash(self) -> None:
+        with ShardWriter(SHARDS_FOLDER) as writer:
+            path = writer.write("a", b"1")
+            writer.write("b", b"2")
+        # Simulates a crash part way through writing the next record,
+        # which is written after the first block ending the archive.
+        size = path.stat().st_size
+        with path.open("r+b") as f:
+            f.seek(size - BLOCK_SIZE)
+            f.write(b"partial data")
+        with path.with_suffix(INDEX_EXTENSION).open("a") as f:
+            f.write('{"key": "c"')
+        with tarfile.open(path) as tar:
+            self.assertEqual(
+                tar.getnames(), ["a.jpg", "a.json", "b.jpg", "b.json"])
+        self.assertEqual(read_shard_keys(SHARDS_FOLDER), {"a", "b"})
+        self.assertEqual(read_shard_keys(SHARDS_FOLDER, "views"), set())
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,115 @@
+"""Unit Tests the stats.py module."""
+import threading
+import unittest
+
+import __init__
+from cache import PanoramaCache
+from mock_server import MockServerSettings, mock_api
+from panorama import PanoramaSettings, get_panorama, get_tiles, iter_tiles
+from stats import *
+
+
+class Test_stats(unittest.TestCase):
+
+    def test_Stats(self) -> None:
+        stats = Stats()
+        stats.add_stage(STAGE_DECODE, 0.5, 0.25)
+        stats.add_stage(STAGE_DECODE, 0.5, 0.25)
+        stats.add(RETRIES)
+        stats.add(BYTES_DOWNLOADED, 100)
+        self.assertEqual(stats.stages[STAGE_DECODE], StageStats(2, 1, 0.5))
+        self.assertEqual(stats.counters[BYTES_DOWNLOADED], 100)
+        total = Stats()
+        total.merge(stats)
+        total.merge(stats)
+        self.assertEqual(
+            total.to_dict()["stages"][STAGE_DECODE],
+            {"calls": 4, "wall_time": 2, "cpu_time": 1})
+        self.assertEqual(total.counters[RETRIES], 2)
+        self.assertIn("decode", str(total))
+        total.reset()
+        self.assertEqual(total.stages, {})
+        self.assertEqual(total.counters[RETRIES], 0)
+
+    def test_collect(self) -> None:
+        # Nothing is recorded while no stats are active.
+        self.assertIsNone(get_stats())
+        with stage(STAGE_ENCODE):
+            count(RETRIES)
+        process_stats = Stats()
+        set_stats(process_stats)
+        try:
+            with collect() as outer:
+                with collect() as inner:
+                    with stage(STAGE_ENCODE):
+                        count(RETRIES)
+                count(RETRIES)
+            # Threads do not inherit the context, but record process-wide.
+            thread = threading.Thread(target=count, args=(RETRIES,))
+            thread.start()
+            thread.join()
+        finally:
+            set_stats(None)
+        self.assertEqual(inner.counters[RETRIES], 1)
+        self.assertEqual(inner.stages[STAGE_ENCODE].calls, 1)
+        self.assertEqual(outer.counters[RETRIES], 2)
+        self.assertEqual(process_stats.counters[RETRIES], 3)
+
+    def test_get_panorama_stats_mock(self) -> None:
+        settings = PanoramaSettings(zoom=2)
+        cache = PanoramaCache()
+        with mock_api():
+            with collect() as stats:
+                tiles = get_tiles("t"*22, settings, cache=cache)
+                get_panorama("t"*22, settings, cache=cache)
+        self.assertEqual(
+            set(stats.stages),
+            {STAGE_DOWNLOAD, STAGE_DECODE, STAGE_PASTE, STAGE_CROP,
+                STAGE_ENCODE})
+        self.assertEqual(stats.stages[STAGE_DECODE].calls, 8)
+        self.assertEqual(stats.counters[TILES_DOWNLOADED], 8)
+        self.assertEqual(stats.counters[TILES_CACHED], 8)
+        self.assertEqual(
+            stats.counters[BYTES_DOWNLOADED], sum(map(len, sum(tiles, []))))
+        # 8 tiles, 2 rows and the stitched image (2048x1024 pixels).
+        self.assertGreaterEqual(
+            stats.counters[BYTES_ALLOCATED], 3 * 2048 * 1024 * 3)
+
+    def test_iter_tiles_stats_mock(self) -> None:
+        # Tiles are downloaded on a background thread.
+        with mock_api(), collect() as stats:
+            list(iter_tiles("i"*22, PanoramaSettings(zoom=1)))
+        self.assertEqual(stats.counters[TILES_DOWNLOADED], 2)
+
+    def test_retries_stats_mock(self) -> None:
+        with mock_api(MockServerSettings(error_rate=1)), collect() as stats:
+            with self.assertRaises(Exception):
+                get_tiles("r"*22, use_async=False)
+        self.assertEqual(stats.counters[RETRIES], 2)
+        self.assertEqual(stats.counters[TILES_DOWNLOADED], 0)
+
+    def test_in_flight_stats_mock(self) -> None:
+        peaks = []
+
+        class PeakStats(Stats):
+            # Records the tiles in flight after each change.
+            def add(self, counter: str, value: int = 1) -> None:
+                super().add(counter, value)
+                if counter == TILES_IN_FLIGHT:
+                    peaks.append(self.counters[counter])
+
+        for use_async in (True, False):
+            peaks.clear()
+            with mock_api(), collect(PeakStats()) as stats:
+                get_tiles("f"*22, PanoramaSettings(zoom=1), use_async)
+            self.assertEqual(stats.counters[TILES_IN_FLIGHT], 0)
+            self.assertEqual(len(peaks), 4)
+            self.assertGreaterEqual(max(peaks), 1)
+        with mock_api(MockServerSettings(error_rate=1)), collect() as stats:
+            with self.assertRaises(Exception):
+                get_tiles("r"*22, use_async=False)
+        self.assertEqual(stats.counters[TILES_IN_FLIGHT], 0)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,60 @@
+"""Unit Tests the streaming.py module."""
+import io
+import unittest
+
+from __init__ import TEST_OUTPUT_FOLDER
+from mock_server import MockServerSettings, mock_api
+from panorama import get_pil_panorama
+from stats import collect
+from streaming import *
+
+
+class Test_streaming(unittest.TestCase):
+
+    def test_write_panorama(self) -> None:
+        self.assertRaises(
+            ValueError, write_panorama, "a"*22, io.BytesIO(),
+            image_format="png")
+        with mock_api(MockServerSettings(extent=(1.0, 0.6))):
+            settings = PanoramaSettings(zoom=2, top_left=(1, 0))
+            expected = get_pil_panorama(
+                "f"*22, settings, crop_black_edges=False)
+            for image_format in (TIFF, PPM):
+                with io.BytesIO() as f:
+                    write_panorama("f"*22, f, settings, image_format)
+                    f.seek(0)
+                    image = Image.open(f)
+                    self.assertEqual(image.size, (1536, 1024))
+                    self.assertEqual(image.tobytes(), expected.tobytes())
+            with io.BytesIO() as f:
+                write_panorama("f"*22, f, PanoramaSettings(0), RAW)
+                self.assertEqual(len(f.getvalue()), TILE_SIZE)
+            # Full zoom 5 widths exceed the get_pil_panorama limits.
+            path = TEST_OUTPUT_FOLDER / "zoom_5.tiff"
+            write_panorama(
+                "f"*22, path, PanoramaSettings(5, (0, 8), (32, 11)))
+            with Image.open(path) as image:
+                self.assertEqual(image.size, (16384, 1536))
+                # Below the extent, so black.
+                self.assertEqual(image.getpixel((16000, 1500)), (0, 0, 0))
+
+    def test_write_panorama_skip_black_tiles(self) -> None:
+        # Content in the top 3 of 8 zoom 4 rows, plus a row of margin.
+        server_settings = MockServerSettings(extent=(1.0, 0.3))
+        settings = PanoramaSettings(4, (0, 0), (4, 8))
+        with mock_api(server_settings):
+            with io.BytesIO() as f:
+                write_panorama("k"*22, f, settings, RAW)
+                expected = f.getvalue()
+            self.assertEqual(len(server_settings.requests), 32)
+            with io.BytesIO() as f, collect() as stats:
+                write_panorama(
+                    "k"*22, f, settings, RAW, skip_black_tiles=True)
+                self.assertEqual(f.getvalue(), expected)
+            # The zoom 0 probe and 4 rows of 4 tiles.
+            self.assertEqual(len(server_settings.requests), 32 + 1 + 16)
+            self.assertEqual(stats.counters[TILES_SKIPPED], 16)
+
+
+if __name__ == "__main__":
+    unittest.main()
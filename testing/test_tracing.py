@@ -0,0 +1,79 @@
+"""Unit Tests the tracing.py module."""
+import json
+import threading
+import unittest
+
+from __init__ import TEST_OUTPUT_FOLDER
+from mock_server import mock_api
+from panorama import PanoramaSettings, get_panorama
+from stats import get_observers
+from tracing import *
+
+
+class Test_tracing(unittest.TestCase):
+
+    def test_Tracer(self) -> None:
+        self.assertRaises(ValueError, Tracer, 0)
+        # Nothing is recorded while no tracer is started.
+        tracer = Tracer(capacity=3)
+        with trace_async("idle"):
+            pass
+        self.assertEqual(tracer.recorded, 0)
+        with tracer:
+            self.assertIn(tracer, get_tracers())
+            self.assertIn(tracer, get_observers())
+            for i in range(2):
+                with trace_async("request", i=i):
+                    pass
+        self.assertNotIn(tracer, get_tracers())
+        self.assertNotIn(tracer, get_observers())
+        # The oldest event was dropped.
+        self.assertEqual((tracer.recorded, tracer.dropped), (4, 1))
+        events = [
+            event for event in tracer.to_dict()["traceEvents"]
+            if event["ph"] != "M"]
+        self.assertEqual(
+            [(event["ph"], event["id"]) for event in events],
+            [("e", 0), ("b", 1), ("e", 1)])
+        self.assertEqual(events[1]["args"], {"i": 1})
+
+    def test_Tracer_threads(self) -> None:
+        with Tracer() as tracer:
+            tracer.add_complete("native", CATEGORY_NATIVE, 0, 0, None, 1)
+            tracer.add_complete("python", CATEGORY_NATIVE, 0, 0)
+        names = {
+            event["tid"]: event["args"]["name"]
+            for event in tracer.to_dict()["traceEvents"]
+            if event["ph"] == "M"}
+        # Only the thread recording its own events is named.
+        self.assertEqual(
+            names, {threading.get_ident(): threading.current_thread().name})
+
+    def test_trace_panorama_mock(self) -> None:
+        with mock_api(), Tracer() as tracer:
+            get_panorama("t"*22, PanoramaSettings(2))
+        path = TEST_OUTPUT_FOLDER / "trace.json"
+        tracer.save(path)
+        trace = json.loads(path.read_text())
+        events = trace["traceEvents"]
+        self.assertEqual(trace["otherData"]["dropped"], 0)
+        tiles = [event for event in events if event["name"] == "tile"]
+        self.assertEqual(
+            sorted(event["ph"] for event in tiles), ["b"] * 8 + ["e"] * 8)
+        self.assertEqual(len({event["id"] for event in tiles}), 8)
+        stages = {
+            event["name"] for event in events
+            if event["ph"] == "X" and event["cat"] == CATEGORY_STAGE}
+        self.assertEqual(
+            stages, {"download", "decode", "paste", "crop", "encode"})
+        # Threads are named, and events lie within the trace.
+        threads = {
+            event["tid"] for event in events if event["ph"] == "M"}
+        for event in events:
+            self.assertIn(event["tid"], threads)
+            if event["ph"] != "M":
+                self.assertGreaterEqual(event["ts"], 0)
+
+
+if __name__ == "__main__":
+    unittest.main()